@@ -0,0 +1,93 @@
+/*
+  Ethernet Modbus TCP Gateway
+
+  This sketch creates a Modbus TCP to RTU gateway: the requests of the
+  TCP clients for the unit ids 1 to 247 are forwarded to the slaves of
+  the same ids on the RS485 bus.
+
+  Circuit:
+   - Any Arduino MKR Board
+   - MKR ETH Shield
+   - MKR 485 Shield
+     - ISO GND connected to GND of the Modbus RTU slaves
+     - Y connected to A/Y of the Modbus RTU slaves
+     - Z connected to B/Z of the Modbus RTU slaves
+     - Jumper positions
+       - FULL set to OFF
+       - Z \/\/ Y set to ON
+*/
+
+#include <SPI.h>
+#include <Ethernet.h>
+
+#include <ArduinoRS485.h> // ArduinoModbus depends on the ArduinoRS485 library
+#include <ArduinoModbus.h>
+
+// Enter a MAC address for your controller below.
+// Newer Ethernet shields have a MAC address printed on a sticker on the shield
+// The IP address will be dependent on your local network:
+byte mac[] = {
+  0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED
+};
+IPAddress ip(192, 168, 1, 177);
+
+EthernetServer ethServer(502);
+
+ModbusTCPGateway modbusTCPGateway;
+
+// the number of clients served at once
+const int maxClients = 4;
+
+void setup() {
+  Serial.begin(9600);
+  while (!Serial) {
+    ; // wait for serial port to connect. Needed for native USB port only
+  }
+  Serial.println("Ethernet Modbus TCP Gateway");
+
+  // start the Ethernet connection and the server:
+  Ethernet.begin(mac, ip);
+
+  if (Ethernet.hardwareStatus() == EthernetNoHardware) {
+    Serial.println("Ethernet shield was not found.  Sorry, can't run without hardware. :(");
+    while (true) {
+      delay(1); // do nothing, no point running without Ethernet hardware
+    }
+  }
+
+  ethServer.begin();
+
+  // start the Modbus RTU client of the bus, the slaves which don't respond
+  // within 200 ms are reported to the TCP clients with exception 0x0B
+  if (!ModbusRTUClient.begin(9600)) {
+    Serial.println("Failed to start Modbus RTU Client!");
+    while (1);
+  }
+  ModbusRTUClient.setTimeout(200);
+
+  // start the gateway, with 4 requests queued on the bus at most
+  if (!modbusTCPGateway.begin(0xff, maxClients, 4)) {
+    Serial.println("Failed to start Modbus TCP Gateway!");
+    while (1);
+  }
+
+  // forward the unit ids 1 to 247 to the slaves of the same ids
+  modbusTCPGateway.route(ModbusRTUClient, 1, 247);
+}
+
+void loop() {
+  EthernetClient client = ethServer.accept();
+
+  if (client) {
+    // the gateway serves its own copy of the client
+    if (modbusTCPGateway.accept(client)) {
+      Serial.println("new client");
+    } else {
+      client.stop();
+    }
+  }
+
+  // receive the requests of the clients and the responses of the slaves,
+  // without waiting on any of them
+  modbusTCPGateway.poll();
+}
@@ -0,0 +1,74 @@
+/*
+  Client of the tests: the bytes received are queued in rx by the test and the
+  ones sent are appended to tx. The copies share the same connection, like
+  the clients of the network libraries.
+*/
+
+#ifndef _MOCK_CLIENT_H_INCLUDED
+#define _MOCK_CLIENT_H_INCLUDED
+
+#include <Client.h>
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+struct MockConnection {
+  std::deque<uint8_t> rx;
+  std::vector<uint8_t> tx;
+  bool up = true;
+};
+
+class MockClient : public Client {
+public:
+  MockClient() : MockClient(std::make_shared<MockConnection>()) {}
+  MockClient(const MockClient& other) : MockClient(other.connection) {}
+
+  std::deque<uint8_t>& rx;
+  std::vector<uint8_t>& tx;
+  bool& up;
+
+  int connect(IPAddress, uint16_t) { return 1; }
+  size_t write(uint8_t c) { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) {
+    tx.insert(tx.end(), buffer, buffer + size);
+    return size;
+  }
+  int available() { return rx.size(); }
+  int read() {
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+  }
+  int read(uint8_t *buffer, size_t size) {
+    size_t i = 0;
+    if (rx.empty()) {
+      return -1;
+    }
+    for (; i < size && !rx.empty(); i++) {
+      buffer[i] = rx.front();
+      rx.pop_front();
+    }
+    return i;
+  }
+  int peek() { return rx.empty() ? -1 : rx.front(); }
+  void flush() {}
+  void stop() { up = false; }
+  uint8_t connected() { return up; }
+  operator bool() { return up; }
+  bool operator==(const MockClient& other) const {
+    return connection == other.connection;
+  }
+
+private:
+  MockClient(std::shared_ptr<MockConnection> connection) :
+    rx(connection->rx),
+    tx(connection->tx),
+    up(connection->up),
+    connection(connection)
+  {
+  }
+
+  std::shared_ptr<MockConnection> connection;
+};
+
+#endif
@@ -0,0 +1,72 @@
+/*
+  Client of the tests over a socket accepted on the loopback. The copies share
+  the same socket, like the clients of the network libraries; it's closed by
+  stop() or with the last copy.
+*/
+
+#ifndef _SOCKET_CLIENT_H_INCLUDED
+#define _SOCKET_CLIENT_H_INCLUDED
+
+#include <Client.h>
+
+#include <memory>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+struct SocketConnection {
+  int s;
+
+  ~SocketConnection() {
+    if (s != -1) {
+      close(s);
+    }
+  }
+};
+
+class SocketClient : public Client {
+public:
+  SocketClient(int s) : connection(new SocketConnection { s }) {}
+
+  int connect(IPAddress, uint16_t) { return 0; }
+  size_t write(uint8_t c) { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) {
+    ssize_t n = send(connection->s, buffer, size, MSG_NOSIGNAL);
+    return n < 0 ? 0 : n;
+  }
+  int available() {
+    int n = 0;
+    ioctl(connection->s, FIONREAD, &n);
+    return n;
+  }
+  int read() {
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+  }
+  int read(uint8_t *buffer, size_t size) {
+    ssize_t n = recv(connection->s, buffer, size, MSG_DONTWAIT);
+    return n <= 0 ? -1 : n;
+  }
+  int peek() { return -1; }
+  void flush() {}
+  void stop() {
+    if (connection->s != -1) {
+      close(connection->s);
+      connection->s = -1;
+    }
+  }
+  uint8_t connected() {
+    char c;
+    return connection->s != -1 &&
+           recv(connection->s, &c, 1, MSG_PEEK | MSG_DONTWAIT) != 0;
+  }
+  operator bool() { return connection->s != -1; }
+  bool operator==(const SocketClient& other) const {
+    return connection == other.connection;
+  }
+
+private:
+  std::shared_ptr<SocketConnection> connection;
+};
+
+#endif
@@ -0,0 +1,125 @@
+/*
+  Dispatch of the requests to their handler: modbus_reply_build() on a mix
+  of function codes (read coils, read and write registers, write coils, an
+  unknown code), then the dispatch alone through a table of handlers and
+  through a switch as modbus_reply() used to do, with the same empty
+  handlers
+*/
+
+#include <chrono>
+#include <stdio.h>
+#include <vector>
+
+extern "C" {
+#include "modbus-tcp.h"
+}
+
+static const int ROUNDS = 1000000;
+
+static double nsPer(std::chrono::steady_clock::time_point start, long nb)
+{
+  return std::chrono::duration<double, std::nano>(
+           std::chrono::steady_clock::now() - start).count() / nb;
+}
+
+static std::vector<uint8_t> request(std::vector<uint8_t> pdu)
+{
+  std::vector<uint8_t> adu = { 0, 1, 0, 0, 0, (uint8_t)(pdu.size() + 1),
+                               MODBUS_TCP_SLAVE };
+
+  adu.insert(adu.end(), pdu.begin(), pdu.end());
+  return adu;
+}
+
+static volatile int sink;
+
+__attribute__((noinline)) static int handleRead(const uint8_t *pdu) { return pdu[1]; }
+__attribute__((noinline)) static int handleWriteOne(const uint8_t *pdu) { return pdu[2]; }
+__attribute__((noinline)) static int handleWriteMany(const uint8_t *pdu) { return pdu[3]; }
+__attribute__((noinline)) static int handleUnknown(const uint8_t *pdu) { return -pdu[0]; }
+
+static int (*const table[MODBUS_FC_WRITE_AND_READ_REGISTERS + 1])(const uint8_t *) = {
+  handleUnknown, handleRead, handleRead, handleRead, handleRead,
+  handleWriteOne, handleWriteOne, handleUnknown, handleUnknown, handleUnknown,
+  handleUnknown, handleUnknown, handleUnknown, handleUnknown, handleUnknown,
+  handleWriteMany, handleWriteMany, handleUnknown, handleUnknown,
+  handleUnknown, handleUnknown, handleUnknown, handleWriteOne, handleWriteMany
+};
+
+static int dispatchTable(const uint8_t *pdu)
+{
+  return pdu[0] < sizeof(table) / sizeof(table[0]) ? table[pdu[0]](pdu) :
+                                                     handleUnknown(pdu);
+}
+
+static int dispatchSwitch(const uint8_t *pdu)
+{
+  switch (pdu[0]) {
+  case MODBUS_FC_READ_COILS:
+  case MODBUS_FC_READ_DISCRETE_INPUTS:
+  case MODBUS_FC_READ_HOLDING_REGISTERS:
+  case MODBUS_FC_READ_INPUT_REGISTERS:
+    return handleRead(pdu);
+  case MODBUS_FC_WRITE_SINGLE_COIL:
+  case MODBUS_FC_WRITE_SINGLE_REGISTER:
+  case MODBUS_FC_MASK_WRITE_REGISTER:
+    return handleWriteOne(pdu);
+  case MODBUS_FC_WRITE_MULTIPLE_COILS:
+  case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+  case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+    return handleWriteMany(pdu);
+  default:
+    return handleUnknown(pdu);
+  }
+}
+
+int main()
+{
+  modbus_t *ctx = modbus_new_tcp("127.0.0.1", 0);
+  modbus_mapping_t *map = modbus_mapping_new(100, 0, 100, 0);
+  std::vector<std::vector<uint8_t>> mix = {
+    request({ MODBUS_FC_READ_COILS, 0, 0, 0, 16 }),
+    request({ MODBUS_FC_READ_HOLDING_REGISTERS, 0, 0, 0, 10 }),
+    request({ MODBUS_FC_WRITE_SINGLE_REGISTER, 0, 1, 0x12, 0x34 }),
+    request({ MODBUS_FC_WRITE_SINGLE_COIL, 0, 2, 0xFF, 0 }),
+    request({ MODBUS_FC_WRITE_MULTIPLE_REGISTERS, 0, 3, 0, 2, 4, 1, 2, 3, 4 }),
+    request({ MODBUS_FC_WRITE_MULTIPLE_COILS, 0, 8, 0, 8, 1, 0x55 }),
+    request({ MODBUS_FC_READ_INPUT_REGISTERS, 0, 0, 0, 1 }),
+    request({ 0x41, 1, 2, 3 })
+  };
+  uint8_t response[MODBUS_TCP_MAX_ADU_LENGTH];
+  long nb = (long)ROUNDS * mix.size();
+
+  for (const std::vector<uint8_t> &adu : mix) {
+    if (modbus_reply_build(ctx, adu.data(), adu.size(), map, response) <= 0) {
+      printf("no response to function 0x%02X\n", adu[7]);
+      return 1;
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < ROUNDS; i++) {
+    for (const std::vector<uint8_t> &adu : mix) {
+      sink = modbus_reply_build(ctx, adu.data(), adu.size(), map, response);
+    }
+  }
+  printf("modbus_reply_build() %6.1f ns/request\n", nsPer(start, nb));
+
+  for (int (*dispatch)(const uint8_t *) : { dispatchTable, dispatchSwitch }) {
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < ROUNDS * 10; i++) {
+      for (const std::vector<uint8_t> &adu : mix) {
+        sink = dispatch(&adu[7]);
+      }
+    }
+    printf("%-20s %6.2f ns/request\n",
+           dispatch == dispatchTable ? "table dispatch" : "switch dispatch",
+           nsPer(start, nb * 10));
+  }
+
+  modbus_free(ctx);
+  modbus_mapping_free(map);
+
+  return 0;
+}
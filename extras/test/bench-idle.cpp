@@ -0,0 +1,73 @@
+/*
+  CPU time spent by a client waiting for a response which never comes,
+  spinning on the stream or calling an idle callback which sleeps like the
+  default one of Mbed OS boards
+*/
+
+#include <ArduinoModbus.h>
+
+#include "MockClient.h"
+
+#include <sched.h>
+#include <time.h>
+
+static const int REQUESTS = 5;
+
+static double cpuMs()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* modbus_idle_default() on Mbed OS, with a tick of 1 ms */
+static void mbedIdle(modbus_t *, unsigned long remaining_us)
+{
+  if (remaining_us >= 2000) {
+    delay(1);
+  } else {
+    sched_yield();
+  }
+}
+
+static void bench(const char *name, ModbusClient &client)
+{
+  struct {
+    const char *name;
+    modbus_idle_cb_t callback;
+  } modes[] = {
+    { "spin", NULL },
+    { "idle callback", mbedIdle },
+  };
+
+  client.setTimeout(200);
+  for (auto &mode : modes) {
+    unsigned long start = millis();
+    double cpu = cpuMs();
+
+    client.setIdleCallback(mode.callback);
+    for (int i = 0; i < REQUESTS; i++) {
+      client.holdingRegisterRead(1, 0);
+    }
+    printf("%-4s %-14s %6.1f ms CPU per timed-out request (%lu ms)\n", name,
+           mode.name, (cpuMs() - cpu) / REQUESTS,
+           (millis() - start) / REQUESTS);
+  }
+}
+
+int main()
+{
+  MockClient socket;
+  ModbusTCPClient tcpClient(socket);
+
+  tcpClient.begin(IPAddress(192, 168, 1, 1));
+  bench("TCP", tcpClient);
+  tcpClient.end();
+
+  ModbusRTUClient.begin(9600);
+  bench("RTU", ModbusRTUClient);
+  ModbusRTUClient.end();
+
+  return 0;
+}
@@ -0,0 +1,125 @@
+/*
+  Reception of whole ADUs (MODBUS_RECEIVE_ADU) against the stepwise reads
+  (MODBUS_RECEIVE_STEPWISE) on the loopback: recv() and select() calls per
+  transaction, on the server and on the client, and transactions per second.
+  The transactions alternate reads and writes of 10 holding registers.
+  The calls of the library are counted by wrapping the libc ones.
+*/
+
+#include <atomic>
+#include <chrono>
+#include <dlfcn.h>
+#include <stdio.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+extern "C" {
+#include "modbus-tcp.h"
+}
+
+static const int PORT = 15040;
+static const int TRANSACTIONS = 20000;
+
+/* Calls per side, the server counts as side 1 */
+static thread_local int side;
+static std::atomic<long> recvs[2];
+static std::atomic<long> selects[2];
+
+extern "C" ssize_t recv(int s, void *buffer, size_t length, int flags)
+{
+  static auto next = (ssize_t (*)(int, void *, size_t, int))dlsym(RTLD_NEXT, "recv");
+
+  recvs[side]++;
+  return next(s, buffer, length, flags);
+}
+
+extern "C" int select(int nfds, fd_set *rset, fd_set *wset, fd_set *eset,
+                      struct timeval *tv)
+{
+  static auto next = (int (*)(int, fd_set *, fd_set *, fd_set *,
+                              struct timeval *))dlsym(RTLD_NEXT, "select");
+
+  selects[side]++;
+  return next(nfds, rset, wset, eset, tv);
+}
+
+static std::atomic<bool> listening;
+
+static void serve(int port, modbus_receive_mode mode)
+{
+  modbus_t *ctx = modbus_new_tcp("127.0.0.1", port);
+  modbus_mapping_t *map = modbus_mapping_new(0, 0, 100, 0);
+  uint8_t request[MODBUS_TCP_MAX_ADU_LENGTH];
+  int ls;
+  int rc;
+
+  side = 1;
+  modbus_set_receive_mode(ctx, mode);
+  ls = modbus_tcp_listen(ctx, 1);
+  listening = true;
+  modbus_tcp_accept(ctx, &ls);
+
+  while ((rc = modbus_receive(ctx, request)) != -1) {
+    if (rc > 0) {
+      modbus_reply(ctx, request, rc, map);
+    }
+  }
+
+  close(ls);
+  modbus_close(ctx);
+  modbus_free(ctx);
+  modbus_mapping_free(map);
+}
+
+int main()
+{
+  int port = PORT;
+
+  for (modbus_receive_mode mode : { MODBUS_RECEIVE_STEPWISE, MODBUS_RECEIVE_ADU }) {
+    const char *name = mode == MODBUS_RECEIVE_ADU ? "adu" : "stepwise";
+    modbus_t *ctx = modbus_new_tcp("127.0.0.1", port);
+    uint16_t registers[10];
+    double elapsed;
+
+    listening = false;
+    std::thread server(serve, port++, mode);
+    while (!listening) {
+      usleep(1000);
+    }
+    modbus_set_receive_mode(ctx, mode);
+    if (modbus_connect(ctx) == -1) {
+      perror("modbus_connect");
+      return 1;
+    }
+
+    for (int i = 0; i < 2; i++) {
+      recvs[i] = selects[i] = 0;
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < TRANSACTIONS; i++) {
+      int rc = (i & 1) ? modbus_write_registers(ctx, i % 90, 10, registers) :
+                         modbus_read_registers(ctx, i % 90, 10, registers);
+
+      if (rc != 10) {
+        perror("modbus_read_registers/modbus_write_registers");
+        return 1;
+      }
+    }
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                            start).count();
+
+    printf("%-8s server %.2f recv %.2f select, client %.2f recv %.2f select "
+           "per transaction, %.0f transactions/s\n", name,
+           (double)recvs[1] / TRANSACTIONS, (double)selects[1] / TRANSACTIONS,
+           (double)recvs[0] / TRANSACTIONS, (double)selects[0] / TRANSACTIONS,
+           TRANSACTIONS / elapsed);
+
+    modbus_close(ctx);
+    modbus_free(ctx);
+    server.join();
+  }
+
+  return 0;
+}
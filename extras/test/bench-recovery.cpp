@@ -0,0 +1,122 @@
+/*
+  Recovery of the server from an invalid request on the loopback: the
+  latency of invalid requests (a read of 0 registers) interleaved with
+  valid ones, when the rest of the bad request is only discarded
+  (MODBUS_EXCEPTION_RECOVERY_DISCARD) and when the server sleeps its
+  response timeout and flushes the socket (MODBUS_EXCEPTION_RECOVERY_FLUSH)
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+extern "C" {
+#include "modbus-tcp.h"
+}
+
+static const int PORT = 15044;
+static const int PAIRS = 20;
+/* Response timeout of the server, slept on flush */
+static const int TIMEOUT_MS = 50;
+
+static std::atomic<bool> listening;
+
+static void serve(int port, modbus_exception_recovery_mode recovery)
+{
+  modbus_t *ctx = modbus_new_tcp("127.0.0.1", port);
+  modbus_mapping_t *map = modbus_mapping_new(0, 0, 100, 0);
+  uint8_t request[MODBUS_TCP_MAX_ADU_LENGTH];
+  int ls;
+  int rc;
+
+  modbus_set_exception_recovery(ctx, recovery);
+  modbus_set_response_timeout(ctx, 0, TIMEOUT_MS * 1000);
+  ls = modbus_tcp_listen(ctx, 1);
+  listening = true;
+  modbus_tcp_accept(ctx, &ls);
+
+  while ((rc = modbus_receive(ctx, request)) != -1) {
+    if (rc > 0) {
+      modbus_reply(ctx, request, rc, map);
+    }
+  }
+
+  close(ls);
+  modbus_close(ctx);
+  modbus_free(ctx);
+  modbus_mapping_free(map);
+}
+
+static double now()
+{
+  return std::chrono::duration<double, std::micro>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double median(std::vector<double> &latencies)
+{
+  std::sort(latencies.begin(), latencies.end());
+  return latencies[latencies.size() / 2];
+}
+
+int main()
+{
+  int port = PORT;
+
+  printf("server response timeout %d ms\n", TIMEOUT_MS);
+  for (modbus_exception_recovery_mode recovery :
+       { MODBUS_EXCEPTION_RECOVERY_DISCARD, MODBUS_EXCEPTION_RECOVERY_FLUSH }) {
+    const char *name = recovery == MODBUS_EXCEPTION_RECOVERY_DISCARD ?
+                       "discard" : "flush";
+    modbus_t *ctx = modbus_new_tcp("127.0.0.1", port);
+    /* Read 0 holding registers from 0 */
+    uint8_t invalid[] = { MODBUS_TCP_SLAVE, MODBUS_FC_READ_HOLDING_REGISTERS,
+                          0, 0, 0, 0 };
+    uint8_t response[MODBUS_TCP_MAX_ADU_LENGTH];
+    uint16_t registers[10];
+    std::vector<double> bad;
+    std::vector<double> good;
+
+    listening = false;
+    std::thread server(serve, port++, recovery);
+    while (!listening) {
+      usleep(1000);
+    }
+    if (modbus_connect(ctx) == -1) {
+      perror("modbus_connect");
+      return 1;
+    }
+
+    for (int i = 0; i < PAIRS; i++) {
+      double start = now();
+
+      if (modbus_send_raw_request(ctx, invalid, sizeof(invalid)) == -1 ||
+          modbus_receive_confirmation(ctx, response) == -1 ||
+          response[7] != (MODBUS_FC_READ_HOLDING_REGISTERS | 0x80)) {
+        perror("invalid request");
+        return 1;
+      }
+      bad.push_back(now() - start);
+
+      start = now();
+      if (modbus_read_registers(ctx, 0, 10, registers) != 10) {
+        perror("modbus_read_registers");
+        return 1;
+      }
+      good.push_back(now() - start);
+    }
+
+    printf("%-7s invalid %8.0f us, valid %5.0f us (medians)\n", name,
+           median(bad), median(good));
+
+    modbus_close(ctx);
+    modbus_free(ctx);
+    server.join();
+  }
+
+  return 0;
+}
@@ -0,0 +1,87 @@
+/*
+  Sequence lock of the tables of the host build: reads of 125 holding
+  registers per second and the share of them copied again, with 0 to 2
+  threads updating the table meanwhile. The figures with writers depend on
+  the number of cores.
+*/
+
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "modbus.h"
+}
+
+static const int REGISTERS = 125;
+static const double SECONDS = 1;
+
+static modbus_mapping_t *map;
+static std::atomic<bool> stop;
+static std::atomic<long> writes;
+/* Outside of main() so the copies aren't optimized out */
+static uint16_t copy[REGISTERS];
+
+static void writeTable()
+{
+  long nb = 0;
+
+  for (uint16_t i = 0; !stop; i++, nb++) {
+    modbus_mapping_write_begin(map, MODBUS_TABLE_REGISTERS);
+    for (int j = 0; j < REGISTERS; j++) {
+      map->tab_registers[j] = i;
+    }
+    modbus_mapping_write_end(map, MODBUS_TABLE_REGISTERS);
+  }
+  writes += nb;
+}
+
+int main()
+{
+  map = modbus_mapping_new(0, 0, REGISTERS, 0);
+
+  printf("%u cores\n", std::thread::hardware_concurrency());
+  for (int nb_writers = 0; nb_writers <= 2; nb_writers++) {
+    std::vector<std::thread> writers;
+    long reads = 0;
+    long retries = 0;
+    auto start = std::chrono::steady_clock::now();
+    double elapsed;
+
+    stop = false;
+    writes = 0;
+    for (int i = 0; i < nb_writers; i++) {
+      writers.emplace_back(writeTable);
+    }
+    do {
+      for (int i = 0; i < 1000; i++) {
+        unsigned int sequence = modbus_mapping_read_begin(map, MODBUS_TABLE_REGISTERS);
+
+        memcpy(copy, map->tab_registers, sizeof(copy));
+        while (modbus_mapping_read_retry(map, MODBUS_TABLE_REGISTERS, sequence)) {
+          sequence = modbus_mapping_read_begin(map, MODBUS_TABLE_REGISTERS);
+          memcpy(copy, map->tab_registers, sizeof(copy));
+          retries++;
+        }
+        reads++;
+      }
+      elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                              start).count();
+    } while (elapsed < SECONDS);
+    stop = true;
+    for (std::thread &writer : writers) {
+      writer.join();
+    }
+
+    printf("%d writers: %9.0f reads/s, %5.2f%% copied again, %9.0f writes/s\n",
+           nb_writers, reads / elapsed, 100.0 * retries / reads,
+           writes / elapsed);
+  }
+
+  modbus_mapping_free(map);
+
+  return 0;
+}
@@ -0,0 +1,112 @@
+/*
+  Server engines of the Linux host build on the loopback: epoll
+  (modbus_tcp_server_new()) against io_uring (modbus_tcp_server_new_uring()),
+  in requests per second, latencies and CPU time of the server thread per
+  request
+*/
+
+#include "load.h"
+
+#include <atomic>
+#include <errno.h>
+#include <string.h>
+#include <thread>
+#include <time.h>
+
+extern "C" {
+#include "modbus-tcp.h"
+}
+
+static const int PORT = 15032;
+static const int SECONDS = 2;
+
+static std::atomic<bool> listening;
+static std::atomic<bool> stop;
+static int error;
+static double cpu;
+
+static double threadCpu()
+{
+  timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Serves until stop, sets cpu to the CPU time of the thread per request in
+   us or error to errno when the server can't be created */
+static void serve(int port, int nb, bool uring)
+{
+  modbus_t *ctx = modbus_new_tcp("127.0.0.1", port);
+  modbus_mapping_t *map = modbus_mapping_new(0, 0, 100, 0);
+  modbus_tcp_server_t *server;
+  long served = 0;
+  double start;
+  int ls;
+
+  for (int i = 0; i < 100; i++) {
+    map->tab_registers[i] = i;
+  }
+  ls = modbus_tcp_listen(ctx, 8192);
+  server = uring ? modbus_tcp_server_new_uring(ctx, ls, nb) :
+                   modbus_tcp_server_new(ctx, ls, nb);
+  error = (server == NULL) ? errno : 0;
+  listening = true;
+
+  if (server != NULL) {
+    start = threadCpu();
+    while (!stop) {
+      int rc = modbus_tcp_server_poll(server, map, 10);
+
+      if (rc > 0) {
+        served += rc;
+      }
+    }
+    cpu = served > 0 ? (threadCpu() - start) / served : 0;
+    modbus_tcp_server_free(server);
+  }
+
+  close(ls);
+  modbus_free(ctx);
+  modbus_mapping_free(map);
+}
+
+int main()
+{
+  const int connections[] = { 1, 100, 1000 };
+  int port = PORT;
+
+  for (int nb : connections) {
+    for (bool uring : { false, true }) {
+      LoadResult result;
+
+      listening = stop = false;
+      std::thread server(serve, port, nb, uring);
+      while (!listening) {
+        usleep(1000);
+      }
+      if (error != 0) {
+        printf("%-8s %4d connections: %s\n", uring ? "io_uring" : "epoll", nb,
+               strerror(error));
+        server.join();
+        continue;
+      }
+
+      result = load(port, nb, 1, SECONDS);
+      stop = true;
+      server.join();
+      port++;
+
+      if (result.bad != 0 || result.connections != nb) {
+        printf("%d connections, %d bad responses\n", result.connections,
+               result.bad);
+        return 1;
+      }
+      printf("%-8s %4d connections: %7.0f req/s, p99 %6u us, "
+             "server %.2f us CPU/request\n", uring ? "io_uring" : "epoll", nb,
+             result.rate, result.p99, cpu);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,64 @@
+/*
+  Scaling of the workers of the Linux host build (modbus_tcp_workers_new())
+  from 1 to 16 threads, each with its listening socket on the same port
+  (SO_REUSEPORT) and the mapping shared by all of them.
+
+  The clients run in the process, with as many threads as workers: the
+  figures only tell the scaling on a machine with at least twice more cores
+  than the largest number of workers.
+*/
+
+#include "load.h"
+
+#include <thread>
+
+extern "C" {
+#include "modbus-tcp.h"
+}
+
+static const int PORT = 15026;
+static const int CONNECTIONS = 2000;
+static const int SECONDS = 2;
+
+int main()
+{
+  modbus_mapping_t *map = modbus_mapping_new(0, 0, 100, 0);
+  int nb = loadLimit(CONNECTIONS);
+  int port = PORT;
+  double single = 0;
+
+  for (int i = 0; i < 100; i++) {
+    map->tab_registers[i] = i;
+  }
+
+  printf("%u cores, %d connections\n", std::thread::hardware_concurrency(),
+         nb);
+  for (int nb_workers = 1; nb_workers <= 16; nb_workers *= 2, port++) {
+    modbus_tcp_workers_t *workers = modbus_tcp_workers_new("127.0.0.1", port,
+                                                           nb_workers, nb);
+    LoadResult result;
+
+    if (workers == NULL || modbus_tcp_workers_start(workers, map) == -1) {
+      perror("modbus_tcp_workers_new");
+      return 1;
+    }
+    result = load(port, nb, nb_workers, SECONDS);
+    modbus_tcp_workers_free(workers);
+
+    if (result.bad != 0 || result.connections != nb) {
+      printf("%2d workers: %d connections, %d bad responses\n", nb_workers,
+             result.connections, result.bad);
+      return 1;
+    }
+    if (nb_workers == 1) {
+      single = result.rate;
+    }
+    printf("%2d workers: %7.0f req/s (x%.2f), p50 %6u us, p99 %6u us\n",
+           nb_workers, result.rate, result.rate / single, result.p50,
+           result.p99);
+  }
+
+  modbus_mapping_free(map);
+
+  return 0;
+}
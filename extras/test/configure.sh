@@ -0,0 +1,40 @@
+#!/bin/sh
+# Writes to $1 the config.h of the Linux host build of libmodbus, probing the
+# compiler $CC as the configure script of libmodbus does.
+
+out=$1
+CC=${CC:-gcc}
+
+# Defines $1 to 1 when the program $2 builds. Otherwise HAVE_DECL_ macros
+# are defined to 0 and the others left undefined, as autoconf does.
+probe() {
+    if printf '%s\n' "$2" | $CC -x c -o /dev/null - >/dev/null 2>&1; then
+        echo "#define $1 1"
+    else
+        case $1 in
+        HAVE_DECL_*) echo "#define $1 0" ;;
+        *) echo "/* #undef $1 */" ;;
+        esac
+    fi
+}
+
+{
+    echo "/* Generated by configure.sh */"
+    probe HAVE_ACCEPT4 '#define _GNU_SOURCE
+#include <sys/socket.h>
+int main(void) { return accept4(0, 0, 0, SOCK_CLOEXEC); }'
+    probe HAVE_BYTESWAP_H '#include <byteswap.h>
+int main(void) { return bswap_16(0); }'
+    probe HAVE_STRLCPY '#include <string.h>
+int main(void) { char s[2]; return strlcpy(s, "a", sizeof(s)); }'
+    probe HAVE_DECL_TIOCSRS485 '#include <sys/ioctl.h>
+int main(void) { return TIOCSRS485; }'
+    probe HAVE_DECL_TIOCM_RTS '#include <sys/ioctl.h>
+int main(void) { return TIOCM_RTS; }'
+    # The server engine needs the multishot operations and the ring of
+    # provided buffers of Linux 6.0
+    probe HAVE_LINUX_IO_URING_H '#include <linux/io_uring.h>
+int main(void) { struct io_uring_buf_ring *br = 0; (void)br;
+return IORING_RECV_MULTISHOT | IORING_ACCEPT_MULTISHOT |
+IORING_REGISTER_PBUF_RING | IORING_FEAT_EXT_ARG; }'
+} > "$out"
@@ -0,0 +1,206 @@
+/*
+  Loopback clients of the load tests and benchmarks of the Linux host
+  server: each connection sends its next request once answered
+*/
+
+#ifndef _LOAD_H_INCLUDED
+#define _LOAD_H_INCLUDED
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/* Length of the responses of loadRequest() */
+#define LOAD_RESPONSE_LENGTH 29
+
+struct LoadResult {
+  int connections;
+  double rate;
+  uint32_t p50;
+  uint32_t p99;
+  /* Responses not matching their request */
+  int bad;
+};
+
+static inline uint64_t loadNow()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline int loadConnect(int port)
+{
+  sockaddr_in address = {};
+  int option = 1;
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+  if (connect(s, (sockaddr *)&address, sizeof(address)) == -1) {
+    close(s);
+    return -1;
+  }
+  setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+  return s;
+}
+
+/* Read Holding Registers of 10 registers from t_id % 90, on registers
+   holding their address */
+static inline void loadRequest(uint8_t *frame, uint16_t t_id)
+{
+  const uint8_t header[] = { (uint8_t)(t_id >> 8), (uint8_t)t_id, 0, 0, 0, 6,
+                             0xFF, 3, 0, (uint8_t)(t_id % 90), 0, 10 };
+
+  std::copy(header, header + sizeof(header), frame);
+}
+
+static inline bool loadCheck(const uint8_t *response, uint16_t t_id)
+{
+  return ((response[0] << 8) | response[1]) == t_id && response[7] == 3 &&
+         response[10] == t_id % 90;
+}
+
+/* Raises the limit of open files to serve both ends of nb connections in
+   the process, returns the number of connections allowed */
+static inline int loadLimit(int nb)
+{
+  rlimit limit;
+
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  if (limit.rlim_cur < 2 * (rlim_t)nb + 64) {
+    nb = (limit.rlim_cur - 64) / 2;
+    printf("open files limited to %lu, %d connections\n",
+           (unsigned long)limit.rlim_cur, nb);
+  }
+  return nb;
+}
+
+struct LoadConnection {
+  int s;
+  uint16_t t_id;
+  uint64_t sent;
+  int length;
+  uint8_t response[64];
+};
+
+static inline void loadSend(LoadConnection &connection)
+{
+  uint8_t frame[12];
+
+  loadRequest(frame, connection.t_id);
+  connection.sent = loadNow();
+  connection.length = 0;
+  send(connection.s, frame, sizeof(frame), MSG_NOSIGNAL);
+}
+
+/* Drives the connections until end, appends the latencies */
+static inline void loadRun(std::vector<LoadConnection> &connections,
+                           uint64_t end, std::vector<uint32_t> &latencies,
+                           int &bad)
+{
+  epoll_event events[1024];
+  int epfd = epoll_create1(0);
+
+  for (size_t i = 0; i < connections.size(); i++) {
+    epoll_event event = {};
+
+    event.events = EPOLLIN;
+    event.data.u32 = i;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, connections[i].s, &event);
+    loadSend(connections[i]);
+  }
+
+  while (loadNow() < end) {
+    int n = epoll_wait(epfd, events, 1024, 100);
+
+    for (int i = 0; i < n; i++) {
+      LoadConnection &connection = connections[events[i].data.u32];
+      ssize_t rc = recv(connection.s, connection.response + connection.length,
+                        sizeof(connection.response) - connection.length, 0);
+
+      if (rc <= 0) {
+        continue;
+      }
+      connection.length += rc;
+      if (connection.length < LOAD_RESPONSE_LENGTH) {
+        continue;
+      }
+      latencies.push_back(loadNow() - connection.sent);
+      if (!loadCheck(connection.response, connection.t_id)) {
+        bad++;
+      }
+      connection.t_id++;
+      loadSend(connection);
+    }
+  }
+
+  close(epfd);
+}
+
+/* Opens nb connections to port and drives them from nb_threads threads for
+   seconds */
+static inline LoadResult load(int port, int nb, int nb_threads, int seconds)
+{
+  std::vector<std::vector<LoadConnection>> connections(nb_threads);
+  std::vector<std::vector<uint32_t>> latencies(nb_threads);
+  std::vector<int> bad(nb_threads);
+  std::vector<std::thread> threads;
+  std::vector<uint32_t> all;
+  LoadResult result = {};
+  uint64_t start;
+  double elapsed;
+
+  for (int i = 0; i < nb; i++) {
+    int s = loadConnect(port);
+
+    if (s == -1) {
+      break;
+    }
+    fcntl(s, F_SETFL, O_NONBLOCK);
+    connections[i % nb_threads].push_back({ s, 0, 0, 0, {} });
+    result.connections++;
+  }
+
+  start = loadNow();
+  for (int i = 0; i < nb_threads; i++) {
+    threads.emplace_back(loadRun, std::ref(connections[i]),
+                         start + seconds * 1000000ULL, std::ref(latencies[i]),
+                         std::ref(bad[i]));
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  elapsed = (loadNow() - start) / 1e6;
+
+  for (int i = 0; i < nb_threads; i++) {
+    all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+    result.bad += bad[i];
+    for (LoadConnection &connection : connections[i]) {
+      close(connection.s);
+    }
+  }
+
+  if (!all.empty()) {
+    std::sort(all.begin(), all.end());
+    result.rate = all.size() / elapsed;
+    result.p50 = all[all.size() / 2];
+    result.p99 = all[all.size() * 99 / 100];
+  }
+  return result;
+}
+
+#endif
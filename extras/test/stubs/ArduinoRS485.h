@@ -0,0 +1,90 @@
+/*
+  RS485 port of the tests: the bytes received are queued in rx by the test,
+  right away or by schedule(), and the ones sent are appended to tx. When fd
+  is set, the port is one side of a pty instead.
+*/
+
+#ifndef _ARDUINO_RS485_H_INCLUDED
+#define _ARDUINO_RS485_H_INCLUDED
+
+#include "Arduino.h"
+
+#include <deque>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+class RS485Class : public Stream {
+public:
+  std::deque<uint8_t> rx;
+  std::vector<uint8_t> tx;
+  int fd = -1;
+
+  /* Receives the bytes delay us from now, one every interval us */
+  void schedule(unsigned long delay, const std::vector<uint8_t> &bytes,
+                unsigned long interval = 0) {
+    unsigned long time = micros() + delay;
+
+    for (uint8_t c : bytes) {
+      scheduled.push_back(std::make_pair(time, c));
+      time += interval;
+    }
+  }
+
+  void begin(unsigned long, uint16_t) {}
+  void end() {}
+  void beginTransmission() {}
+  void endTransmission() {}
+  void receive() {}
+  void noReceive() {}
+
+  size_t write(uint8_t c) { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) {
+    if (fd >= 0) {
+      ssize_t n = ::write(fd, buffer, size);
+      return n < 0 ? 0 : n;
+    }
+    tx.insert(tx.end(), buffer, buffer + size);
+    return size;
+  }
+
+  int available() {
+    if (fd >= 0) {
+      int n = 0;
+      ioctl(fd, FIONREAD, &n);
+      return n;
+    }
+    receiveScheduled();
+    return rx.size();
+  }
+  int read() {
+    uint8_t c;
+    if (fd >= 0) {
+      return available() > 0 && ::read(fd, &c, 1) == 1 ? c : -1;
+    }
+    receiveScheduled();
+    if (rx.empty()) {
+      return -1;
+    }
+    c = rx.front();
+    rx.pop_front();
+    return c;
+  }
+  int peek() { return fd < 0 && !rx.empty() ? rx.front() : -1; }
+
+private:
+  std::deque<std::pair<unsigned long, uint8_t>> scheduled;
+
+  void receiveScheduled() {
+    while (!scheduled.empty() &&
+           (long)(micros() - scheduled.front().first) >= 0) {
+      rx.push_back(scheduled.front().second);
+      scheduled.pop_front();
+    }
+  }
+};
+
+extern RS485Class RS485;
+
+#endif
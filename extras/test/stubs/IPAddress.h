@@ -0,0 +1,12 @@
+#ifndef _IPADDRESS_H_INCLUDED
+#define _IPADDRESS_H_INCLUDED
+
+#include <stdint.h>
+
+class IPAddress {
+public:
+  IPAddress() {}
+  IPAddress(uint8_t, uint8_t, uint8_t, uint8_t) {}
+};
+
+#endif
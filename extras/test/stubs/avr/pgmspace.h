@@ -0,0 +1,7 @@
+#ifndef _PGMSPACE_H_INCLUDED
+#define _PGMSPACE_H_INCLUDED
+
+#define PROGMEM
+#define pgm_read_byte_near(p) (*(const uint8_t *)(p))
+
+#endif
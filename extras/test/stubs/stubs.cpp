@@ -0,0 +1,44 @@
+/*
+  Clock and objects of the Arduino core API, see Arduino.h
+*/
+
+#include "Arduino.h"
+#include "ArduinoRS485.h"
+
+#include <time.h>
+
+HardwareSerial Serial;
+RS485Class RS485;
+
+static unsigned long long now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+unsigned long millis()
+{
+  return now_us() / 1000;
+}
+
+unsigned long micros()
+{
+  return now_us();
+}
+
+void delay(unsigned long ms)
+{
+  struct timespec ts = { (time_t)(ms / 1000), (long)(ms % 1000) * 1000000 };
+  nanosleep(&ts, NULL);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  struct timespec ts = { (time_t)(us / 1000000), (long)(us % 1000000) * 1000 };
+  nanosleep(&ts, NULL);
+}
+
+void yield()
+{
+}
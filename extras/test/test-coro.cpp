@@ -0,0 +1,181 @@
+/*
+  Awaitable requests of the Linux host build against a local server: each
+  request of modbus::Client, an exception, a timeout and a request beyond
+  the transactions in flight. The epoll registrations of the loop are
+  counted by wrapping the libc call.
+*/
+
+#include "modbus-coro.h"
+
+#include "test.h"
+
+#include <atomic>
+#include <dlfcn.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <thread>
+#include <unistd.h>
+
+extern "C" {
+#include "modbus-tcp.h"
+}
+
+static const int PORT = 15048;
+static const int SEQUENTIAL = 100;
+/* Read of this register left unanswered by the server */
+static const int SILENT = 99;
+
+static int adds;
+static int dels;
+
+extern "C" int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+  static auto next = (int (*)(int, int, int, struct epoll_event *))dlsym(RTLD_NEXT, "epoll_ctl");
+
+  adds += op == EPOLL_CTL_ADD;
+  dels += op == EPOLL_CTL_DEL;
+  return next(epfd, op, fd, event);
+}
+
+static std::atomic<bool> listening;
+
+static void serve(int port)
+{
+  modbus_t *ctx = modbus_new_tcp("127.0.0.1", port);
+  modbus_mapping_t *map = modbus_mapping_new(100, 100, 100, 100);
+  uint8_t request[MODBUS_TCP_MAX_ADU_LENGTH];
+  int ls;
+  int rc;
+
+  for (int i = 0; i < 100; i++) {
+    map->tab_input_bits[i] = i % 3 == 0;
+    map->tab_registers[i] = i * 3;
+    map->tab_input_registers[i] = i * 5;
+  }
+  modbus_set_slave(ctx, 1);
+  ls = modbus_tcp_listen(ctx, 1);
+  listening = true;
+  modbus_tcp_accept(ctx, &ls);
+
+  while ((rc = modbus_receive(ctx, request)) != -1) {
+    if (rc > 0 && !(request[7] == MODBUS_FC_READ_HOLDING_REGISTERS &&
+                    request[9] == SILENT)) {
+      modbus_reply(ctx, request, rc, map);
+    }
+  }
+
+  close(ls);
+  modbus_close(ctx);
+  modbus_free(ctx);
+  modbus_mapping_free(map);
+}
+
+static int done;
+
+/* One request after the other, as a collector does */
+static modbus::Task sequential(modbus::Client &client)
+{
+  uint16_t registers[10];
+  int reads = 0;
+
+  for (int i = 0; i < SEQUENTIAL; i++) {
+    if (co_await client.readHoldingRegisters(1, i % 90, 10, registers) == 10 &&
+        registers[9] == (i % 90 + 9) * 3) {
+      reads++;
+    }
+  }
+  CHECK(reads == SEQUENTIAL);
+  done++;
+}
+
+static modbus::Task requests(modbus::Client &client)
+{
+  uint8_t bits[10];
+  uint16_t registers[4];
+  const uint8_t coils[3] = { 1, 0, 1 };
+  const uint16_t values[2] = { 0x1234, 0x5678 };
+
+  CHECK(co_await client.writeCoil(1, 5, 1) == 1);
+  CHECK(co_await client.writeCoils(1, 6, 3, coils) == 3);
+  CHECK(co_await client.readCoils(1, 4, 6, bits) == 6);
+  CHECK(bits[0] == 0 && bits[1] == 1 && bits[2] == 1 && bits[3] == 0 &&
+        bits[4] == 1 && bits[5] == 0);
+
+  CHECK(co_await client.readDiscreteInputs(1, 0, 4, bits) == 4);
+  CHECK(bits[0] == 1 && bits[1] == 0 && bits[2] == 0 && bits[3] == 1);
+  CHECK(co_await client.readInputRegisters(1, 10, 2, registers) == 2);
+  CHECK(registers[0] == 50 && registers[1] == 55);
+
+  CHECK(co_await client.writeRegister(1, 20, 0xABCD) == 1);
+  CHECK(co_await client.writeRegisters(1, 21, 2, values) == 2);
+  CHECK(co_await client.maskWriteRegister(1, 20, 0xFF00, 0x0012) == 1);
+  CHECK(co_await client.readHoldingRegisters(1, 20, 4, registers) == 4);
+  CHECK(registers[0] == 0xAB12 && registers[1] == 0x1234 &&
+        registers[2] == 0x5678 && registers[3] == 23 * 3);
+
+  /* Exception of the server */
+  CHECK(co_await client.readHoldingRegisters(1, 95, 10, registers) == -1 &&
+        errno == EMBXILADD);
+  /* No response */
+  CHECK(co_await client.readHoldingRegisters(1, SILENT, 1, registers) == -1 &&
+        errno == ETIMEDOUT);
+  /* Answered after the timeout */
+  CHECK(co_await client.readHoldingRegisters(1, 0, 2, registers) == 2 &&
+        registers[1] == 3);
+  done++;
+}
+
+/* Beyond modbus_set_max_transactions() */
+static modbus::Task busy(modbus::Client &client, int *rc, int *error)
+{
+  uint16_t registers[1];
+
+  *rc = co_await client.readHoldingRegisters(1, 0, 1, registers);
+  *error = errno;
+  done++;
+}
+
+int main()
+{
+  modbus_t *ctx = modbus_new_tcp("127.0.0.1", PORT);
+  std::thread server(serve, PORT);
+  modbus::Loop loop;
+  modbus::Client client(loop, ctx);
+
+  while (!listening) {
+    usleep(1000);
+  }
+  CHECK(modbus_connect(ctx) == 0);
+  modbus_set_response_timeout(ctx, 0, 100000);
+
+  /* The fd stays registered from one request to the next */
+  done = adds = dels = 0;
+  sequential(client);
+  CHECK(loop.run() == 0);
+  CHECK(done == 1);
+  CHECK(adds == 1);
+  CHECK(dels == 1);
+
+  done = 0;
+  requests(client);
+  CHECK(loop.run() == 0);
+  CHECK(done == 1);
+
+  int rc[2];
+  int error[2];
+
+  done = 0;
+  CHECK(modbus_set_max_transactions(ctx, 1) == 0);
+  busy(client, &rc[0], &error[0]);
+  busy(client, &rc[1], &error[1]);
+  CHECK(rc[1] == -1 && error[1] == EBUSY);
+  CHECK(loop.run() == 0);
+  CHECK(done == 2);
+  CHECK(rc[0] == 1);
+
+  modbus_close(ctx);
+  modbus_free(ctx);
+  server.join();
+
+  return failures != 0;
+}
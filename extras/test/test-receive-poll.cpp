@@ -0,0 +1,213 @@
+/*
+  Requests received in pieces by ModbusRTUServer::poll() and
+  ModbusTCPServer::poll(), which shall never wait for the missing bytes
+*/
+
+#include <ArduinoModbus.h>
+
+#include "MockClient.h"
+#include "test.h"
+
+static std::vector<uint8_t> rtuRequest(uint8_t slave)
+{
+  /* Read holding register 2 */
+  std::vector<uint8_t> request = { slave, 0x03, 0x00, 0x02, 0x00, 0x01 };
+
+  appendCrc(request);
+  return request;
+}
+
+static void push(const std::vector<uint8_t> &bytes, size_t begin, size_t end)
+{
+  RS485.rx.insert(RS485.rx.end(), bytes.begin() + begin, bytes.begin() + end);
+}
+
+/* Polls the server, checks it didn't wait unless it replied (after the frame
+   delay) and returns whether it replied */
+static int timedPoll()
+{
+  unsigned long start = micros();
+  int rc = ModbusRTUServer.poll();
+
+  CHECK(rc == 1 || micros() - start < 2000);
+  return rc;
+}
+
+static void testRtu()
+{
+  std::vector<uint8_t> request = rtuRequest(1);
+  std::vector<uint8_t> response = { 0x01, 0x03, 0x02, 0x12, 0x34 };
+
+  appendCrc(response);
+
+  ModbusRTUServer.begin(1, 9600);
+  /* Long enough for the test to poll within the byte timeout */
+  ModbusRTUServer.setCharTimeout(20000);
+  ModbusRTUServer.configureHoldingRegisters(0, 10);
+  ModbusRTUServer.holdingRegisterWrite(2, 0x1234);
+
+  /* Received byte by byte */
+  for (size_t i = 0; i < request.size(); i++) {
+    push(request, i, i + 1);
+    CHECK(timedPoll() == (i + 1 == request.size()));
+  }
+  CHECK(RS485.tx == response);
+
+  /* Nothing received */
+  for (int i = 0; i < 100; i++) {
+    CHECK(timedPoll() == 0);
+  }
+
+  /* Beginning of a request never completed, polled during the silence */
+  RS485.tx.clear();
+  push(request, 0, 2);
+  timedPoll();
+  for (int i = 0; i < 15; i++) {
+    delay(2);
+    timedPoll();
+  }
+  push(request, 0, request.size());
+  CHECK(timedPoll() == 1);
+  CHECK(RS485.tx == response);
+
+  /* Same when the silence ends between two polls */
+  RS485.tx.clear();
+  push(request, 0, 2);
+  timedPoll();
+  for (int i = 0; i < 9; i++) {
+    delay(2);
+    timedPoll();
+  }
+  delay(4);
+  push(request, 0, request.size());
+  CHECK(timedPoll() == 1);
+  CHECK(RS485.tx == response);
+
+  /* Same when the loop of the sketch didn't poll during the silence */
+  RS485.tx.clear();
+  push(request, 0, 2);
+  timedPoll();
+  delay(50);
+  push(request, 0, request.size());
+  CHECK(timedPoll() == 1);
+  CHECK(RS485.tx == response);
+
+  /* A slow loop of which the polls are further apart than the byte timeout
+     doesn't cut the requests */
+  RS485.tx.clear();
+  push(request, 0, 3);
+  timedPoll();
+  delay(50);
+  push(request, 3, request.size());
+  CHECK(timedPoll() == 1);
+  CHECK(RS485.tx == response);
+
+  /* Request to another slave, its confirmation, then a request split */
+  RS485.tx.clear();
+  std::vector<uint8_t> other = rtuRequest(2);
+  std::vector<uint8_t> confirmation = { 0x02, 0x03, 0x02, 0x00, 0x00 };
+  appendCrc(confirmation);
+  push(other, 0, other.size());
+  CHECK(timedPoll() == 0);
+  push(confirmation, 0, confirmation.size());
+  CHECK(timedPoll() == 0);
+  push(request, 0, 3);
+  CHECK(timedPoll() == 0);
+  push(request, 3, request.size());
+  CHECK(timedPoll() == 1);
+  CHECK(RS485.tx == response);
+
+  /* A bad coil value is received whole, the request right behind it isn't
+     discarded with it */
+  RS485.tx.clear();
+  ModbusRTUServer.configureCoils(0, 4);
+  std::vector<uint8_t> coil = { 0x01, 0x05, 0x00, 0x01, 0x12, 0x34 };
+  std::vector<uint8_t> exception = { 0x01, 0x85, 0x03 };
+  appendCrc(coil);
+  appendCrc(exception);
+  push(coil, 0, coil.size());
+  push(request, 0, request.size());
+  CHECK(timedPoll() == 1);
+  CHECK(RS485.tx == exception);
+  RS485.tx.clear();
+  CHECK(timedPoll() == 1);
+  CHECK(RS485.tx == response);
+
+  /* The echo responses keep the CRC of the request, the others get theirs */
+  std::vector<uint8_t> echoes[] = {
+    { 0x01, 0x05, 0x00, 0x02, 0xFF, 0x00 },
+    { 0x01, 0x06, 0x00, 0x03, 0xAB, 0xCD },
+    { 0x01, 0x10, 0x00, 0x04, 0x00, 0x01, 0x02, 0x56, 0x78 }
+  };
+  for (std::vector<uint8_t> &echo : echoes) {
+    std::vector<uint8_t> expected(echo.begin(), echo.begin() + 6);
+
+    appendCrc(echo);
+    appendCrc(expected);
+    RS485.tx.clear();
+    push(echo, 0, echo.size());
+    CHECK(timedPoll() == 1);
+    CHECK(RS485.tx == expected);
+  }
+  CHECK(ModbusRTUServer.coilRead(2) == 1);
+  CHECK(ModbusRTUServer.holdingRegisterRead(3) == 0xABCD);
+  CHECK(ModbusRTUServer.holdingRegisterRead(4) == 0x5678);
+
+  ModbusRTUServer.end();
+}
+
+static void testTcp()
+{
+  MockClient client;
+  ModbusTCPServer server;
+  std::vector<uint8_t> request = {
+    0x00, 0x09, 0x00, 0x00, 0x00, 0x06, 0xFF, 0x04, 0x00, 0x01, 0x00, 0x01
+  };
+  std::vector<uint8_t> response = {
+    0x00, 0x09, 0x00, 0x00, 0x00, 0x05, 0xFF, 0x04, 0x02, 0x00, 0x07
+  };
+
+  server.begin();
+  server.setByteTimeout(20);
+  server.accept(client);
+  server.configureInputRegisters(0, 4);
+  server.inputRegisterWrite(1, 7);
+
+  /* Received byte by byte */
+  for (size_t i = 0; i < request.size(); i++) {
+    client.rx.push_back(request[i]);
+    CHECK(server.poll() == (i + 1 == request.size()));
+  }
+  CHECK(client.tx == response);
+
+  /* Two requests in the same segment */
+  client.tx.clear();
+  client.rx.insert(client.rx.end(), request.begin(), request.end());
+  client.rx.insert(client.rx.end(), request.begin(), request.end());
+  server.poll();
+  server.poll();
+  CHECK(client.tx.size() == 2 * response.size());
+
+  /* Beginning of a request never completed */
+  client.tx.clear();
+  client.rx.insert(client.rx.end(), request.begin(), request.begin() + 3);
+  server.poll();
+  for (int i = 0; i < 9; i++) {
+    delay(2);
+    server.poll();
+  }
+  delay(4);
+  client.rx.insert(client.rx.end(), request.begin(), request.end());
+  server.poll();
+  CHECK(client.tx == response);
+
+  server.end();
+}
+
+int main()
+{
+  testRtu();
+  testTcp();
+
+  return failures != 0;
+}
@@ -0,0 +1,95 @@
+/*
+  Responses received in pieces by the RTU backend: a partial response shall
+  only cost the inter-character timeout, where Stream::readBytes() waits for
+  the missing bytes until the stream timeout
+*/
+
+#include <ArduinoModbus.h>
+
+#include "test.h"
+
+static ModbusRTUClientClass &client = ModbusRTUClient;
+
+/* Reads holding register 0 of slave 1, response is received delay us after
+   the request, a character every interval us. Returns the duration of the
+   read in us. */
+static unsigned long timedRead(const std::vector<uint8_t> &response,
+                               unsigned long delay, unsigned long interval,
+                               long *value)
+{
+  unsigned long start;
+
+  /* What's left of the previous response */
+  while (RS485.read() != -1) {
+  }
+  RS485.tx.clear();
+  RS485.schedule(delay, response, interval);
+  start = micros();
+  *value = client.holdingRegisterRead(1, 0);
+  return micros() - start;
+}
+
+int main()
+{
+  /* Response to a read of one holding register, 7 bytes */
+  std::vector<uint8_t> response = { 0x01, 0x03, 0x02, 0x12, 0x34 };
+  unsigned long elapsed;
+  long value;
+
+  appendCrc(response);
+
+  client.begin(9600);
+  client.setTimeout(100);
+
+  /* Whole response */
+  elapsed = timedRead(response, 1000, 0, &value);
+  CHECK(value == 0x1234);
+  CHECK(elapsed < 20000);
+
+  /* Characters received at the baud rate */
+  elapsed = timedRead(response, 1000, 1042, &value);
+  CHECK(value == 0x1234);
+  CHECK(elapsed < 20000);
+
+  /* A silence longer than t1.5 cuts the response */
+  std::vector<uint8_t> head(response.begin(), response.begin() + 3);
+  std::vector<uint8_t> tail(response.begin() + 3, response.end());
+  RS485.rx.clear();
+  RS485.schedule(1000, head);
+  RS485.schedule(10000, tail);
+  value = client.holdingRegisterRead(1, 0);
+  CHECK(value == -1);
+  delay(20);
+
+  printf("bytes received   readBytes()   RTU backend\n");
+  for (int cut = response.size(); cut > 0; cut -= 2) {
+    std::vector<uint8_t> partial(response.begin(), response.begin() + cut);
+    unsigned long worst = 0;
+    unsigned long stream;
+    uint8_t buffer[8];
+
+    for (int i = 0; i < 3; i++) {
+      elapsed = timedRead(partial, 1000, 0, &value);
+      CHECK(value == (cut == (int)response.size() ? 0x1234 : -1));
+      if (elapsed > worst) {
+        worst = elapsed;
+      }
+    }
+
+    /* How the backend read the response before draining only the bytes
+       available */
+    RS485.rx.assign(partial.begin(), partial.end());
+    elapsed = micros();
+    RS485.readBytes(buffer, response.size());
+    stream = micros() - elapsed;
+
+    printf("%d of %zu           %6lu ms     %6lu ms\n", cut, response.size(),
+           stream / 1000, worst / 1000);
+    /* Less than the response timeout, whatever the bytes missing */
+    CHECK(worst < 100000);
+  }
+
+  client.end();
+
+  return failures != 0;
+}
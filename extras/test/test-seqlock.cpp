@@ -0,0 +1,158 @@
+/*
+  Sequence lock of the tables of the host build: two writers update all the
+  holding registers at once while two readers check they never get a mix of
+  two updates. A writer and a reader go through the table directly
+  (modbus_mapping_write_begin() and modbus_mapping_read_begin()), the others
+  through write multiple registers and read holding registers requests.
+*/
+
+#include "test.h"
+
+#include <atomic>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
+
+extern "C" {
+#include "modbus-tcp.h"
+}
+
+static const int REGISTERS = 100;
+static const int SECONDS = 1;
+
+static modbus_mapping_t *map;
+static std::atomic<bool> stop;
+static std::atomic<long> reads;
+static std::atomic<long> torn;
+
+/* MBAP header, unit and function of a request of pdu_length bytes */
+static int header(uint8_t *adu, int pdu_length, int function)
+{
+  adu[0] = 0;
+  adu[1] = 1;
+  adu[2] = 0;
+  adu[3] = 0;
+  adu[4] = 0;
+  adu[5] = pdu_length + 1;
+  adu[6] = MODBUS_TCP_SLAVE;
+  adu[7] = function;
+  return 8;
+}
+
+static void writeTable(uint8_t id)
+{
+  for (unsigned int i = 0; !stop; i++) {
+    uint16_t value = id << 8 | (i & 0xFF);
+
+    modbus_mapping_write_begin(map, MODBUS_TABLE_REGISTERS);
+    for (int j = 0; j < REGISTERS; j++) {
+      map->tab_registers[j] = value;
+    }
+    modbus_mapping_write_end(map, MODBUS_TABLE_REGISTERS);
+  }
+}
+
+static void writeRequests(uint8_t id)
+{
+  modbus_t *ctx = modbus_new_tcp("127.0.0.1", 0);
+  uint8_t request[MODBUS_TCP_MAX_ADU_LENGTH];
+  uint8_t response[MODBUS_TCP_MAX_ADU_LENGTH];
+  int length = header(request, 6 + 2 * REGISTERS,
+                      MODBUS_FC_WRITE_MULTIPLE_REGISTERS);
+
+  request[length++] = 0;
+  request[length++] = 0;
+  request[length++] = 0;
+  request[length++] = REGISTERS;
+  request[length++] = 2 * REGISTERS;
+  length += 2 * REGISTERS;
+
+  for (unsigned int i = 0; !stop; i++) {
+    for (int j = 0; j < REGISTERS; j++) {
+      request[13 + 2 * j] = id;
+      request[14 + 2 * j] = i;
+    }
+    if (modbus_reply_build(ctx, request, length, map, response) != 12) {
+      torn++;
+    }
+  }
+
+  modbus_free(ctx);
+}
+
+static void readTable()
+{
+  uint16_t copy[REGISTERS];
+
+  while (!stop) {
+    unsigned int sequence;
+    int j;
+
+    do {
+      sequence = modbus_mapping_read_begin(map, MODBUS_TABLE_REGISTERS);
+      memcpy(copy, map->tab_registers, sizeof(copy));
+    } while (modbus_mapping_read_retry(map, MODBUS_TABLE_REGISTERS, sequence));
+
+    for (j = 1; j < REGISTERS && copy[j] == copy[0]; j++) {
+    }
+    if (j != REGISTERS) {
+      torn++;
+    }
+    reads++;
+  }
+}
+
+static void readRequests()
+{
+  modbus_t *ctx = modbus_new_tcp("127.0.0.1", 0);
+  uint8_t request[MODBUS_TCP_MAX_ADU_LENGTH];
+  uint8_t response[MODBUS_TCP_MAX_ADU_LENGTH];
+  int length = header(request, 5, MODBUS_FC_READ_HOLDING_REGISTERS);
+
+  request[length++] = 0;
+  request[length++] = 0;
+  request[length++] = 0;
+  request[length++] = REGISTERS;
+
+  while (!stop) {
+    int j;
+
+    if (modbus_reply_build(ctx, request, length, map, response) !=
+        9 + 2 * REGISTERS) {
+      torn++;
+      continue;
+    }
+    for (j = 1; j < REGISTERS &&
+                memcmp(&response[9 + 2 * j], &response[9], 2) == 0; j++) {
+    }
+    if (j != REGISTERS) {
+      torn++;
+    }
+    reads++;
+  }
+
+  modbus_free(ctx);
+}
+
+int main()
+{
+  map = modbus_mapping_new(0, 0, REGISTERS, 0);
+
+  std::thread threads[] = {
+    std::thread(writeTable, 1), std::thread(writeRequests, 2),
+    std::thread(readTable), std::thread(readRequests)
+  };
+  sleep(SECONDS);
+  stop = true;
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  printf("%ld reads, %ld torn\n", reads.load(), torn.load());
+  CHECK(reads > 0);
+  CHECK(torn == 0);
+
+  modbus_mapping_free(map);
+
+  return failures != 0;
+}
@@ -0,0 +1,353 @@
+/*
+  ModbusTCPGateway between loopback TCP clients and an RTU slave emulated on
+  the other side of a pty
+*/
+
+#include <ArduinoModbus.h>
+
+#include "SocketClient.h"
+#include "test.h"
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <fcntl.h>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <termios.h>
+#include <thread>
+
+static const int PORT = 15502;
+/* Silence ending the frames received by the slave, in ms */
+static const int SLAVE_SILENCE = 2;
+/* User defined function code answered by the slave with a response of a
+   length the library doesn't know */
+static const uint8_t USER_FUNCTION = 0x41;
+
+static std::atomic<bool> stop;
+static int slaveFd;
+static uint16_t registers[10];
+
+struct Frame {
+  /* Reception of the first bytes */
+  unsigned long time;
+  uint8_t slave;
+  uint8_t function;
+};
+static std::mutex framesMutex;
+static std::vector<Frame> frames;
+
+static uint16_t crc16(const uint8_t *frame, int length)
+{
+  std::vector<uint8_t> bytes(frame, frame + length);
+
+  appendCrc(bytes);
+  return bytes[length] | (bytes[length + 1] << 8);
+}
+
+/* RTU slave 1 on the pty, the broadcast writes are applied too. The frames
+   of the other slaves are ignored. */
+static void runSlave()
+{
+  uint8_t request[256];
+  int length = 0;
+  unsigned long start = 0;
+
+  for (int i = 0; i < 10; i++) {
+    registers[i] = i * 10;
+  }
+
+  while (!stop) {
+    pollfd pending = { slaveFd, POLLIN, 0 };
+    uint8_t response[256];
+    int n = 0;
+
+    if (::poll(&pending, 1, SLAVE_SILENCE) > 0) {
+      int rc = ::read(slaveFd, request + length, sizeof(request) - length);
+
+      if (rc > 0) {
+        if (length == 0) {
+          start = millis();
+        }
+        length += rc;
+      }
+      continue;
+    }
+    if (length == 0) {
+      continue;
+    }
+
+    int frameLength = length;
+    length = 0;
+    if (frameLength < 4 ||
+        crc16(request, frameLength - 2) !=
+          (request[frameLength - 2] | (request[frameLength - 1] << 8))) {
+      continue;
+    }
+    {
+      std::lock_guard<std::mutex> lock(framesMutex);
+      frames.push_back({ start, request[0], request[1] });
+    }
+    if (request[0] != 1 && request[0] != 0) {
+      continue;
+    }
+
+    int address = (request[2] << 8) | request[3];
+    int value = (request[4] << 8) | request[5];
+
+    response[n++] = 1;
+    if (request[1] == 3 && address + value <= 10) {
+      response[n++] = 3;
+      response[n++] = 2 * value;
+      for (int i = 0; i < value; i++) {
+        response[n++] = registers[address + i] >> 8;
+        response[n++] = registers[address + i];
+      }
+    } else if (request[1] == 6 && address < 10) {
+      registers[address] = value;
+      std::copy(request, request + 6, response);
+      n = 6;
+    } else if (request[1] == USER_FUNCTION) {
+      /* The data reversed, then its length */
+      response[n++] = USER_FUNCTION;
+      for (int i = frameLength - 3; i >= 2; i--) {
+        response[n++] = request[i];
+      }
+      response[n++] = frameLength - 4;
+    } else {
+      response[n++] = request[1] | 0x80;
+      response[n++] = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+
+    if (request[0] != 0) {
+      uint16_t crc = crc16(response, n);
+
+      response[n++] = crc;
+      response[n++] = crc >> 8;
+      if (::write(slaveFd, response, n) != n) {
+        printf("slave: write failed\n");
+      }
+    }
+  }
+}
+
+static int listening;
+static ModbusTCPGateway gateway;
+
+/* Accepts a pending client and polls the gateway */
+static void pollGateway()
+{
+  int s = accept4(listening, NULL, NULL, SOCK_NONBLOCK);
+
+  if (s != -1) {
+    SocketClient client(s);
+
+    if (!gateway.accept(client)) {
+      client.stop();
+    }
+  }
+  gateway.poll();
+}
+
+static int connectTo(int port)
+{
+  sockaddr_in address = {};
+  int option = 1;
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+  connect(s, (sockaddr *)&address, sizeof(address));
+  setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+  return s;
+}
+
+static void sendPdu(int s, uint16_t t_id, uint8_t unit,
+                    std::vector<uint8_t> pdu)
+{
+  std::vector<uint8_t> adu = {
+    (uint8_t)(t_id >> 8), (uint8_t)t_id, 0, 0,
+    (uint8_t)((pdu.size() + 1) >> 8), (uint8_t)(pdu.size() + 1), unit
+  };
+
+  adu.insert(adu.end(), pdu.begin(), pdu.end());
+  send(s, adu.data(), adu.size(), MSG_NOSIGNAL);
+}
+
+static void sendRequest(int s, uint16_t t_id, uint8_t unit, uint8_t function,
+                        uint16_t address, uint16_t value)
+{
+  sendPdu(s, t_id, unit, { function, (uint8_t)(address >> 8),
+                           (uint8_t)address, (uint8_t)(value >> 8),
+                           (uint8_t)value });
+}
+
+/* Polls the gateway until a response is received on s or for ms, returns
+   the response (empty on timeout) */
+static std::vector<uint8_t> receiveResponse(int s, unsigned long ms = 1000)
+{
+  uint8_t response[260];
+  unsigned long start = millis();
+  int length = 0;
+
+  while (millis() - start < ms) {
+    int rc;
+
+    pollGateway();
+    rc = recv(s, response + length, sizeof(response) - length, MSG_DONTWAIT);
+    if (rc > 0) {
+      length += rc;
+    }
+    if (length >= 7 && length >= 6 + ((response[4] << 8) | response[5])) {
+      return std::vector<uint8_t>(response + 7, response + length);
+    }
+    usleep(100);
+  }
+  return std::vector<uint8_t>();
+}
+
+static unsigned long frameTime(uint8_t slave, uint8_t function)
+{
+  std::lock_guard<std::mutex> lock(framesMutex);
+
+  for (const Frame &frame : frames) {
+    if (frame.slave == slave && frame.function == function) {
+      return frame.time;
+    }
+  }
+  return 0;
+}
+
+int main()
+{
+  RS485Class port;
+  termios attributes;
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  int option = 1;
+  sockaddr_in address = {};
+
+  grantpt(master);
+  unlockpt(master);
+  slaveFd = open(ptsname(master), O_RDWR | O_NOCTTY);
+  tcgetattr(slaveFd, &attributes);
+  cfmakeraw(&attributes);
+  tcsetattr(slaveFd, TCSANOW, &attributes);
+  port.fd = master;
+  std::thread slave(runSlave);
+
+  ModbusRTUClientClass bus(port);
+  CHECK(bus.begin(115200) == 1);
+  bus.setTimeout(100);
+
+  listening = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(listening, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(PORT);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  bind(listening, (sockaddr *)&address, sizeof(address));
+  listen(listening, 8);
+  fcntl(listening, F_SETFL, O_NONBLOCK);
+
+  CHECK(gateway.begin(0xff, 4, 2) == 1);
+  gateway.configureHoldingRegisters(0, 4);
+  gateway.holdingRegisterWrite(0, 0xBEEF);
+  gateway.setTurnaroundDelay(50);
+  CHECK(gateway.route(bus, 1, 1) == 1);
+  /* Silent slaves */
+  CHECK(gateway.route(bus, 2, 3, 5) == 1);
+  CHECK(gateway.route(bus, 10, 10, 0) == 1);
+  CHECK(gateway.route(bus, 240, 250) == 0);
+
+  int a = connectTo(PORT);
+  int b = connectTo(PORT);
+  std::vector<uint8_t> response;
+
+  sendRequest(a, 1, 1, 3, 0, 4);
+  CHECK(receiveResponse(a) ==
+        std::vector<uint8_t>({ 3, 8, 0, 0, 0, 10, 0, 20, 0, 30 }));
+
+  sendRequest(a, 2, 1, 6, 2, 777);
+  CHECK(receiveResponse(a) == std::vector<uint8_t>({ 6, 0, 2, 3, 9 }));
+  CHECK(registers[2] == 777);
+
+  /* Exception responses are relayed */
+  sendRequest(a, 3, 1, 3, 50, 1);
+  CHECK(receiveResponse(a) == std::vector<uint8_t>({ 0x83, 2 }));
+
+  sendRequest(a, 4, 50, 3, 0, 1);
+  CHECK(receiveResponse(a) ==
+        std::vector<uint8_t>({ 0x83, MODBUS_EXCEPTION_GATEWAY_PATH }));
+
+  sendRequest(a, 5, 0xff, 3, 0, 1);
+  CHECK(receiveResponse(a) == std::vector<uint8_t>({ 3, 2, 0xBE, 0xEF }));
+
+  /* The function codes the library doesn't know end with the silence */
+  for (int length : { 0, 1, 7, 40 }) {
+    std::vector<uint8_t> pdu = { USER_FUNCTION };
+    std::vector<uint8_t> expected = { USER_FUNCTION };
+
+    for (int i = 0; i < length; i++) {
+      pdu.push_back(i + 1);
+      expected.insert(expected.begin() + 1, i + 1);
+    }
+    expected.push_back(length);
+    sendPdu(a, 6, 1, pdu);
+    CHECK(receiveResponse(a) == expected);
+  }
+
+  /* The bus is busy until the timeout of the silent slave, the gateway's
+     own registers are served meanwhile and the request for the bus waits */
+  unsigned long start = millis();
+  sendRequest(a, 7, 2, 3, 0, 1);
+  sendRequest(b, 8, 0xff, 3, 0, 1);
+  CHECK(receiveResponse(b, 50) == std::vector<uint8_t>({ 3, 2, 0xBE, 0xEF }));
+  CHECK(millis() - start < 50);
+  sendRequest(b, 9, 1, 3, 1, 1);
+  CHECK(receiveResponse(a) ==
+        std::vector<uint8_t>({ 0x83, MODBUS_EXCEPTION_GATEWAY_TARGET }));
+  CHECK(millis() - start >= 100);
+  CHECK(receiveResponse(b) == std::vector<uint8_t>({ 3, 2, 0, 10 }));
+
+  /* Broadcast, without response: the next request of the bus waits for the
+     turnaround delay */
+  sendRequest(a, 10, 10, 6, 3, 1234);
+  sendRequest(a, 11, 1, 3, 3, 1);
+  CHECK(receiveResponse(a) == std::vector<uint8_t>({ 3, 2, 0x04, 0xD2 }));
+  CHECK(registers[3] == 1234);
+  unsigned long broadcast = frameTime(0, 6);
+  unsigned long next = 0;
+  {
+    std::lock_guard<std::mutex> lock(framesMutex);
+    next = frames.back().time;
+  }
+  CHECK(broadcast != 0);
+  CHECK(next - broadcast >= 50);
+
+  /* A client gone while its request is on the bus */
+  int c = connectTo(PORT);
+  for (int i = 0; i < 5; i++) {
+    pollGateway();
+  }
+  sendRequest(c, 12, 2, 3, 0, 1);
+  for (int i = 0; i < 5; i++) {
+    pollGateway();
+    usleep(1000);
+  }
+  close(c);
+  sendRequest(a, 13, 1, 3, 9, 1);
+  CHECK(receiveResponse(a) == std::vector<uint8_t>({ 3, 2, 0, 90 }));
+  CHECK(gateway.clients() == 2);
+
+  gateway.end();
+  stop = true;
+  slave.join();
+  close(a);
+  close(b);
+  close(listening);
+  close(slaveFd);
+  close(master);
+
+  return failures != 0;
+}
@@ -0,0 +1,223 @@
+/*
+  Pipelined requests of the Linux host build, against a local server which
+  answers the requests received together in reverse order
+*/
+
+#include "modbus-coro.h"
+
+#include "test.h"
+
+#include <chrono>
+#include <errno.h>
+#include <poll.h>
+#include <thread>
+#include <unistd.h>
+
+extern "C" {
+#include "modbus-tcp.h"
+}
+
+static const int PORT = 15021;
+static const int REQUESTS = 4000;
+
+/* Serves one connection. The replies of the requests received together are
+   sent in reverse order after delay us, the slow first ones after slow_delay
+   us each. */
+static void serve(int port, int delay, int slow, int slow_delay)
+{
+  modbus_t *ctx = modbus_new_tcp("127.0.0.1", port);
+  modbus_mapping_t *map = modbus_mapping_new(0, 0, 100, 0);
+  std::vector<std::vector<uint8_t>> batch;
+  int ls;
+  int s;
+
+  for (int i = 0; i < 100; i++) {
+    map->tab_registers[i] = i * 3;
+  }
+  modbus_set_slave(ctx, 1);
+  ls = modbus_tcp_listen(ctx, 1);
+  s = modbus_tcp_accept(ctx, &ls);
+
+  for (;;) {
+    uint8_t request[MODBUS_TCP_MAX_ADU_LENGTH];
+    int rc = modbus_receive(ctx, request);
+    pollfd pending = { s, POLLIN, 0 };
+
+    if (rc == -1) {
+      break;
+    }
+    batch.emplace_back(request, request + rc);
+    if (poll(&pending, 1, 0) > 0) {
+      continue;
+    }
+
+    for (int i = batch.size() - 1; i >= 0; i--) {
+      if (slow > 0) {
+        slow--;
+        usleep(slow_delay);
+      } else if (delay > 0 && i == (int)batch.size() - 1) {
+        usleep(delay);
+      }
+      modbus_reply(ctx, batch[i].data(), batch[i].size(), map);
+    }
+    batch.clear();
+  }
+
+  close(ls);
+  modbus_close(ctx);
+  modbus_free(ctx);
+  modbus_mapping_free(map);
+}
+
+static modbus_t *connect(int port)
+{
+  modbus_t *ctx = modbus_new_tcp("127.0.0.1", port);
+
+  for (int i = 0; i < 100 && modbus_connect(ctx) == -1; i++) {
+    usleep(10000);
+  }
+  return ctx;
+}
+
+static int reads;
+static int errors;
+
+static modbus::Task reader(modbus::Client &client, int id, int nb)
+{
+  uint16_t registers[10];
+
+  for (int i = 0; i < nb; i++) {
+    int address = (id * 7 + i) % 90;
+    int rc = co_await client.readHoldingRegisters(1, address, 10, registers);
+
+    if (rc == 10 && registers[0] == address * 3 &&
+        registers[9] == (address + 9) * 3) {
+      reads++;
+    } else {
+      errors++;
+    }
+  }
+}
+
+/* Reads through depth coroutines sharing one connection, returns the
+   requests per second */
+static double pipeline(int port, int depth)
+{
+  std::thread server(serve, port, 200, 0, 0);
+  modbus_t *ctx = connect(port);
+  modbus::Loop loop;
+  modbus::Client client(loop, ctx);
+  auto start = std::chrono::steady_clock::now();
+  double elapsed;
+
+  CHECK(modbus_set_max_transactions(ctx, depth) == 0);
+  reads = errors = 0;
+  for (int i = 0; i < depth; i++) {
+    reader(client, i, REQUESTS / depth);
+  }
+  loop.run();
+  elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                          start).count();
+  CHECK(reads == REQUESTS);
+  CHECK(errors == 0);
+
+  /* Beyond the table of transactions */
+  uint16_t registers[1];
+  uint8_t response[MODBUS_TCP_MAX_ADU_LENGTH];
+  int sent = 0;
+  int received = 0;
+  int t_id;
+
+  for (int i = 0; i < depth; i++) {
+    sent += modbus_send_transaction(ctx, MODBUS_FC_READ_HOLDING_REGISTERS, 0,
+                                    1, NULL, registers) >= 0;
+  }
+  CHECK(sent == depth);
+  CHECK(modbus_send_transaction(ctx, MODBUS_FC_READ_HOLDING_REGISTERS, 0, 1,
+                                NULL, registers) == -1 && errno == EBUSY);
+  while (received < sent) {
+    int rc = modbus_poll_transactions(ctx, response, &t_id);
+
+    if (rc == 1) {
+      received++;
+    } else if (errno != EAGAIN) {
+      break;
+    }
+  }
+  CHECK(received == sent);
+
+  modbus_close(ctx);
+  modbus_free(ctx);
+  server.join();
+
+  printf("depth %2d: %.0f req/s\n", depth, reads / elapsed);
+  return reads / elapsed;
+}
+
+/* The confirmations of expired transactions are dropped */
+static void lateConfirmations(int port)
+{
+  std::thread server(serve, port, 0, 3, 60000);
+  modbus_t *ctx = connect(port);
+  uint8_t response[MODBUS_TCP_MAX_ADU_LENGTH];
+  uint16_t registers[4][2];
+  int ids[4];
+  int t_id;
+  int rc;
+
+  modbus_set_slave(ctx, 1);
+  modbus_set_max_transactions(ctx, 4);
+  modbus_set_response_timeout(ctx, 0, 100000);
+
+  for (int i = 0; i < 3; i++) {
+    ids[i] = modbus_send_transaction(ctx, MODBUS_FC_READ_HOLDING_REGISTERS, i,
+                                     2, NULL, registers[i]);
+  }
+  /* Answered 60 ms apart: the first one in time, the others expire */
+  int answered = 0;
+  int expired = 0;
+  for (int i = 0; i < 3; i++) {
+    while ((rc = modbus_poll_transactions(ctx, response, &t_id)) == -1 &&
+           errno == EAGAIN) {
+    }
+    for (int j = 0; j < 3; j++) {
+      if (t_id != ids[j]) {
+        continue;
+      }
+      if (rc == 2 && registers[j][0] == j * 3 &&
+          registers[j][1] == (j + 1) * 3) {
+        answered++;
+      } else if (rc == -1 && errno == ETIMEDOUT) {
+        expired++;
+      }
+    }
+  }
+  CHECK(answered == 1);
+  CHECK(expired == 2);
+
+  /* The late confirmations arrive meanwhile */
+  usleep(150000);
+  ids[3] = modbus_send_transaction(ctx, MODBUS_FC_READ_HOLDING_REGISTERS, 5, 2,
+                                   NULL, registers[3]);
+  while ((rc = modbus_poll_transactions(ctx, response, &t_id)) == -1 &&
+         errno == EAGAIN) {
+  }
+  CHECK(t_id == ids[3]);
+  CHECK(rc == 2 && registers[3][0] == 15 && registers[3][1] == 18);
+
+  modbus_close(ctx);
+  modbus_free(ctx);
+  server.join();
+}
+
+int main()
+{
+  double single = pipeline(PORT, 1);
+  double pipelined = pipeline(PORT + 1, 16);
+
+  /* The server latency is paid once per batch */
+  CHECK(pipelined > 2 * single);
+  lateConfirmations(PORT + 2);
+
+  return failures != 0;
+}
@@ -0,0 +1,172 @@
+/*
+  Server engine of the Linux host build (modbus_tcp_server_poll()) under
+  load: a client reading its responses slower than it sends the requests,
+  and thousands of connections on the loopback. Both engines are tested,
+  io_uring (modbus_tcp_server_new_uring()) when the build and the kernel
+  support it.
+*/
+
+#include "load.h"
+#include "test.h"
+
+#include <atomic>
+#include <errno.h>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
+
+extern "C" {
+#include "modbus-tcp.h"
+}
+
+static const int PORT = 15024;
+static const int CONNECTIONS = 5000;
+static const int SECONDS = 2;
+
+static std::atomic<bool> listening;
+static std::atomic<bool> stop;
+static long served;
+/* errno of the creation of the server, 0 if successful */
+static int error;
+
+/* Serves up to max_connections clients until stop, the accepted sockets
+   inherit the send buffer of the listening socket (0 for the default) */
+static void serve(int port, int max_connections, int sndbuf, bool uring)
+{
+  modbus_t *ctx = modbus_new_tcp("127.0.0.1", port);
+  modbus_mapping_t *map = modbus_mapping_new(0, 0, 100, 0);
+  modbus_tcp_server_t *server;
+  int ls;
+
+  for (int i = 0; i < 100; i++) {
+    map->tab_registers[i] = i;
+  }
+  ls = modbus_tcp_listen(ctx, 8192);
+  if (sndbuf > 0) {
+    setsockopt(ls, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  }
+  server = uring ? modbus_tcp_server_new_uring(ctx, ls, max_connections) :
+                   modbus_tcp_server_new(ctx, ls, max_connections);
+  error = (server == NULL) ? errno : 0;
+  served = 0;
+  listening = true;
+
+  while (server != NULL && !stop) {
+    int rc = modbus_tcp_server_poll(server, map, 10);
+
+    if (rc > 0) {
+      served += rc;
+    }
+  }
+
+  modbus_tcp_server_free(server);
+  close(ls);
+  modbus_free(ctx);
+  modbus_mapping_free(map);
+}
+
+/* The responses which don't fit in the socket are sent once the client
+   reads nb of them, in order */
+static void slowReader(int port, int nb, bool uring)
+{
+  std::vector<uint8_t> requests(nb * 12);
+  std::vector<uint8_t> responses(nb * LOAD_RESPONSE_LENGTH);
+  size_t received = 0;
+  int bad = 0;
+  int s;
+
+  listening = stop = false;
+  std::thread server(serve, port, 1, 4096, uring);
+  while (!listening) {
+    usleep(1000);
+  }
+  CHECK(error == 0);
+  s = loadConnect(port);
+  CHECK(s != -1);
+
+  for (int i = 0; i < nb; i++) {
+    loadRequest(&requests[i * 12], i);
+  }
+  /* The server stops reading while its responses are stuck */
+  std::thread sender([&] {
+    send(s, requests.data(), requests.size(), MSG_NOSIGNAL);
+  });
+  usleep(200000);
+
+  while (received < responses.size()) {
+    ssize_t rc = recv(s, &responses[received], responses.size() - received, 0);
+
+    if (rc <= 0) {
+      break;
+    }
+    received += rc;
+  }
+  sender.join();
+  CHECK(received == responses.size());
+
+  for (int i = 0; i < nb; i++) {
+    if (!loadCheck(&responses[i * LOAD_RESPONSE_LENGTH], i)) {
+      bad++;
+    }
+  }
+  CHECK(bad == 0);
+
+  close(s);
+  stop = true;
+  server.join();
+  CHECK(served == nb);
+}
+
+/* Prints the requests per second and the latencies of nb connections */
+static void manyConnections(int port, int nb, bool uring)
+{
+  LoadResult result;
+
+  listening = stop = false;
+  std::thread server(serve, port, nb, 0, uring);
+  while (!listening) {
+    usleep(1000);
+  }
+  CHECK(error == 0);
+
+  result = load(port, nb, 1, SECONDS);
+  CHECK(result.connections == nb);
+  CHECK(result.rate > 0);
+  CHECK(result.bad == 0);
+  printf("%s, %d connections: %.0f req/s, p50 %u us, p99 %u us\n",
+         uring ? "io_uring" : "epoll", result.connections, result.rate, result.p50, result.p99);
+
+  stop = true;
+  server.join();
+}
+
+int main()
+{
+  int nb = loadLimit(CONNECTIONS);
+  bool uring = false;
+
+  slowReader(PORT, 20000, false);
+  manyConnections(PORT + 1, nb, false);
+
+  /* Skipped when unsupported */
+  listening = stop = false;
+  std::thread probe(serve, PORT + 2, 1, 0, true);
+  while (!listening) {
+    usleep(1000);
+  }
+  stop = true;
+  probe.join();
+  if (error == 0) {
+    uring = true;
+  } else {
+    printf("io_uring: %s, skipped\n", strerror(error));
+  }
+
+  /* The responses a client doesn't read are bounded to 256 ADUs */
+  if (uring) {
+    slowReader(PORT + 3, 2000, true);
+    manyConnections(PORT + 4, nb, true);
+  }
+
+  return failures != 0;
+}
@@ -0,0 +1,153 @@
+/*
+  Clients served at once by ModbusTCPServer, sending their requests in small
+  pieces interleaved with the others, against the shared registers
+*/
+
+#include <ArduinoModbus.h>
+
+#include "MockClient.h"
+#include "test.h"
+
+#include <chrono>
+
+static const int CLIENTS = 8;
+static const int REQUESTS = 2000;
+/* Bytes received by each client per poll */
+static const size_t CHUNK = 5;
+/* Response to a read of 10 registers */
+static const size_t RESPONSE_LENGTH = 29;
+
+static int address(int client, int request)
+{
+  return (client * 11 + request) % 90;
+}
+
+int main()
+{
+  ModbusTCPServer server;
+  MockClient clients[CLIENTS];
+  std::vector<uint8_t> requests[CLIENTS];
+  size_t sent[CLIENTS] = { 0 };
+  int polls = 0;
+
+  CHECK(server.begin(0xff, CLIENTS) == 1);
+  server.configureHoldingRegisters(0, 100);
+  for (int i = 0; i < 100; i++) {
+    server.holdingRegisterWrite(i, i * 3);
+  }
+
+  for (int i = 0; i < CLIENTS; i++) {
+    /* The server keeps its own copy */
+    MockClient client = clients[i];
+
+    CHECK(server.accept(client) == 1);
+    for (int r = 0; r < REQUESTS; r++) {
+      int a = address(i, r);
+      uint8_t request[] = {
+        (uint8_t)(r >> 8), (uint8_t)r, 0x00, 0x00, 0x00, 0x06,
+        0xFF, 0x03, (uint8_t)(a >> 8), (uint8_t)a, 0x00, 0x0A
+      };
+
+      requests[i].insert(requests[i].end(), request, request + sizeof(request));
+    }
+  }
+  MockClient extra;
+  CHECK(server.accept(extra) == 0);
+  CHECK(server.clients() == CLIENTS);
+
+  auto start = std::chrono::steady_clock::now();
+  for (bool pending = true; pending; polls++) {
+    pending = false;
+    for (int i = 0; i < CLIENTS; i++) {
+      size_t n = std::min(CHUNK, requests[i].size() - sent[i]);
+
+      clients[i].rx.insert(clients[i].rx.end(), requests[i].begin() + sent[i],
+                           requests[i].begin() + sent[i] + n);
+      sent[i] += n;
+      pending |= sent[i] < requests[i].size() || !clients[i].rx.empty();
+    }
+    server.poll();
+  }
+  double elapsed = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+
+  for (int i = 0; i < CLIENTS; i++) {
+    std::vector<uint8_t> &tx = clients[i].tx;
+
+    CHECK(tx.size() == REQUESTS * RESPONSE_LENGTH);
+    if (tx.size() != REQUESTS * RESPONSE_LENGTH) {
+      continue;
+    }
+    for (int r = 0; r < REQUESTS; r++) {
+      const uint8_t *response = &tx[r * RESPONSE_LENGTH];
+      int a = address(i, r);
+
+      if (((response[0] << 8) | response[1]) != r || response[7] != 0x03 ||
+          response[8] != 20 || ((response[9] << 8) | response[10]) != a * 3 ||
+          ((response[27] << 8) | response[28]) != (a + 9) * 3) {
+        CHECK(!"response");
+        break;
+      }
+    }
+  }
+  printf("%d clients x %d requests in chunks of %zu bytes: %.0f req/s, "
+         "%d polls\n", CLIENTS, REQUESTS, CHUNK,
+         CLIENTS * REQUESTS / elapsed, polls);
+
+  /* A disconnected client is released, making room for another */
+  clients[3].stop();
+  server.poll();
+  CHECK(server.clients() == CLIENTS - 1);
+  CHECK(server.accept(extra) == 1);
+
+  /* A client already served isn't taken again, even when they are all
+     served */
+  MockClient again = extra;
+  CHECK(server.accept(again) == 1);
+  CHECK(server.clients() == CLIENTS);
+
+  /* The idle clients are stopped */
+  server.setIdleTimeout(50);
+  clients[0].rx.push_back(0x00);
+  delay(30);
+  server.poll();
+  delay(30);
+  server.poll();
+  CHECK(clients[0].connected());
+  CHECK(!clients[1].connected());
+  CHECK(server.clients() == 1);
+
+  /* Accepted again while it has data, its requests are still received by a
+     single connection */
+  uint8_t request[] = {
+    0x00, 0x07, 0x00, 0x00, 0x00, 0x06, 0xFF, 0x03, 0x00, 0x01, 0x00, 0x0A
+  };
+  MockClient fresh;
+  fresh.rx.insert(fresh.rx.end(), request, request + 6);
+  CHECK(server.accept(fresh) == 1);
+  server.poll();
+  fresh.rx.insert(fresh.rx.end(), request + 6, request + sizeof(request));
+  CHECK(server.accept(fresh) == 1);
+  server.poll();
+  server.poll();
+  CHECK(server.clients() == 2);
+  CHECK(fresh.tx.size() == RESPONSE_LENGTH);
+
+  /* A plain Client is served without a copy */
+  MockClient owned;
+  Client& plain = owned;
+  CHECK(server.accept(plain) == 1);
+  CHECK(server.accept(plain) == 1);
+  CHECK(server.clients() == 3);
+  owned.rx.insert(owned.rx.end(), request, request + sizeof(request));
+  server.poll();
+  server.poll();
+  CHECK(owned.tx.size() == RESPONSE_LENGTH);
+
+  server.end();
+  CHECK(server.clients() == 0);
+  CHECK(!clients[0].connected());
+  CHECK(!owned.connected());
+
+  return failures != 0;
+}
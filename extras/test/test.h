@@ -0,0 +1,36 @@
+/*
+  Checks of the tests, main() returns the number of failures
+*/
+
+#ifndef _TEST_H_INCLUDED
+#define _TEST_H_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+/* Appends the CRC of an RTU frame */
+static inline void appendCrc(std::vector<uint8_t> &frame)
+{
+  uint16_t crc = 0xFFFF;
+
+  for (uint8_t b : frame) {
+    crc ^= b;
+    for (int i = 0; i < 8; i++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+  }
+  frame.push_back(crc & 0xFF);
+  frame.push_back(crc >> 8);
+}
+
+#endif
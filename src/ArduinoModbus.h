@@ -26,4 +26,6 @@
 #include "ModbusTCPClient.h"
 #include "ModbusTCPServer.h"
 
+#include "ModbusTCPGateway.h"
+
 #endif
@@ -18,19 +18,24 @@
 */
 
 #include <errno.h>
+#include <limits.h>
 
 #include "ModbusClient.h"
 
 ModbusClient::ModbusClient(unsigned long defaultTimeout) :
   _mb(NULL),
-  _timeout(defaultTimeout),
+  _timeoutMicros(defaultTimeout * 1000),
   _defaultId(0x00),
   _transmissionBegun(false),
   _values(NULL),
   _available(0),
   _read(0),
   _availableForWrite(0),
-  _written(0)
+  _written(0),
+  _response(NULL),
+  _pending(false),
+  _pendingRead(false),
+  _result(0)
 {
 }
 
@@ -40,6 +45,10 @@ ModbusClient::~ModbusClient()
     free(_values);
   }
 
+  if (_response != NULL) {
+    free(_response);
+  }
+
   if (_mb != NULL) {
     modbus_free(_mb);
   }
@@ -67,10 +76,12 @@ int ModbusClient::begin(modbus_t* mb, int defaultId)
   _read = 0;
   _availableForWrite = 0;
   _written = 0;
+  _pending = false;
+  _result = 0;
 
   modbus_set_error_recovery(_mb, MODBUS_ERROR_RECOVERY_PROTOCOL);
   
-  setTimeout(_timeout);
+  setTimeoutMicros(_timeoutMicros);
 
   modbus_set_debug(_mb, 1);
 
@@ -85,6 +96,14 @@ void ModbusClient::end()
     _values = NULL;
   }
 
+  if (_response != NULL) {
+    free(_response);
+
+    _response = NULL;
+  }
+
+  _pending = false;
+
   if (_mb != NULL) {
     modbus_close(_mb);
     modbus_free(_mb);
@@ -237,6 +256,13 @@ int ModbusClient::beginTransmission(int id, int type, int address, int nb)
     return 0;
   }
 
+  if (_pending) {
+    // the values of a read in progress are received in _values
+    errno = EBUSY;
+
+    return 0;
+  }
+
   int valueSize = (type == COILS) ? sizeof(uint8_t) : sizeof(uint16_t);
 
   _values = realloc(_values, nb * valueSize);
@@ -288,22 +314,39 @@ int ModbusClient::write(unsigned int value)
 }
 
 int ModbusClient::endTransmission()
+{
+  if (!startTransmission()) {
+    return 0;
+  }
+
+  uint8_t response[MODBUS_MAX_ADU_LENGTH];
+
+  return complete(modbus_wait_confirmation(_mb, response, NULL));
+}
+
+int ModbusClient::startTransmission()
 {
   if (!_transmissionBegun) {
     return 0;
   }
 
+  if (_pending) {
+    errno = EBUSY;
+
+    return 0;
+  }
+
   int result = -1;
 
   modbus_set_slave(_mb, _id);
 
   switch (_type) {
     case COILS:
-      result = modbus_write_bits(_mb, _address, _nb, (const uint8_t*)_values);
+      result = modbus_send_request(_mb, MODBUS_FC_WRITE_MULTIPLE_COILS, _address, _nb, _values);
       break;
 
     case HOLDING_REGISTERS:
-      result = modbus_write_registers(_mb, _address, _nb, (const uint16_t*)_values);
+      result = modbus_send_request(_mb, MODBUS_FC_WRITE_MULTIPLE_REGISTERS, _address, _nb, _values);
       break;
 
     default:
@@ -316,7 +359,16 @@ int ModbusClient::endTransmission()
   _availableForWrite = 0;
   _written = 0;
 
-  return (result < 0) ? 0 : 1;
+  if (result < 0) {
+    _result = 0;
+
+    return 0;
+  }
+
+  _pending = true;
+  _pendingRead = false;
+
+  return 1;
 }
 
 int ModbusClient::requestFrom(int type, int address, int nb)
@@ -325,6 +377,22 @@ int ModbusClient::requestFrom(int type, int address, int nb)
 }
 
 int ModbusClient::requestFrom(int id, int type, int address, int nb)
+{
+  if (!startRequest(id, type, address, nb)) {
+    return 0;
+  }
+
+  uint8_t response[MODBUS_MAX_ADU_LENGTH];
+
+  return complete(modbus_wait_confirmation(_mb, response, _values));
+}
+
+int ModbusClient::startRequest(int type, int address, int nb)
+{
+  return startRequest(_defaultId, type, address, nb);
+}
+
+int ModbusClient::startRequest(int id, int type, int address, int nb)
 {
   if ((type != COILS && type != DISCRETE_INPUTS && type != HOLDING_REGISTERS && type != INPUT_REGISTERS) 
       || (nb < 1)) {
@@ -333,6 +401,12 @@ int ModbusClient::requestFrom(int id, int type, int address, int nb)
     return 0;
   }
 
+  if (_pending) {
+    errno = EBUSY;
+
+    return 0;
+  }
+
   int valueSize = (type == COILS || type == DISCRETE_INPUTS) ? sizeof(uint8_t) : sizeof(uint16_t);
 
   _values = realloc(_values, nb * valueSize);
@@ -349,19 +423,19 @@ int ModbusClient::requestFrom(int id, int type, int address, int nb)
 
   switch (type) {
     case COILS:
-      result = modbus_read_bits(_mb, address, nb, (uint8_t*)_values);
+      result = modbus_send_request(_mb, MODBUS_FC_READ_COILS, address, nb, NULL);
       break;
 
     case DISCRETE_INPUTS:
-      result = modbus_read_input_bits(_mb, address, nb, (uint8_t*)_values);
+      result = modbus_send_request(_mb, MODBUS_FC_READ_DISCRETE_INPUTS, address, nb, NULL);
       break;
 
     case HOLDING_REGISTERS:
-      result = modbus_read_registers(_mb, address, nb, (uint16_t*)_values);
+      result = modbus_send_request(_mb, MODBUS_FC_READ_HOLDING_REGISTERS, address, nb, NULL);
       break;
 
     case INPUT_REGISTERS:
-      result = modbus_read_input_registers(_mb, address, nb, (uint16_t*)_values);
+      result = modbus_send_request(_mb, MODBUS_FC_READ_INPUT_REGISTERS, address, nb, NULL);
       break;
 
     default:
@@ -374,12 +448,72 @@ int ModbusClient::requestFrom(int id, int type, int address, int nb)
 
   _transmissionBegun = false;
   _type = type;
-  _available = nb;
+  _nb = nb;
+  _available = 0;
   _read = 0;
   _availableForWrite = 0;
   _written = 0;
 
-  return nb;
+  _pending = true;
+  _pendingRead = true;
+
+  return 1;
+}
+
+int ModbusClient::poll()
+{
+  if (!_pending) {
+    return 1;
+  }
+
+  if (_response == NULL) {
+    _response = (uint8_t*)malloc(MODBUS_MAX_ADU_LENGTH);
+
+    if (_response == NULL) {
+      // the confirmation can't be received, drop the request
+      modbus_flush(_mb);
+      errno = ENOMEM;
+      complete(-1);
+
+      return 1;
+    }
+  }
+
+  int rc = modbus_poll_confirmation(_mb, _response, _pendingRead ? _values : NULL);
+
+  if (rc == -1 && errno == EAGAIN) {
+    return 0;
+  }
+
+  complete(rc);
+
+  return 1;
+}
+
+int ModbusClient::isComplete()
+{
+  return _pending ? 0 : 1;
+}
+
+int ModbusClient::result()
+{
+  return _result;
+}
+
+int ModbusClient::complete(int rc)
+{
+  _pending = false;
+
+  if (rc == -1) {
+    _result = 0;
+  } else if (_pendingRead) {
+    _result = _nb;
+    _available = _nb;
+  } else {
+    _result = 1;
+  }
+
+  return _result;
 }
 
 int ModbusClient::available()
@@ -429,13 +563,33 @@ const char* ModbusClient::lastError()
 
 void ModbusClient::setTimeout(unsigned long responseTimeoutMs)
 {
-  _timeout = responseTimeoutMs;
+  if (responseTimeoutMs > ULONG_MAX / 1000) {
+    responseTimeoutMs = ULONG_MAX / 1000;
+  }
+
+  setTimeoutMicros(responseTimeoutMs * 1000);
+}
+
+void ModbusClient::setTimeoutMicros(unsigned long responseTimeoutUs)
+{
+  _timeoutMicros = responseTimeoutUs;
 
   if (_mb) {
-    modbus_set_response_timeout(_mb, _timeout / 1000, (_timeout % 1000) * 1000);
+    modbus_set_response_timeout(_mb, _timeoutMicros / 1000000, _timeoutMicros % 1000000);
   }
 }
 
+int ModbusClient::setIdleCallback(modbus_idle_cb_t callback)
+{
+  if (_mb == NULL) {
+    return 0;
+  }
+
+  modbus_set_idle_callback(_mb, callback);
+
+  return 1;
+}
+
 void ModbusClient::setByteTimeout(unsigned long byteTimeoutMs)
 {
   if (_mb) {
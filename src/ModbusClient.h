@@ -172,6 +172,57 @@ public:
   int requestFrom(int type, int address, int nb);
   int requestFrom(int id, int type, int address,int nb);
 
+  /**
+   * Start a read of multiple coils, discrete inputs, holding registers, or
+   * input register values without waiting for the response.
+   *
+   * Call poll() until it returns 1, then use result(), available() and
+   * read() to process the read values. Other requests fail while this one
+   * is in progress.
+   *
+   * @param id (slave) id of target, defaults to 0x00 if not specified
+   * @param type type of read to perform, either COILS, DISCRETE_INPUTS,
+   *             HOLDING_REGISTERS, or INPUT_REGISTERS
+   * @param address start address to use for operation
+   * @param nb number of values to read
+   *
+   * @return 1 on success, 0 on failure
+   */
+  int startRequest(int type, int address, int nb);
+  int startRequest(int id, int type, int address, int nb);
+
+  /**
+   * End the process of a writing multiple coils or holding registers like
+   * endTransmission(), without waiting for the response.
+   *
+   * Call poll() until it returns 1, then use result() to check the outcome.
+   *
+   * @return 1 on success, 0 on failure
+   */
+  int startTransmission();
+
+  /**
+   * Process the response of the request started by startRequest(...) or
+   * startTransmission(), without waiting.
+   *
+   * @return 1 when the request is complete, 0 while the response is awaited
+   */
+  int poll();
+
+  /**
+   * Query whether the last request started is complete
+   *
+   * @return 1 when complete, 0 while the response is awaited
+   */
+  int isComplete();
+
+  /**
+   * Query the result of the last request completed
+   *
+   * @return number of values read for a read, 1 for a write, 0 on failure
+   */
+  int result();
+
   /**
    * Query the number of values available to read after calling
    * requestFrom(...)
@@ -203,17 +254,38 @@ public:
    * Set response timeout (in milliseconds)
    */
   void setTimeout(unsigned long ms);
+
+  /**
+   * Set response timeout (in microseconds), for fast buses needing less
+   * than a millisecond
+   */
+  void setTimeoutMicros(unsigned long us);
+
+  /**
+   * Set the function called while waiting for a response, to let the rest
+   * of the firmware run. By default it yields, and sleeps for a tick on
+   * Mbed OS boards.
+   *
+   * @param callback function called with the microseconds left to wait,
+   *        NULL to spin without pause
+   *
+   * @return 1 on success, 0 on failure
+   */
+  int setIdleCallback(modbus_idle_cb_t callback);
   void setByteTimeout(unsigned long byteTimeoutMs);
 
 protected:
+  friend class ModbusTCPGateway;
+
   ModbusClient(unsigned long defaultTimeout);
   virtual ~ModbusClient();
 
   int begin(modbus_t* _mb, int defaultId);
 
-private:
   modbus_t* _mb;
-  unsigned long _timeout;
+
+private:
+  unsigned long _timeoutMicros;
   int _defaultId;
 
   bool _transmissionBegun;
@@ -227,6 +299,13 @@ private:
   int _read;
   int _availableForWrite;
   int _written;
+
+  uint8_t* _response;
+  bool _pending;
+  bool _pendingRead;
+  int _result;
+
+  int complete(int rc);
 };
 
 #endif
@@ -57,4 +57,18 @@ int ModbusRTUClientClass::begin(RS485Class& rs485, unsigned long baudrate, uint1
   return begin(baudrate, config);
 }
 
+void ModbusRTUClientClass::setCharTimeout(unsigned long us)
+{
+  if (_mb) {
+    modbus_rtu_set_char_timeout(_mb, us);
+  }
+}
+
+void ModbusRTUClientClass::setFrameDelay(unsigned long us)
+{
+  if (_mb) {
+    modbus_rtu_set_frame_delay(_mb, us);
+  }
+}
+
 ModbusRTUClientClass ModbusRTUClient;
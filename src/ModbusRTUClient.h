@@ -40,6 +40,26 @@ public:
   int begin(unsigned long baudrate, uint16_t config = SERIAL_8N1);
   int begin(RS485Class& rs485, unsigned long baudrate, uint16_t config = SERIAL_8N1);
 
+  /**
+   * Set the inter-character timeout (t1.5): a frame is dropped as
+   * incomplete after a silence of this duration. Defaults to 1.5 character
+   * times at the baud rate and serial config of begin(), 750 us above
+   * 19200 bauds.
+   *
+   * @param us timeout in microseconds, 0 to restore the default
+   */
+  void setCharTimeout(unsigned long us);
+
+  /**
+   * Set the inter-frame delay (t3.5): the line is left silent for this
+   * duration after a frame is received before transmitting. Defaults to 3.5
+   * character times at the baud rate and serial config of begin(), 1750 us
+   * above 19200 bauds.
+   *
+   * @param us delay in microseconds, 0 to restore the default
+   */
+  void setFrameDelay(unsigned long us);
+
 private:
   RS485Class* _rs485 = &RS485;
 };
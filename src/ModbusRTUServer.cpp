@@ -67,16 +67,28 @@ int ModbusRTUServerClass::begin(RS485Class& rs485, int id, unsigned long baudrat
 
 int ModbusRTUServerClass::poll()
 {
-  uint8_t request[MODBUS_RTU_MAX_ADU_LENGTH];
-
-  int requestLength = modbus_receive(_mb, request);
+  int requestLength = modbus_receive_poll(_mb, _request);
 
   if (requestLength > 0) {
-    modbus_reply(_mb, request, requestLength, &_mbMapping);
+    modbus_reply_in_place(_mb, _request, requestLength, &_mbMapping);
     return 1;
   }
   return 0;
 }
 
+void ModbusRTUServerClass::setCharTimeout(unsigned long us)
+{
+  if (_mb) {
+    modbus_rtu_set_char_timeout(_mb, us);
+  }
+}
+
+void ModbusRTUServerClass::setFrameDelay(unsigned long us)
+{
+  if (_mb) {
+    modbus_rtu_set_frame_delay(_mb, us);
+  }
+}
+
 
 ModbusRTUServerClass ModbusRTUServer;
@@ -23,6 +23,10 @@
 #include "ModbusServer.h"
 #include <ArduinoRS485.h>
 
+extern "C" {
+#include "libmodbus/modbus-rtu.h"
+}
+
 class ModbusRTUServerClass : public ModbusServer {
 public:
   ModbusRTUServerClass();
@@ -42,12 +46,34 @@ public:
   int begin(RS485Class& rs485, int id, unsigned long baudrate, uint16_t config = SERIAL_8N1);
 
   /**
-   * Poll interface for requests
+   * Set the inter-character timeout (t1.5): a frame is dropped as
+   * incomplete after a silence of this duration. Defaults to 1.5 character
+   * times at the baud rate and serial config of begin(), 750 us above
+   * 19200 bauds.
+   *
+   * @param us timeout in microseconds, 0 to restore the default
+   */
+  void setCharTimeout(unsigned long us);
+
+  /**
+   * Set the inter-frame delay (t3.5): the line is left silent for this
+   * duration after a frame is received before transmitting. Defaults to 3.5
+   * character times at the baud rate and serial config of begin(), 1750 us
+   * above 19200 bauds.
+   *
+   * @param us delay in microseconds, 0 to restore the default
+   */
+  void setFrameDelay(unsigned long us);
+
+  /**
+   * Poll interface for requests, doesn't wait for the rest of a request
+   * partially received
    */
   virtual int poll();
 
 private:
   RS485Class* _rs485 = &RS485;
+  uint8_t _request[MODBUS_RTU_MAX_ADU_LENGTH];
 };
 
 extern ModbusRTUServerClass ModbusRTUServer;
@@ -29,6 +29,11 @@ ModbusServer::ModbusServer() :
 
 ModbusServer::~ModbusServer()
 {
+  for (int table = 0; table < MODBUS_TABLE_MAX; table++) {
+    modbus_mapping_remove_segments(&_mbMapping, (modbus_table_t)table);
+    modbus_mapping_disable_paging(&_mbMapping, (modbus_table_t)table);
+  }
+
   if (_mbMapping.tab_bits != NULL) {
     free(_mbMapping.tab_bits);
   }
@@ -64,7 +69,7 @@ void ModbusServer::setByteTimeout(unsigned long byteTimeoutMs) {
 }
 
 
-int ModbusServer::configureCoils(int startAddress, int nb)
+int ModbusServer::configureCoils(int startAddress, int nb, bool packed)
 {
   if (startAddress < 0 || nb < 1) {
     errno = EINVAL;
@@ -72,7 +77,10 @@ int ModbusServer::configureCoils(int startAddress, int nb)
     return -1;
   }
 
-  size_t s = sizeof(_mbMapping.tab_bits[0]) * nb;
+  modbus_mapping_remove_segments(&_mbMapping, MODBUS_TABLE_BITS);
+  modbus_mapping_disable_paging(&_mbMapping, MODBUS_TABLE_BITS);
+
+  size_t s = sizeof(_mbMapping.tab_bits[0]) * (packed ? (nb + 7) / 8 : nb);
 
   _mbMapping.tab_bits = (uint8_t*)realloc(_mbMapping.tab_bits, s);
 
@@ -86,11 +94,16 @@ int ModbusServer::configureCoils(int startAddress, int nb)
   memset(_mbMapping.tab_bits, 0x00, s);
   _mbMapping.start_bits = startAddress;
   _mbMapping.nb_bits = nb;
+  if (packed) {
+    _mbMapping.flags |= MODBUS_MAPPING_PACKED_BITS;
+  } else {
+    _mbMapping.flags &= ~MODBUS_MAPPING_PACKED_BITS;
+  }
 
   return 1;
 }
 
-int ModbusServer::configureDiscreteInputs(int startAddress, int nb)
+int ModbusServer::configureDiscreteInputs(int startAddress, int nb, bool packed)
 {
   if (startAddress < 0 || nb < 1) {
     errno = EINVAL;
@@ -98,7 +111,10 @@ int ModbusServer::configureDiscreteInputs(int startAddress, int nb)
     return -1;
   }
 
-  size_t s = sizeof(_mbMapping.tab_input_bits[0]) * nb;
+  modbus_mapping_remove_segments(&_mbMapping, MODBUS_TABLE_INPUT_BITS);
+  modbus_mapping_disable_paging(&_mbMapping, MODBUS_TABLE_INPUT_BITS);
+
+  size_t s = sizeof(_mbMapping.tab_input_bits[0]) * (packed ? (nb + 7) / 8 : nb);
 
   _mbMapping.tab_input_bits = (uint8_t*)realloc(_mbMapping.tab_input_bits, s);
 
@@ -112,11 +128,16 @@ int ModbusServer::configureDiscreteInputs(int startAddress, int nb)
   memset(_mbMapping.tab_input_bits, 0x00, s);
   _mbMapping.start_input_bits = startAddress;
   _mbMapping.nb_input_bits = nb;
+  if (packed) {
+    _mbMapping.flags |= MODBUS_MAPPING_PACKED_INPUT_BITS;
+  } else {
+    _mbMapping.flags &= ~MODBUS_MAPPING_PACKED_INPUT_BITS;
+  }
 
   return 1;
 }
 
-int ModbusServer::configureHoldingRegisters(int startAddress, int nb)
+int ModbusServer::configureHoldingRegisters(int startAddress, int nb, bool wireOrder)
 {
   if (startAddress < 0 || nb < 1) {
     errno = EINVAL;
@@ -124,6 +145,9 @@ int ModbusServer::configureHoldingRegisters(int startAddress, int nb)
     return -1;
   }
 
+  modbus_mapping_remove_segments(&_mbMapping, MODBUS_TABLE_REGISTERS);
+  modbus_mapping_disable_paging(&_mbMapping, MODBUS_TABLE_REGISTERS);
+
   size_t s = sizeof(_mbMapping.tab_registers[0]) * nb;
 
   _mbMapping.tab_registers = (uint16_t*)realloc(_mbMapping.tab_registers, s);
@@ -138,11 +162,16 @@ int ModbusServer::configureHoldingRegisters(int startAddress, int nb)
   memset(_mbMapping.tab_registers, 0x00, s);
   _mbMapping.start_registers = startAddress;
   _mbMapping.nb_registers = nb;
+  if (wireOrder) {
+    _mbMapping.flags |= MODBUS_MAPPING_WIRE_ORDER_REGISTERS;
+  } else {
+    _mbMapping.flags &= ~MODBUS_MAPPING_WIRE_ORDER_REGISTERS;
+  }
 
   return 1;
 }
 
-int ModbusServer::configureInputRegisters(int startAddress, int nb)
+int ModbusServer::configureInputRegisters(int startAddress, int nb, bool wireOrder)
 {
   if (startAddress < 0 || nb < 1) {
     errno = EINVAL;
@@ -150,6 +179,9 @@ int ModbusServer::configureInputRegisters(int startAddress, int nb)
     return -1;
   }
 
+  modbus_mapping_remove_segments(&_mbMapping, MODBUS_TABLE_INPUT_REGISTERS);
+  modbus_mapping_disable_paging(&_mbMapping, MODBUS_TABLE_INPUT_REGISTERS);
+
   size_t s = sizeof(_mbMapping.tab_input_registers[0]) * nb;
 
   _mbMapping.tab_input_registers = (uint16_t*)realloc(_mbMapping.tab_input_registers, s);
@@ -164,101 +196,262 @@ int ModbusServer::configureInputRegisters(int startAddress, int nb)
   memset(_mbMapping.tab_input_registers, 0x00, s);
   _mbMapping.start_input_registers = startAddress;
   _mbMapping.nb_input_registers = nb;
+  if (wireOrder) {
+    _mbMapping.flags |= MODBUS_MAPPING_WIRE_ORDER_INPUT_REGISTERS;
+  } else {
+    _mbMapping.flags &= ~MODBUS_MAPPING_WIRE_ORDER_INPUT_REGISTERS;
+  }
 
   return 1;
 }
 
-int ModbusServer::coilRead(int address)
+int ModbusServer::configurePaging(bool strict, bool packed, bool wireOrder)
 {
-  if (_mbMapping.start_bits > address || 
-      (_mbMapping.start_bits + _mbMapping.nb_bits) < (address + 1)) {
-    errno = EMBXILADD;
-
-    return -1;
+  // the configured blocks are replaced by the whole address space
+  for (int table = 0; table < MODBUS_TABLE_MAX; table++) {
+    modbus_mapping_remove_segments(&_mbMapping, (modbus_table_t)table);
+    modbus_mapping_disable_paging(&_mbMapping, (modbus_table_t)table);
+  }
+
+  free(_mbMapping.tab_bits);
+  free(_mbMapping.tab_input_bits);
+  free(_mbMapping.tab_input_registers);
+  free(_mbMapping.tab_registers);
+  _mbMapping.tab_bits = NULL;
+  _mbMapping.tab_input_bits = NULL;
+  _mbMapping.tab_input_registers = NULL;
+  _mbMapping.tab_registers = NULL;
+  _mbMapping.nb_bits = 0;
+  _mbMapping.nb_input_bits = 0;
+  _mbMapping.nb_input_registers = 0;
+  _mbMapping.nb_registers = 0;
+
+  // the layouts of the blocks configured before don't apply anymore
+  if (packed) {
+    _mbMapping.flags |= MODBUS_MAPPING_PACKED_BITS | MODBUS_MAPPING_PACKED_INPUT_BITS;
+  } else {
+    _mbMapping.flags &= ~(MODBUS_MAPPING_PACKED_BITS | MODBUS_MAPPING_PACKED_INPUT_BITS);
+  }
+
+  if (strict) {
+    _mbMapping.flags |= MODBUS_MAPPING_STRICT_PAGES;
+  } else {
+    _mbMapping.flags &= ~MODBUS_MAPPING_STRICT_PAGES;
+  }
+
+  if (wireOrder) {
+    _mbMapping.flags |= MODBUS_MAPPING_WIRE_ORDER_REGISTERS | MODBUS_MAPPING_WIRE_ORDER_INPUT_REGISTERS;
+  } else {
+    _mbMapping.flags &= ~(MODBUS_MAPPING_WIRE_ORDER_REGISTERS | MODBUS_MAPPING_WIRE_ORDER_INPUT_REGISTERS);
+  }
+
+  for (int table = 0; table < MODBUS_TABLE_MAX; table++) {
+    if (modbus_mapping_enable_paging(&_mbMapping, (modbus_table_t)table) < 0) {
+      return 0;
+    }
   }
 
-  return _mbMapping.tab_bits[address - _mbMapping.start_bits];
+  return 1;
 }
 
-int ModbusServer::discreteInputRead(int address)
+int ModbusServer::addCoils(int startAddress, int nb)
 {
-  if (_mbMapping.start_input_bits > address || 
-      (_mbMapping.start_input_bits + _mbMapping.nb_input_bits) < (address + 1)) {
-    errno = EMBXILADD;
+  if (modbus_mapping_add_segment(&_mbMapping, MODBUS_TABLE_BITS, startAddress, nb) < 0) {
+    return 0;
+  }
 
-    return -1;
+  return 1;
+}
+
+int ModbusServer::addDiscreteInputs(int startAddress, int nb)
+{
+  if (modbus_mapping_add_segment(&_mbMapping, MODBUS_TABLE_INPUT_BITS, startAddress, nb) < 0) {
+    return 0;
   }
 
-  return _mbMapping.tab_input_bits[address - _mbMapping.start_input_bits];
+  return 1;
 }
 
-long ModbusServer::holdingRegisterRead(int address)
+int ModbusServer::addHoldingRegisters(int startAddress, int nb)
 {
-  if (_mbMapping.start_registers > address ||
-      (_mbMapping.start_registers + _mbMapping.nb_registers) < (address + 1)) {
-    errno = EMBXILADD;
+  if (modbus_mapping_add_segment(&_mbMapping, MODBUS_TABLE_REGISTERS, startAddress, nb) < 0) {
+    return 0;
+  }
 
-    return -1;
+  return 1;
+}
+
+int ModbusServer::addInputRegisters(int startAddress, int nb)
+{
+  if (modbus_mapping_add_segment(&_mbMapping, MODBUS_TABLE_INPUT_REGISTERS, startAddress, nb) < 0) {
+    return 0;
   }
 
-  return _mbMapping.tab_registers[address - _mbMapping.start_registers];
+  return 1;
 }
 
-long ModbusServer::inputRegisterRead(int address)
+int ModbusServer::coilRead(int address)
 {
-  if (_mbMapping.start_input_registers > address || 
-      (_mbMapping.start_input_registers + _mbMapping.nb_input_registers) < (address + 1)) {
-    errno = EMBXILADD;
+  uint8_t* tab;
+  int index;
+  int value;
+  unsigned int sequence;
 
-    return -1;
-  }
+  // copied again when it's updated meanwhile
+  do {
+    sequence = modbus_mapping_read_begin(&_mbMapping, MODBUS_TABLE_BITS);
+
+    if (!modbus_mapping_locate(&_mbMapping, MODBUS_TABLE_BITS, address, (void**)&tab, &index)) {
+      errno = EMBXILADD;
 
- return _mbMapping.tab_input_registers[address - _mbMapping.start_input_registers];
+      return -1;
+    }
+
+    if (tab == NULL) {
+      // untouched page
+      value = 0;
+    } else if (_mbMapping.flags & MODBUS_MAPPING_PACKED_BITS) {
+      value = MODBUS_GET_PACKED_BIT(tab, index);
+    } else {
+      value = tab[index];
+    }
+  } while (modbus_mapping_read_retry(&_mbMapping, MODBUS_TABLE_BITS, sequence));
+
+  return value;
 }
 
-int ModbusServer::coilWrite(int address, uint8_t value)
+int ModbusServer::discreteInputRead(int address)
 {
-  if (_mbMapping.start_bits > address ||
-      (_mbMapping.start_bits + _mbMapping.nb_bits) < (address + 1)) {
-    errno = EMBXILADD;
+  uint8_t* tab;
+  int index;
+  int value;
+  unsigned int sequence;
 
-    return 0;
-  }
+  // copied again when it's updated meanwhile
+  do {
+    sequence = modbus_mapping_read_begin(&_mbMapping, MODBUS_TABLE_INPUT_BITS);
 
-  _mbMapping.tab_bits[address - _mbMapping.start_bits] = value;
+    if (!modbus_mapping_locate(&_mbMapping, MODBUS_TABLE_INPUT_BITS, address, (void**)&tab, &index)) {
+      errno = EMBXILADD;
 
-  return 1;
+      return -1;
+    }
+
+    if (tab == NULL) {
+      // untouched page
+      value = 0;
+    } else if (_mbMapping.flags & MODBUS_MAPPING_PACKED_INPUT_BITS) {
+      value = MODBUS_GET_PACKED_BIT(tab, index);
+    } else {
+      value = tab[index];
+    }
+  } while (modbus_mapping_read_retry(&_mbMapping, MODBUS_TABLE_INPUT_BITS, sequence));
+
+  return value;
 }
 
-int ModbusServer::holdingRegisterWrite(int address, uint16_t value)
+long ModbusServer::holdingRegisterRead(int address)
 {
-  if (_mbMapping.start_registers > address || 
-      (_mbMapping.start_registers + _mbMapping.nb_registers) < (address + 1)) {
-    errno = EMBXILADD;
+  uint16_t* tab;
+  int index;
+  long value;
+  unsigned int sequence;
 
-    return 0;
-  }
+  // copied again when it's updated meanwhile
+  do {
+    sequence = modbus_mapping_read_begin(&_mbMapping, MODBUS_TABLE_REGISTERS);
 
-  _mbMapping.tab_registers[address - _mbMapping.start_registers] = value;
+    if (!modbus_mapping_locate(&_mbMapping, MODBUS_TABLE_REGISTERS, address, (void**)&tab, &index)) {
+      errno = EMBXILADD;
 
-  return 1;
+      return -1;
+    }
+
+    if (tab == NULL) {
+      // untouched page
+      value = 0;
+    } else if (_mbMapping.flags & MODBUS_MAPPING_WIRE_ORDER_REGISTERS) {
+      value = MODBUS_GET_WIRE_REGISTER(tab, index);
+    } else {
+      value = tab[index];
+    }
+  } while (modbus_mapping_read_retry(&_mbMapping, MODBUS_TABLE_REGISTERS, sequence));
+
+  return value;
+}
+
+long ModbusServer::inputRegisterRead(int address)
+{
+  uint16_t* tab;
+  int index;
+  long value;
+  unsigned int sequence;
+
+  // copied again when it's updated meanwhile
+  do {
+    sequence = modbus_mapping_read_begin(&_mbMapping, MODBUS_TABLE_INPUT_REGISTERS);
+
+    if (!modbus_mapping_locate(&_mbMapping, MODBUS_TABLE_INPUT_REGISTERS, address, (void**)&tab, &index)) {
+      errno = EMBXILADD;
+
+      return -1;
+    }
+
+    if (tab == NULL) {
+      // untouched page
+      value = 0;
+    } else if (_mbMapping.flags & MODBUS_MAPPING_WIRE_ORDER_INPUT_REGISTERS) {
+      value = MODBUS_GET_WIRE_REGISTER(tab, index);
+    } else {
+      value = tab[index];
+    }
+  } while (modbus_mapping_read_retry(&_mbMapping, MODBUS_TABLE_INPUT_REGISTERS, sequence));
+
+  return value;
+}
+
+int ModbusServer::coilWrite(int address, uint8_t value)
+{
+  return writeBits(MODBUS_TABLE_BITS, address, &value, 1);
+}
+
+int ModbusServer::holdingRegisterWrite(int address, uint16_t value)
+{
+  return writeRegisters(MODBUS_TABLE_REGISTERS, address, &value, 1);
+}
+
+int ModbusServer::writeHoldingRegisters(int address, uint16_t values[], int nb)
+{
+  return writeRegisters(MODBUS_TABLE_REGISTERS, address, values, nb);
 }
 
 int ModbusServer::registerMaskWrite(int address, uint16_t andMask, uint16_t orMask)
 {
-  long value = holdingRegisterRead(address);
+  uint16_t* tab;
+  int index;
+
+  if (!isMapped(MODBUS_TABLE_REGISTERS, address, 1)) {
+    errno = EMBXILADD;
 
-  if (value < 0) {
     return 0;
   }
 
-  value &= andMask;
-  value |= orMask;
-
-  if (!holdingRegisterWrite(address, value)) {
+  if (modbus_mapping_touch(&_mbMapping, MODBUS_TABLE_REGISTERS, address, 1) < 0) {
     return 0;
   }
 
+  // read, modify and write in the same update
+  modbus_mapping_write_begin(&_mbMapping, MODBUS_TABLE_REGISTERS);
+
+  modbus_mapping_locate(&_mbMapping, MODBUS_TABLE_REGISTERS, address, (void**)&tab, &index);
+  if (_mbMapping.flags & MODBUS_MAPPING_WIRE_ORDER_REGISTERS) {
+    MODBUS_SET_WIRE_REGISTER(tab, index, (MODBUS_GET_WIRE_REGISTER(tab, index) & andMask) | orMask);
+  } else {
+    tab[index] = (tab[index] & andMask) | orMask;
+  }
+
+  modbus_mapping_write_end(&_mbMapping, MODBUS_TABLE_REGISTERS);
+
   return 1;
 }
 
@@ -269,37 +462,122 @@ int ModbusServer::discreteInputWrite(int address, uint8_t value)
 
 int ModbusServer::writeDiscreteInputs(int address, uint8_t values[], int nb)
 {
-  if (_mbMapping.start_input_bits > address || 
-      (_mbMapping.start_input_bits + _mbMapping.nb_input_bits) < (address + nb)) {
+  return writeBits(MODBUS_TABLE_INPUT_BITS, address, values, nb);
+}
+
+int ModbusServer::inputRegisterWrite(int address, uint16_t value)
+{
+  return writeInputRegisters(address, &value, 1);
+}
+
+int ModbusServer::writeInputRegisters(int address, uint16_t values[], int nb)
+{
+  return writeRegisters(MODBUS_TABLE_INPUT_REGISTERS, address, values, nb);
+}
+
+int ModbusServer::writeBits(modbus_table_t table, int address, uint8_t values[], int nb)
+{
+  int packed = _mbMapping.flags &
+    (table == MODBUS_TABLE_BITS ? MODBUS_MAPPING_PACKED_BITS : MODBUS_MAPPING_PACKED_INPUT_BITS);
+
+  if (!isMapped(table, address, nb)) {
     errno = EMBXILADD;
 
     return 0;
   }
 
-  memcpy(&_mbMapping.tab_input_bits[address - _mbMapping.start_input_bits], values, sizeof(values[0]) * nb);
+  if (modbus_mapping_touch(&_mbMapping, table, address, nb) < 0) {
+    return 0;
+  }
+
+  // the values are seen all together by the clients
+  modbus_mapping_write_begin(&_mbMapping, table);
+
+  // the range can span several contiguous segments
+  for (int i = 0, n; i < nb; i += n) {
+    uint8_t* tab;
+    int index;
+
+    n = modbus_mapping_locate(&_mbMapping, table, address + i, (void**)&tab, &index);
+    if (n > nb - i) {
+      n = nb - i;
+    }
+
+    if (packed) {
+      for (int j = 0; j < n; j++) {
+        MODBUS_SET_PACKED_BIT(tab, index + j, values[i + j]);
+      }
+    } else {
+      memcpy(&tab[index], &values[i], sizeof(values[0]) * n);
+    }
+  }
+
+  modbus_mapping_write_end(&_mbMapping, table);
 
   return 1;
 }
 
-int ModbusServer::inputRegisterWrite(int address, uint16_t value)
+int ModbusServer::writeRegisters(modbus_table_t table, int address, uint16_t values[], int nb)
 {
-  return writeInputRegisters(address, &value, 1);
-}
+  int wireOrder = _mbMapping.flags &
+    (table == MODBUS_TABLE_REGISTERS ? MODBUS_MAPPING_WIRE_ORDER_REGISTERS : MODBUS_MAPPING_WIRE_ORDER_INPUT_REGISTERS);
 
-int ModbusServer::writeInputRegisters(int address, uint16_t values[], int nb)
-{
-  if (_mbMapping.start_input_registers > address || 
-      (_mbMapping.start_input_registers + _mbMapping.nb_input_registers) < (address + nb)) {
+  if (!isMapped(table, address, nb)) {
     errno = EMBXILADD;
 
     return 0;
   }
 
-  memcpy(&_mbMapping.tab_input_registers[address - _mbMapping.start_input_registers], values, sizeof(values[0]) * nb);
+  if (modbus_mapping_touch(&_mbMapping, table, address, nb) < 0) {
+    return 0;
+  }
+
+  // the values are seen all together by the clients
+  modbus_mapping_write_begin(&_mbMapping, table);
+
+  // the range can span several contiguous segments
+  for (int i = 0, n; i < nb; i += n) {
+    uint16_t* tab;
+    int index;
+
+    n = modbus_mapping_locate(&_mbMapping, table, address + i, (void**)&tab, &index);
+    if (n > nb - i) {
+      n = nb - i;
+    }
+
+    if (wireOrder) {
+      for (int j = 0; j < n; j++) {
+        MODBUS_SET_WIRE_REGISTER(tab, index + j, values[i + j]);
+      }
+    } else {
+      memcpy(&tab[index], &values[i], sizeof(values[0]) * n);
+    }
+  }
+
+  modbus_mapping_write_end(&_mbMapping, table);
 
   return 1;
 }
 
+bool ModbusServer::isMapped(modbus_table_t table, int address, int nb)
+{
+  void* tab;
+  int index;
+
+  while (nb > 0) {
+    int n = modbus_mapping_locate(&_mbMapping, table, address, &tab, &index);
+
+    if (n == 0) {
+      return false;
+    }
+
+    address += n;
+    nb -= n;
+  }
+
+  return true;
+}
+
 int ModbusServer::setId(int id)
 {
   if (_mb == NULL) {
@@ -339,6 +617,17 @@ int ModbusServer::setEventCallback(modbus_event_cb_t callback)
     return 1;
 }
 
+int ModbusServer::setIdleCallback(modbus_idle_cb_t callback)
+{
+    if (_mb == NULL) {
+        return 0;
+    }
+
+    modbus_set_idle_callback(_mb, callback);
+
+    return 1;
+}
+
 int ModbusServer::setCallbacks(callback_mapping_t* callbacks)
 {
   if (_mb == NULL) {
@@ -352,6 +641,11 @@ int ModbusServer::setCallbacks(callback_mapping_t* callbacks)
 
 void ModbusServer::end()
 {
+  for (int table = 0; table < MODBUS_TABLE_MAX; table++) {
+    modbus_mapping_remove_segments(&_mbMapping, (modbus_table_t)table);
+    modbus_mapping_disable_paging(&_mbMapping, (modbus_table_t)table);
+  }
+
   if (_mbMapping.tab_bits != NULL) {
     free(_mbMapping.tab_bits);
   }
@@ -34,40 +34,100 @@ public:
    *
    * @param startAddress start address of coils
    * @param nb number of coils to configure
+   * @param packed store 8 coils per byte instead of one per byte
    *
    * @return 0 on success, 1 on failure
    */
-  int configureCoils(int startAddress, int nb);
+  int configureCoils(int startAddress, int nb, bool packed = false);
 
   /**
    * Configure the servers discrete inputs.
    *
    * @param startAddress start address of discrete inputs
    * @param nb number of discrete inputs to configure
+   * @param packed store 8 discrete inputs per byte instead of one per byte
    *
    * @return 0 on success, 1 on failure
    */
-  int configureDiscreteInputs(int startAddress, int nb);
+  int configureDiscreteInputs(int startAddress, int nb, bool packed = false);
 
   /**
    * Configure the servers holding registers.
    *
    * @param startAddress start address of holding registers
    * @param nb number of holding registers to configure
+   * @param wireOrder store the registers in network byte order
    *
    * @return 0 on success, 1 on failure
    */
-  int configureHoldingRegisters(int startAddress, int nb);
+  int configureHoldingRegisters(int startAddress, int nb, bool wireOrder = false);
 
   /**
    * Configure the servers input registers.
    *
    * @param startAddress start address of input registers
    * @param nb number of input registers to configure
+   * @param wireOrder store the registers in network byte order
    *
    * @return 0 on success, 1 on failure
    */
-  int configureInputRegisters(int startAddress, int nb);
+  int configureInputRegisters(int startAddress, int nb, bool wireOrder = false);
+
+  /**
+   * Expose the whole address space (0 to 65535) of the coils, discrete
+   * inputs, holding registers and input registers instead of configured
+   * blocks. The storage is allocated by pages of 256 addresses on the first
+   * write, untouched pages read as zero.
+   *
+   * @param strict reply an illegal data address exception to the reads of
+   *        untouched pages instead of zeros
+   * @param packed store 8 coils or discrete inputs per byte instead of one per byte
+   * @param wireOrder store the registers in network byte order
+   *
+   * @return 1 on success, 0 on failure
+   */
+  int configurePaging(bool strict = false, bool packed = false, bool wireOrder = false);
+
+  /**
+   * Add a block of coils to the ones already configured, for sparse maps.
+   * Requests can span contiguous blocks.
+   *
+   * @param startAddress start address of the coils
+   * @param nb number of coils to add
+   *
+   * @return 1 on success, 0 on failure (overlapping block or out of memory)
+   */
+  int addCoils(int startAddress, int nb);
+
+  /**
+   * Add a block of discrete inputs to the ones already configured.
+   *
+   * @param startAddress start address of the discrete inputs
+   * @param nb number of discrete inputs to add
+   *
+   * @return 1 on success, 0 on failure (overlapping block or out of memory)
+   */
+  int addDiscreteInputs(int startAddress, int nb);
+
+  /**
+   * Add a block of holding registers to the ones already configured.
+   *
+   * @param startAddress start address of the holding registers
+   * @param nb number of holding registers to add
+   *
+   * @return 1 on success, 0 on failure (overlapping block or out of memory)
+   */
+  int addHoldingRegisters(int startAddress, int nb);
+
+  /**
+   * Add a block of input registers to the ones already configured.
+   *
+   * @param startAddress start address of the input registers
+   * @param nb number of input registers to add
+   *
+   * @return 1 on success, 0 on failure (overlapping block or out of memory)
+   */
+  int addInputRegisters(int startAddress, int nb);
 
   // same as ModbusClient.h
   int coilRead(int address);
@@ -78,6 +138,19 @@ public:
   int holdingRegisterWrite(int address, uint16_t value);
   int registerMaskWrite(int address, uint16_t andMask, uint16_t orMask);
 
+  /**
+   * Write values to the server's Holding Registers for the specified address
+   * and values. The clients never read a mix of old and new values, even
+   * when the server is polled from another thread.
+   *
+   * @param address address to use for operation
+   * @param values array of holding registers values to write
+   * @param nb number of holding registers to write
+   *
+   * @return 1 on success, 0 on failure.
+   */
+  int writeHoldingRegisters(int address, uint16_t values[], int nb);
+
   /**
    * Write the value of the server's Discrete Input for the specified address
    * and value.
@@ -114,7 +187,8 @@ public:
 
   /**
    * Write values to the server's Input Registers for the specified address
-   * and values.
+   * and values. The clients never read a mix of old and new values, even
+   * when the server is polled from another thread.
    *
    * @param address address to use for operation
    * @param values array of input registers values to write
@@ -136,9 +210,24 @@ public:
    */
   void end();
 
+  /**
+   * Set the functions called while the requests are replied, see
+   * callback_mapping_t. They are called without any table locked, so they
+   * can use the read and write functions of the server.
+   *
+   * @return 1 on success, 0 on failure
+   */
   int setCallbacks(callback_mapping_t* callbacks);
   int setEventCallback(modbus_event_cb_t callback);
 
+  /**
+   * Set the function called while waiting on the line, see
+   * ModbusClient::setIdleCallback()
+   *
+   * @return 1 on success, 0 on failure
+   */
+  int setIdleCallback(modbus_idle_cb_t callback);
+
   int setId(int id);
   int getId();
   modbus_t* _mb;
@@ -152,6 +241,11 @@ protected:
 
   int begin(modbus_t* _mb, int id);
 
+private:
+  bool isMapped(modbus_table_t table, int address, int nb);
+  int writeBits(modbus_table_t table, int address, uint8_t values[], int nb);
+  int writeRegisters(modbus_table_t table, int address, uint16_t values[], int nb);
+
 protected:
   modbus_mapping_t _mbMapping;
 };
@@ -0,0 +1,341 @@
+/*
+  This file is part of the ArduinoModbus library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <errno.h>
+
+extern "C" {
+#include "libmodbus/modbus.h"
+#include "libmodbus/modbus-tcp.h"
+#include "libmodbus/modbus-rtu.h"
+}
+
+#include "ModbusTCPGateway.h"
+
+// MBAP header: transaction id (2), protocol id (2), length (2), unit id (1)
+#define MBAP_LENGTH 7
+
+// the RTU frames end with a CRC
+#define RTU_CHECKSUM_LENGTH 2
+
+// 100 to 200 ms recommended by the Modbus over serial line specification
+#define DEFAULT_TURNAROUND_DELAY 100
+
+ModbusTCPGateway::ModbusTCPGateway() :
+  _buses(NULL),
+  _nbBuses(0),
+  _routes(NULL),
+  _nbRoutes(0),
+  _queueSize(0),
+  _id(MODBUS_TCP_SLAVE),
+  _turnaroundDelay(DEFAULT_TURNAROUND_DELAY)
+{
+}
+
+ModbusTCPGateway::~ModbusTCPGateway()
+{
+  for (int i = 0; i < _nbBuses; i++) {
+    free(_buses[i].queue);
+  }
+
+  if (_buses != NULL) {
+    free(_buses);
+  }
+
+  if (_routes != NULL) {
+    free(_routes);
+  }
+}
+
+int ModbusTCPGateway::begin(int id, int maxClients, int queueSize)
+{
+  end();
+
+  if (queueSize < 1) {
+    return 0;
+  }
+
+  if (!ModbusTCPServer::begin(id, maxClients)) {
+    return 0;
+  }
+  _queueSize = queueSize;
+  _id = id;
+
+  return 1;
+}
+
+int ModbusTCPGateway::route(ModbusRTUClientClass& bus, int firstUnit, int lastUnit, int slave)
+{
+  if (slave == -1) {
+    slave = firstUnit;
+  }
+
+  if (_queueSize == 0 || bus._mb == NULL || firstUnit < 0 || lastUnit > 0xff ||
+      firstUnit > lastUnit || slave < 0 || slave + (lastUnit - firstUnit) > 247) {
+    return 0;
+  }
+
+  int index = 0;
+
+  while (index < _nbBuses && _buses[index].client != &bus) {
+    index++;
+  }
+
+  if (index == _nbBuses) {
+    Request* queue = (Request*)calloc(_queueSize, sizeof(Request));
+    if (queue == NULL) {
+      return 0;
+    }
+
+    Bus* buses = (Bus*)realloc(_buses, (_nbBuses + 1) * sizeof(Bus));
+    if (buses == NULL) {
+      free(queue);
+      return 0;
+    }
+    _buses = buses;
+
+    _buses[index].client = &bus;
+    _buses[index].queue = queue;
+    _buses[index].head = 0;
+    _buses[index].count = 0;
+    _buses[index].busy = false;
+    _buses[index].turnaround = false;
+    _nbBuses++;
+  }
+
+  Route* routes = (Route*)realloc(_routes, (_nbRoutes + 1) * sizeof(Route));
+  if (routes == NULL) {
+    return 0;
+  }
+  _routes = routes;
+
+  _routes[_nbRoutes].firstUnit = firstUnit;
+  _routes[_nbRoutes].lastUnit = lastUnit;
+  _routes[_nbRoutes].slave = slave;
+  _routes[_nbRoutes].bus = index;
+  _nbRoutes++;
+
+  return 1;
+}
+
+void ModbusTCPGateway::setTurnaroundDelay(unsigned long ms)
+{
+  _turnaroundDelay = ms;
+}
+
+int ModbusTCPGateway::poll()
+{
+  // the requests received are queued, or replied right away when they can't be forwarded
+  int requests = ModbusTCPServer::poll();
+
+  for (int i = 0; i < _nbBuses; i++) {
+    if (serve(_buses[i])) {
+      requests = 1;
+    }
+  }
+
+  return requests;
+}
+
+void ModbusTCPGateway::end()
+{
+  ModbusTCPServer::end();
+
+  for (int i = 0; i < _nbBuses; i++) {
+    if (_buses[i].busy) {
+      // the response of the request in flight would be taken for the next one
+      modbus_flush(_buses[i].client->_mb);
+    }
+    free(_buses[i].queue);
+  }
+
+  if (_buses != NULL) {
+    free(_buses);
+    _buses = NULL;
+  }
+  _nbBuses = 0;
+
+  if (_routes != NULL) {
+    free(_routes);
+    _routes = NULL;
+  }
+  _nbRoutes = 0;
+  _queueSize = 0;
+}
+
+void ModbusTCPGateway::handleRequest(Connection* connection, int length)
+{
+  uint8_t* adu = connection->request;
+  int unit = adu[MBAP_LENGTH - 1];
+
+  for (int i = 0; i < _nbRoutes; i++) {
+    Route& route = _routes[i];
+
+    if (unit < route.firstUnit || unit > route.lastUnit) {
+      continue;
+    }
+
+    Bus& bus = _buses[route.bus];
+
+    if (bus.count == _queueSize) {
+      // overloaded, the client may try again later
+      modbus_reply_exception(_mb, adu, MODBUS_EXCEPTION_GATEWAY_PATH);
+      return;
+    }
+
+    Request& request = bus.queue[(bus.head + bus.count) % _queueSize];
+
+    request.connection = connection;
+    request.slave = route.slave + (unit - route.firstUnit);
+    request.length = length;
+    memcpy(request.adu, adu, length);
+    bus.count++;
+
+    return;
+  }
+
+  if (unit == _id) {
+    // request for the gateway itself
+    ModbusTCPServer::handleRequest(connection, length);
+  } else {
+    modbus_reply_exception(_mb, adu, MODBUS_EXCEPTION_GATEWAY_PATH);
+  }
+}
+
+void ModbusTCPGateway::released(Connection* connection)
+{
+  // the responses of its requests are dropped
+  for (int i = 0; i < _nbBuses; i++) {
+    Bus& bus = _buses[i];
+
+    for (int n = 0; n < bus.count; n++) {
+      Request& request = bus.queue[(bus.head + n) % _queueSize];
+
+      if (request.connection == connection) {
+        request.connection = NULL;
+      }
+    }
+  }
+}
+
+int ModbusTCPGateway::serve(Bus& bus)
+{
+  modbus_t* mb = bus.client->_mb;
+  int responses = 0;
+
+  if (bus.busy) {
+    int rc = modbus_poll_confirmation(mb, bus.response, NULL);
+
+    if (rc == -1 && errno == EAGAIN) {
+      return 0;
+    }
+
+    Request& request = bus.queue[bus.head];
+    int header = modbus_get_header_length(mb);
+
+    if (rc > 0) {
+      // relayed without its slave id and CRC, exception responses included
+      respond(request, bus.response + header, rc - header - RTU_CHECKSUM_LENGTH);
+    } else {
+      // timeout or invalid response, the rest of it is dropped
+      modbus_flush(mb);
+      respondException(request, MODBUS_EXCEPTION_GATEWAY_TARGET);
+    }
+
+    bus.head = (bus.head + 1) % _queueSize;
+    bus.count--;
+    bus.busy = false;
+    responses++;
+  }
+
+  if (bus.turnaround) {
+    if (millis() - bus.turnaroundStart < _turnaroundDelay) {
+      return (responses > 0) ? 1 : 0;
+    }
+    bus.turnaround = false;
+  }
+
+  // forward the next request, the ones of the clients released are skipped
+  while (bus.count > 0) {
+    Request& request = bus.queue[bus.head];
+
+    if (request.connection != NULL) {
+      uint8_t* raw = request.adu + MBAP_LENGTH - 1;
+      int rawLength = request.length - MBAP_LENGTH + 1;
+      uint8_t unit = raw[0];
+      int rc;
+
+      // the PDU is sent after the slave id, in place of the unit id
+      raw[0] = request.slave;
+      rc = modbus_set_slave(mb, request.slave);
+      if (rc == 0 && request.slave == MODBUS_BROADCAST_ADDRESS) {
+        // no response expected
+        modbus_send_raw_request(mb, raw, rawLength);
+      } else if (rc == 0) {
+        rc = modbus_send_raw_transaction(mb, raw, rawLength);
+      }
+      raw[0] = unit;
+
+      if (rc == -1) {
+        respondException(request, MODBUS_EXCEPTION_GATEWAY_PATH);
+        responses++;
+      } else if (request.slave != MODBUS_BROADCAST_ADDRESS) {
+        bus.busy = true;
+        break;
+      } else {
+        // the slaves process it before the next request
+        bus.turnaround = true;
+        bus.turnaroundStart = millis();
+        bus.head = (bus.head + 1) % _queueSize;
+        bus.count--;
+        break;
+      }
+    }
+
+    bus.head = (bus.head + 1) % _queueSize;
+    bus.count--;
+  }
+
+  return (responses > 0) ? 1 : 0;
+}
+
+void ModbusTCPGateway::respond(Request& request, const uint8_t* pdu, int length)
+{
+  if (request.connection == NULL) {
+    return;
+  }
+
+  // the response takes the place of the request, after its MBAP header
+  uint8_t* adu = request.adu;
+
+  adu[4] = (length + 1) >> 8;
+  adu[5] = (length + 1) & 0xff;
+  memmove(adu + MBAP_LENGTH, pdu, length);
+
+  request.connection->client->write(adu, MBAP_LENGTH + length);
+}
+
+void ModbusTCPGateway::respondException(Request& request, int exceptionCode)
+{
+  uint8_t pdu[2];
+
+  pdu[0] = request.adu[MBAP_LENGTH] | 0x80;
+  pdu[1] = exceptionCode;
+
+  respond(request, pdu, sizeof(pdu));
+}
@@ -0,0 +1,121 @@
+/*
+  This file is part of the ArduinoModbus library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _MODBUS_TCP_GATEWAY_H_INCLUDED
+#define _MODBUS_TCP_GATEWAY_H_INCLUDED
+
+#include "ModbusTCPServer.h"
+#include "ModbusRTUClient.h"
+
+class ModbusTCPGateway : public ModbusTCPServer {
+public:
+  ModbusTCPGateway();
+  virtual ~ModbusTCPGateway();
+
+  /**
+   * Start the Modbus TCP gateway with the specified parameters
+   *
+   * @param id (slave) id of the gateway's own coils and registers, defaults to 0xff (TCP)
+   * @param maxClients number of client connections served at once, defaults to 1
+   * @param queueSize number of requests queued per serial bus, defaults to 4
+   *
+   * @return 1 on success, 0 on failure
+   */
+  int begin(int id = 0xff, int maxClients = 1, int queueSize = 4);
+
+  /**
+   * Forward the requests of a range of unit ids to the slaves of a serial bus.
+   * The RTU client must be started and is dedicated to the gateway, its
+   * timeout is the one of the forwarded requests.
+   *
+   * @param bus RTU client of the serial bus
+   * @param firstUnit first unit id of the range
+   * @param lastUnit last unit id of the range
+   * @param slave RTU (slave) id of firstUnit, the next units are mapped to the
+   *              next ids. Defaults to the unit ids
+   *
+   * @return 1 on success, 0 on failure
+   */
+  int route(ModbusRTUClientClass& bus, int firstUnit, int lastUnit, int slave = -1);
+
+  /**
+   * Set the delay left to the slaves to process a broadcast request (unit
+   * mapped to the slave id 0) before the next request of its bus
+   *
+   * @param ms turnaround delay in milliseconds, defaults to 100
+   */
+  void setTurnaroundDelay(unsigned long ms);
+
+  /**
+   * Poll the accepted clients for requests and the serial buses for
+   * responses, without waiting on any of them. The requests are queued per
+   * bus and forwarded one at a time.
+   */
+  virtual int poll();
+
+  /**
+   * Stop the gateway, release the clients and drop the requests queued
+   */
+  void end();
+
+private:
+  struct Request {
+    // NULL once the client is released
+    Connection* connection;
+    uint8_t slave;
+    int length;
+    uint8_t adu[MODBUS_TCP_MAX_ADU_LENGTH];
+  };
+
+  struct Bus {
+    ModbusRTUClientClass* client;
+    Request* queue;
+    int head;
+    int count;
+    bool busy;
+    // a broadcast request was sent at turnaroundStart, the bus waits
+    bool turnaround;
+    unsigned long turnaroundStart;
+    uint8_t response[MODBUS_RTU_MAX_ADU_LENGTH];
+  };
+
+  struct Route {
+    uint8_t firstUnit;
+    uint8_t lastUnit;
+    uint8_t slave;
+    uint8_t bus;
+  };
+
+  virtual void handleRequest(Connection* connection, int length);
+  virtual void released(Connection* connection);
+
+  int serve(Bus& bus);
+  void respond(Request& request, const uint8_t* pdu, int length);
+  void respondException(Request& request, int exceptionCode);
+
+  Bus* _buses;
+  int _nbBuses;
+  Route* _routes;
+  int _nbRoutes;
+  int _queueSize;
+  int _id;
+  unsigned long _turnaroundDelay;
+};
+
+#endif
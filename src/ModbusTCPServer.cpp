@@ -27,16 +27,40 @@ extern "C" {
 #include "ModbusTCPServer.h"
 
 ModbusTCPServer::ModbusTCPServer() :
-  _client(NULL)
+  _connections(NULL),
+  _maxClients(0),
+  _next(0),
+  _idleTimeout(0)
 {
 }
 
 ModbusTCPServer::~ModbusTCPServer()
 {
+  for (int i = 0; i < _maxClients; i++) {
+    if (_connections[i] != NULL) {
+      release(i);
+    }
+  }
+
+  if (_connections != NULL) {
+    free(_connections);
+  }
 }
 
-int ModbusTCPServer::begin(int id)
+int ModbusTCPServer::begin(int id, int maxClients)
 {
+  end();
+
+  if (maxClients < 1) {
+    return 0;
+  }
+
+  _connections = (Connection**)calloc(maxClients, sizeof(Connection*));
+  if (_connections == NULL) {
+    return 0;
+  }
+  _maxClients = maxClients;
+
   modbus_t* mb = modbus_new_tcp(NULL, IPAddress(0, 0, 0, 0), 0);
 
   if (!ModbusServer::begin(mb, id)) {
@@ -50,24 +74,170 @@ int ModbusTCPServer::begin(int id)
   return 1;
 }
 
-void ModbusTCPServer::accept(Client& client)
+int ModbusTCPServer::accept(Client& client)
+{
+  for (int i = 0; i < _maxClients; i++) {
+    if (_connections[i] != NULL && _connections[i]->client == &client) {
+      return 1;
+    }
+  }
+
+  return accept(&client, keepClient);
+}
+
+int ModbusTCPServer::accept(Client* client, void (*destroy)(Client* client))
+{
+  int index = -1;
+
+  if (client == NULL) {
+    return 0;
+  }
+
+  for (int i = 0; i < _maxClients; i++) {
+    Connection* connection = _connections[i];
+
+    if (connection == NULL) {
+      if (index == -1) {
+        index = i;
+      }
+    } else if (!connection->client->connected()) {
+      release(i);
+      if (index == -1) {
+        index = i;
+      }
+    }
+  }
+
+  if (index == -1) {
+    destroy(client);
+    return 0;
+  }
+
+  Connection* connection = (Connection*)malloc(sizeof(Connection));
+  if (connection == NULL) {
+    destroy(client);
+    return 0;
+  }
+
+  connection->parser = modbus_parser_new();
+  if (connection->parser == NULL) {
+    free(connection);
+    destroy(client);
+    return 0;
+  }
+  connection->client = client;
+  connection->destroy = destroy;
+  connection->lastActivity = millis();
+
+  _connections[index] = connection;
+
+  return 1;
+}
+
+void ModbusTCPServer::setIdleTimeout(unsigned long ms)
 {
-  if (modbus_tcp_accept(_mb, &client) == 0) {
-    _client = &client;
+  _idleTimeout = ms;
+}
+
+int ModbusTCPServer::clients()
+{
+  int nb = 0;
+
+  for (int i = 0; i < _maxClients; i++) {
+    if (_connections[i] != NULL) {
+      nb++;
+    }
   }
+
+  return nb;
 }
 
 int ModbusTCPServer::poll()
 {
-  if (_client != NULL) {
-    uint8_t request[MODBUS_TCP_MAX_ADU_LENGTH];
+  int requests = 0;
 
-    int requestLength = modbus_receive(_mb, request);
+  // start from the next client at each call, so none of them is always served first
+  for (int n = 0; n < _maxClients; n++) {
+    int index = (_next + n) % _maxClients;
+    Connection* connection = _connections[index];
+
+    if (connection == NULL) {
+      continue;
+    }
+
+    Client* client = connection->client;
+
+    if (client->available() > 0) {
+      connection->lastActivity = millis();
+    } else if (!client->connected()) {
+      release(index);
+      continue;
+    } else if (_idleTimeout != 0 && (millis() - connection->lastActivity) >= _idleTimeout) {
+      client->stop();
+      release(index);
+      continue;
+    }
+
+    // receive and reply on this client, with the parsing state of its request
+    modbus_tcp_accept(_mb, client);
+    modbus_swap_parser(_mb, connection->parser);
+
+    int requestLength = modbus_receive_poll(_mb, connection->request);
 
     if (requestLength > 0) {
-      modbus_reply(_mb, request, requestLength, &_mbMapping);
-      return 1;
+      handleRequest(connection, requestLength);
+      requests++;
+    }
+
+    modbus_swap_parser(_mb, connection->parser);
+  }
+
+  if (_maxClients != 0) {
+    _next = (_next + 1) % _maxClients;
+  }
+
+  return (requests > 0) ? 1 : 0;
+}
+
+void ModbusTCPServer::end()
+{
+  for (int i = 0; i < _maxClients; i++) {
+    if (_connections[i] != NULL) {
+      _connections[i]->client->stop();
+      release(i);
     }
   }
-  return 0;
+
+  if (_connections != NULL) {
+    free(_connections);
+    _connections = NULL;
+  }
+  _maxClients = 0;
+  _next = 0;
+
+  ModbusServer::end();
+}
+
+void ModbusTCPServer::handleRequest(Connection* connection, int length)
+{
+  modbus_reply_in_place(_mb, connection->request, length, &_mbMapping);
+}
+
+void ModbusTCPServer::released(Connection* /*connection*/)
+{
+}
+
+void ModbusTCPServer::keepClient(Client* /*client*/)
+{
+}
+
+void ModbusTCPServer::release(int index)
+{
+  released(_connections[index]);
+  // the context mustn't keep the client destroyed
+  modbus_tcp_accept(_mb, NULL);
+  _connections[index]->destroy(_connections[index]->client);
+  modbus_parser_free(_connections[index]->parser);
+  free(_connections[index]);
+  _connections[index] = NULL;
 }
@@ -24,6 +24,10 @@
 
 #include "ModbusServer.h"
 
+extern "C" {
+#include "libmodbus/modbus-tcp.h"
+}
+
 class ModbusTCPServer : public ModbusServer {
 public:
   ModbusTCPServer();
@@ -33,25 +37,113 @@ public:
    * Start the Modbus TCP server with the specified parameters
    *
    * @param id (slave) id of the server, defaults to 0xff (TCP)
+   * @param maxClients number of client connections served at once, defaults to 1
    *
    * Return 1 on success, 0 on failure
    */
-  int begin(int id = 0xff);
+  int begin(int id = 0xff, int maxClients = 1);
 
   /**
-   * Accept client connection
+   * Accept client connection. The server keeps its own copy of the client,
+   * served until it disconnects or idles out, so the client passed can go
+   * out of scope. A client equal to one already served isn't copied again:
+   * EthernetServer::available() and WiFiServer::available() return the same
+   * client on each call while it has data to read.
+   *
+   * @param client client to accept, of a type which can be copied and
+   *        compared like EthernetClient or WiFiClient
+   *
+   * @return 1 on success or when the client is already served, 0 when
+   *         maxClients clients are already connected
+   */
+  template <class ClientType>
+  int accept(ClientType& client)
+  {
+    for (int i = 0; i < _maxClients; i++) {
+      Connection* connection = _connections[i];
+
+      if (connection != NULL && connection->destroy == destroyClient<ClientType> &&
+          *static_cast<ClientType*>(connection->client) == client) {
+        return 1;
+      }
+    }
+
+    return accept(new ClientType(client), destroyClient<ClientType>);
+  }
+
+  /**
+   * Accept client connection without a copy, for the clients only known as
+   * a Client. The client must stay valid until it is released.
    *
    * @param client client to accept
+   *
+   * @return 1 on success or when the client is already served, 0 when
+   *         maxClients clients are already connected
+   */
+  int accept(Client& client);
+
+  /**
+   * Set the time after which a client which sent nothing is stopped
+   *
+   * @param ms idle timeout in milliseconds, 0 (default) to never stop them
    */
-  void accept(Client& client);
+  void setIdleTimeout(unsigned long ms);
 
   /**
-   * Poll accepted client for requests
+   * Return the number of clients served
+   */
+  int clients();
+
+  /**
+   * Poll the accepted clients for requests in turn, doesn't wait for the rest
+   * of a request partially received. The disconnected and idle clients are
+   * released.
    */
   virtual int poll();
 
+  /**
+   * Stop the server and release the clients
+   */
+  void end();
+
+protected:
+  struct Connection {
+    Client* client;
+    void (*destroy)(Client* client);
+    modbus_parser_t* parser;
+    unsigned long lastActivity;
+    uint8_t request[MODBUS_TCP_MAX_ADU_LENGTH];
+  };
+
+  // reply the request received on the connection (in its request buffer),
+  // from the coils and registers of the server by default
+  virtual void handleRequest(Connection* connection, int length);
+
+  // called before the connection is released
+  virtual void released(Connection* connection);
+
 private:
-  Client* _client;
+  int accept(Client* client, void (*destroy)(Client* client));
+  void release(int index);
+
+  // Client may have no virtual destructor, the copy is destroyed as its own
+  // type (spelled out, delete warns about the classes which could be derived)
+  template <class ClientType>
+  static void destroyClient(Client* client)
+  {
+    ClientType* copy = static_cast<ClientType*>(client);
+
+    copy->~ClientType();
+    ::operator delete(copy);
+  }
+
+  // the clients accepted without a copy are left to their owner
+  static void keepClient(Client* client);
+
+  Connection** _connections;
+  int _maxClients;
+  int _next;
+  unsigned long _idleTimeout;
 };
 
 #endif
@@ -0,0 +1,378 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include "modbus-coro.h"
+
+#if !defined(ARDUINO) && defined(__linux__) && defined(__cpp_impl_coroutine)
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace modbus {
+
+/* Max number of events handled by an epoll_wait() call */
+#define _LOOP_MAX_EVENTS 64
+
+static uint64_t monotonic_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t timeout_us(uint32_t sec, uint32_t usec)
+{
+    return (uint64_t)sec * 1000000 + usec;
+}
+
+Request::Request(Loop &loop, modbus_t *ctx, int slave, int function,
+                 int addr, int nb, const void *src, void *dest) :
+    _loop(loop), _ctx(ctx), _slave(slave), _function(function), _addr(addr),
+    _nb(nb), _src(src), _dest(dest), _status(0), _rc(-1), _errno(0),
+    _t_id(-1), _deadline(0)
+{
+    /* The single writes are sent once awaited, keep their values */
+    switch (function) {
+    case MODBUS_FC_WRITE_SINGLE_COIL:
+        _status = *(const uint8_t *)src;
+        _src = &_status;
+        break;
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        _values[0] = *(const uint16_t *)src;
+        _src = _values;
+        break;
+    case MODBUS_FC_MASK_WRITE_REGISTER:
+        _values[0] = ((const uint16_t *)src)[0];
+        _values[1] = ((const uint16_t *)src)[1];
+        _src = _values;
+        break;
+    default:
+        break;
+    }
+}
+
+/* Sends the request, the coroutine isn't suspended when it fails */
+bool Request::await_ready()
+{
+    uint32_t sec, usec;
+
+    if (modbus_set_slave(_ctx, _slave) == -1) {
+        finish(-1);
+        return true;
+    }
+
+    _t_id = modbus_send_transaction(_ctx, _function, _addr, _nb, _src, _dest);
+    if (_t_id == -1) {
+        finish(-1);
+        return true;
+    }
+
+    modbus_get_response_timeout(_ctx, &sec, &usec);
+    _deadline = monotonic_us() + timeout_us(sec, usec);
+
+    return false;
+}
+
+bool Request::await_suspend(std::coroutine_handle<> handle)
+{
+    _handle = handle;
+
+    if (_loop.add(this) == -1) {
+        /* Drop the request, nobody would receive its confirmation. The
+           context wasn't polled yet, no other request of the loop is in
+           flight. */
+        _errno = errno;
+        modbus_flush(_ctx);
+        _rc = -1;
+        return false;
+    }
+
+    return true;
+}
+
+int Request::await_resume()
+{
+    errno = _errno;
+    return _rc;
+}
+
+void Request::finish(int rc)
+{
+    /* errno is shared by all the coroutines of the thread, it's restored
+       when the coroutine is resumed */
+    _rc = rc;
+    _errno = (rc == -1) ? errno : 0;
+}
+
+Loop::Loop() : _epfd(epoll_create1(EPOLL_CLOEXEC))
+{
+}
+
+Loop::~Loop()
+{
+    if (_epfd != -1) {
+        close(_epfd);
+    }
+}
+
+int Loop::add(Request *request)
+{
+    Connection *connection = NULL;
+    struct epoll_event event;
+    size_t i;
+
+    if (_epfd == -1) {
+        errno = EBADF;
+        return -1;
+    }
+
+    for (i = 0; i < _connections.size(); i++) {
+        if (_connections[i]->ctx == request->_ctx) {
+            connection = _connections[i];
+            break;
+        }
+    }
+
+    if (connection != NULL && connection->requests.empty() &&
+        connection->s != modbus_get_socket(request->_ctx)) {
+        /* Reconnected since its last request */
+        remove(connection);
+        connection = NULL;
+    }
+
+    if (connection == NULL) {
+        connection = new Connection;
+        connection->ctx = request->_ctx;
+        connection->s = modbus_get_socket(request->_ctx);
+        connection->readable = false;
+        connection->failed = false;
+        connection->deadline = UINT64_MAX;
+
+        event.events = EPOLLIN;
+        event.data.ptr = connection;
+        if (epoll_ctl(_epfd, EPOLL_CTL_ADD, connection->s, &event) == -1) {
+            delete connection;
+            return -1;
+        }
+        _connections.push_back(connection);
+    }
+
+    connection->requests.push_back(request);
+
+    return 0;
+}
+
+void Loop::remove(Connection *connection)
+{
+    size_t i;
+
+    /* The socket may have been closed and reopened by the error recovery,
+       the kernel has then already forgotten it */
+    epoll_ctl(_epfd, EPOLL_CTL_DEL, connection->s, NULL);
+
+    for (i = 0; i < _connections.size(); i++) {
+        if (_connections[i] == connection) {
+            _connections[i] = _connections.back();
+            _connections.pop_back();
+            break;
+        }
+    }
+
+    delete connection;
+}
+
+void Loop::poll(Connection *connection, std::vector<Request *> &done)
+{
+    std::vector<Request *> &requests = connection->requests;
+    size_t i;
+
+    while (!requests.empty()) {
+        int t_id;
+        int rc = modbus_poll_transactions(connection->ctx, connection->rsp,
+                                          &t_id);
+
+        if (rc == -1 && errno == EAGAIN) {
+            uint32_t sec, usec;
+
+            /* A confirmation may have started, libmodbus then checks the
+               byte timeout */
+            modbus_get_byte_timeout(connection->ctx, &sec, &usec);
+            if (sec == 0 && usec == 0) {
+                usec = 1000;
+            }
+            connection->deadline = monotonic_us() + timeout_us(sec, usec);
+            return;
+        }
+
+        if (rc == -1 && t_id == -1) {
+            /* The link failed, all the transactions are dropped */
+            connection->failed = true;
+            for (i = 0; i < requests.size(); i++) {
+                requests[i]->finish(-1);
+                done.push_back(requests[i]);
+            }
+            requests.clear();
+            return;
+        }
+
+        for (i = 0; i < requests.size(); i++) {
+            if (requests[i]->_t_id == t_id) {
+                requests[i]->finish(rc);
+                done.push_back(requests[i]);
+                requests[i] = requests.back();
+                requests.pop_back();
+                break;
+            }
+        }
+    }
+}
+
+int Loop::run()
+{
+    struct epoll_event events[_LOOP_MAX_EVENTS];
+    std::vector<Request *> done;
+
+    while (!_connections.empty()) {
+        uint64_t now = monotonic_us();
+        uint64_t deadline = UINT64_MAX;
+        int timeout;
+        int n;
+        int i;
+        size_t j, k;
+
+        for (j = 0; j < _connections.size(); j++) {
+            Connection *connection = _connections[j];
+
+            if (connection->deadline < deadline) {
+                deadline = connection->deadline;
+            }
+            for (k = 0; k < connection->requests.size(); k++) {
+                if (connection->requests[k]->_deadline < deadline) {
+                    deadline = connection->requests[k]->_deadline;
+                }
+            }
+        }
+        /* Rounded up so the deadline has passed when epoll returns */
+        timeout = (deadline <= now) ? 0 :
+            (int)((deadline - now + 999) / 1000);
+
+        n = epoll_wait(_epfd, events, _LOOP_MAX_EVENTS, timeout);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        for (i = 0; i < n; i++) {
+            ((Connection *)events[i].data.ptr)->readable = true;
+        }
+
+        /* The coroutines are resumed once the lists are settled, they may
+           send other requests */
+        now = monotonic_us();
+        for (j = 0; j < _connections.size(); j++) {
+            Connection *connection = _connections[j];
+            bool expired = connection->deadline <= now;
+
+            for (k = 0; !expired && k < connection->requests.size(); k++) {
+                expired = connection->requests[k]->_deadline <= now;
+            }
+
+            if (connection->readable || expired) {
+                connection->readable = false;
+                connection->deadline = UINT64_MAX;
+                poll(connection, done);
+            }
+        }
+
+        /* Forgotten before the coroutines reopen the socket */
+        for (j = _connections.size(); j > 0; j--) {
+            if (_connections[j - 1]->failed) {
+                remove(_connections[j - 1]);
+            }
+        }
+        for (j = 0; j < done.size(); j++) {
+            done[j]->_handle.resume();
+        }
+        done.clear();
+
+        /* The connections are kept while their coroutines send the next
+           request */
+        for (j = _connections.size(); j > 0; j--) {
+            if (_connections[j - 1]->requests.empty()) {
+                remove(_connections[j - 1]);
+            }
+        }
+    }
+
+    return 0;
+}
+
+Request Client::readCoils(int slave, int addr, int nb, uint8_t *dest)
+{
+    return Request(_loop, _ctx, slave, MODBUS_FC_READ_COILS, addr, nb,
+                   NULL, dest);
+}
+
+Request Client::readDiscreteInputs(int slave, int addr, int nb, uint8_t *dest)
+{
+    return Request(_loop, _ctx, slave, MODBUS_FC_READ_DISCRETE_INPUTS, addr,
+                   nb, NULL, dest);
+}
+
+Request Client::readHoldingRegisters(int slave, int addr, int nb,
+                                     uint16_t *dest)
+{
+    return Request(_loop, _ctx, slave, MODBUS_FC_READ_HOLDING_REGISTERS, addr,
+                   nb, NULL, dest);
+}
+
+Request Client::readInputRegisters(int slave, int addr, int nb, uint16_t *dest)
+{
+    return Request(_loop, _ctx, slave, MODBUS_FC_READ_INPUT_REGISTERS, addr,
+                   nb, NULL, dest);
+}
+
+Request Client::writeCoil(int slave, int addr, uint8_t status)
+{
+    return Request(_loop, _ctx, slave, MODBUS_FC_WRITE_SINGLE_COIL, addr, 1,
+                   &status, NULL);
+}
+
+Request Client::writeRegister(int slave, int addr, uint16_t value)
+{
+    return Request(_loop, _ctx, slave, MODBUS_FC_WRITE_SINGLE_REGISTER, addr, 1,
+                   &value, NULL);
+}
+
+Request Client::writeCoils(int slave, int addr, int nb, const uint8_t *src)
+{
+    return Request(_loop, _ctx, slave, MODBUS_FC_WRITE_MULTIPLE_COILS, addr, nb,
+                   src, NULL);
+}
+
+Request Client::writeRegisters(int slave, int addr, int nb,
+                               const uint16_t *src)
+{
+    return Request(_loop, _ctx, slave, MODBUS_FC_WRITE_MULTIPLE_REGISTERS, addr,
+                   nb, src, NULL);
+}
+
+Request Client::maskWriteRegister(int slave, int addr, uint16_t and_mask,
+                                  uint16_t or_mask)
+{
+    uint16_t masks[2] = { and_mask, or_mask };
+
+    return Request(_loop, _ctx, slave, MODBUS_FC_MASK_WRITE_REGISTER, addr, 1,
+                   masks, NULL);
+}
+
+}  /* namespace modbus */
+
+#endif
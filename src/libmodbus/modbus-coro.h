@@ -0,0 +1,168 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef MODBUS_CORO_H
+#define MODBUS_CORO_H
+
+/* Awaitable client requests for the Linux host build (C++20).
+
+   A Loop multiplexes the sockets (or serial fds) of many modbus_t contexts
+   with epoll on one thread. The requests are sent by
+   modbus_send_transaction() and their confirmations are received and checked
+   by modbus_poll_transactions() when the fd is readable:
+
+       modbus::Task collect(modbus::Client &client)
+       {
+           uint16_t regs[10];
+
+           if (co_await client.readHoldingRegisters(1, 0, 10, regs) == -1)
+               fprintf(stderr, "%s\n", modbus_strerror(errno));
+       }
+
+       modbus::Loop loop;
+       modbus::Client client(loop, ctx);
+       collect(client);
+       loop.run();
+
+   Up to modbus_set_max_transactions() requests can be in flight per
+   context, the confirmations of a TCP context are matched to the coroutines
+   by transaction identifier whatever their order. The requests beyond
+   complete with EBUSY. The contexts must be connected before use.
+*/
+
+#if !defined(ARDUINO) && defined(__linux__) && defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <vector>
+
+extern "C" {
+#include "modbus.h"
+}
+
+namespace modbus {
+
+class Loop;
+class Request;
+
+/* Context polled by a Loop, with its requests in flight. It stays
+   registered while its coroutines send their next request. */
+struct Connection {
+    modbus_t *ctx;
+    int s;
+    bool readable;
+    /* The link failed, the socket may be reopened by the coroutines */
+    bool failed;
+    /* Time to poll a confirmation partially received, in microseconds of
+       CLOCK_MONOTONIC */
+    uint64_t deadline;
+    std::vector<Request *> requests;
+    uint8_t rsp[MODBUS_MAX_ADU_LENGTH];
+};
+
+/* Coroutine started right away and destroyed once finished */
+struct Task {
+    struct promise_type {
+        Task get_return_object() { return Task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+/* Request awaited in a coroutine. co_await returns the same value as the
+   blocking libmodbus function (number of values read or written) or -1 with
+   errno set. */
+class Request {
+public:
+    Request(Loop &loop, modbus_t *ctx, int slave, int function, int addr,
+            int nb, const void *src, void *dest);
+    Request(const Request &) = delete;
+    Request &operator=(const Request &) = delete;
+
+    bool await_ready();
+    bool await_suspend(std::coroutine_handle<> handle);
+    int await_resume();
+
+private:
+    friend class Loop;
+
+    void finish(int rc);
+
+    Loop &_loop;
+    modbus_t *_ctx;
+    int _slave;
+    int _function;
+    int _addr;
+    int _nb;
+    const void *_src;
+    void *_dest;
+    /* Copy of the values of the single writes */
+    uint8_t _status;
+    uint16_t _values[2];
+
+    int _rc;
+    int _errno;
+    int _t_id;
+    /* Response timeout, in microseconds of CLOCK_MONOTONIC */
+    uint64_t _deadline;
+    std::coroutine_handle<> _handle;
+};
+
+/* Event loop of the requests */
+class Loop {
+public:
+    Loop();
+    ~Loop();
+    Loop(const Loop &) = delete;
+    Loop &operator=(const Loop &) = delete;
+
+    /* Resumes the coroutines as their requests complete, until no request
+       is in flight. Returns 0, or -1 with errno set when epoll fails. */
+    int run();
+
+private:
+    friend class Request;
+
+    int add(Request *request);
+    /* Receives the confirmations already available, the requests over are
+       moved to done */
+    void poll(Connection *connection, std::vector<Request *> &done);
+    void remove(Connection *connection);
+
+    int _epfd;
+    std::vector<Connection *> _connections;
+};
+
+/* Requests of a context, see the modbus_read_xxx()/modbus_write_xxx()
+   functions for the arguments */
+class Client {
+public:
+    Client(Loop &loop, modbus_t *ctx) : _loop(loop), _ctx(ctx) {}
+
+    Request readCoils(int slave, int addr, int nb, uint8_t *dest);
+    Request readDiscreteInputs(int slave, int addr, int nb, uint8_t *dest);
+    Request readHoldingRegisters(int slave, int addr, int nb, uint16_t *dest);
+    Request readInputRegisters(int slave, int addr, int nb, uint16_t *dest);
+    Request writeCoil(int slave, int addr, uint8_t status);
+    Request writeRegister(int slave, int addr, uint16_t value);
+    Request writeCoils(int slave, int addr, int nb, const uint8_t *src);
+    Request writeRegisters(int slave, int addr, int nb, const uint16_t *src);
+    Request maskWriteRegister(int slave, int addr, uint16_t and_mask,
+                              uint16_t or_mask);
+
+    modbus_t *context() const { return _ctx; }
+
+private:
+    Loop &_loop;
+    modbus_t *_ctx;
+};
+
+}  /* namespace modbus */
+
+#endif
+
+#endif  /* MODBUS_CORO_H */
@@ -133,6 +133,73 @@ uint8_t modbus_get_byte_from_bits(const uint8_t *src, int idx,
     return value;
 }
 
+/* Copies nb_bits bits starting at bit idx of the packed table src (LSB first)
+   to dest, starting at bit 0. The unused high bits of the last byte are
+   cleared so dest can be sent as is in a read coils/discrete inputs
+   response. */
+void modbus_get_packed_bits(const uint8_t *src, int idx, unsigned int nb_bits,
+                            uint8_t *dest)
+{
+    const uint8_t *p = src + (idx >> 3);
+    unsigned int shift = idx & 7;
+    unsigned int nb_bytes = (nb_bits + 7) / 8;
+    unsigned int i;
+
+    if (nb_bits == 0)
+        return;
+
+    if (shift == 0) {
+        memcpy(dest, p, nb_bytes);
+    } else {
+        /* Each destination byte straddles two source bytes */
+        for (i = 0; i < nb_bytes - 1; i++) {
+            uint16_t word = p[i] | (p[i + 1] << 8);
+            dest[i] = word >> shift;
+        }
+        /* Don't read past the last source byte holding a requested bit */
+        if (shift + (nb_bits - 1) % 8 >= 8) {
+            dest[i] = (p[i] | (p[i + 1] << 8)) >> shift;
+        } else {
+            dest[i] = p[i] >> shift;
+        }
+    }
+
+    if (nb_bits % 8)
+        dest[nb_bytes - 1] &= (1 << (nb_bits % 8)) - 1;
+}
+
+/* Sets nb_bits bits starting at bit idx of the packed table dest (LSB first)
+   from src, starting at bit 0. The bits of dest outside the range are left
+   untouched. */
+void modbus_set_packed_bits(uint8_t *dest, int idx, unsigned int nb_bits,
+                            const uint8_t *src)
+{
+    uint8_t *p = dest + (idx >> 3);
+    unsigned int shift = idx & 7;
+    unsigned int i;
+
+    if (shift == 0) {
+        memcpy(p, src, nb_bits / 8);
+        i = nb_bits / 8;
+        nb_bits %= 8;
+    } else {
+        i = 0;
+    }
+
+    while (nb_bits > 0) {
+        unsigned int n = nb_bits < 8 ? nb_bits : 8;
+        uint16_t mask = ((1 << n) - 1) << shift;
+        uint16_t word = (src[i] << shift) & mask;
+
+        p[i] = (p[i] & ~mask) | word;
+        if (mask >> 8) {
+            p[i + 1] = (p[i + 1] & ~(mask >> 8)) | (word >> 8);
+        }
+        nb_bits -= n;
+        i++;
+    }
+}
+
 /* Get a float from 4 bytes (Modbus) without any conversion (ABCD) */
 float modbus_get_float_abcd(const uint16_t *src)
 {
@@ -70,6 +70,48 @@ typedef enum {
     MSG_CONFIRMATION
 } msg_type_t;
 
+/* 3 steps are used to parse the query. The confirmations of unknown
+   functions have no length, they end with the silence after them
+   (_STEP_SILENCE, see frame_delay). */
+typedef enum {
+    _STEP_FUNCTION,
+    _STEP_META,
+    _STEP_DATA,
+    _STEP_SILENCE
+} _step_t;
+
+/* Parsing state of a message, kept between the reads so a message can be
+   received over several calls. The parser is idle when length_to_read is 0. */
+struct _modbus_parser {
+    msg_type_t msg_type;
+    _step_t step;
+    /* Number of bytes received */
+    int msg_length;
+    /* Number of bytes expected by the current step */
+    int length_to_read;
+    /* Time of the last bytes received, see _modbus_micros() */
+    unsigned long last_recv_time;
+    /* Time of the last call to _modbus_receive_msg_poll() */
+    unsigned long last_poll_time;
+    /* Offset of the bytes received after a silence which couldn't be told
+       apart from a pause of the poll loop, 0 if none */
+    int resume_offset;
+};
+
+/* Request sent by modbus_send_transaction() of which the confirmation is
+   awaited. Only the beginning of the request is kept, it's enough to check the
+   confirmation. The slot is free when req_length is 0. */
+typedef struct _modbus_transaction {
+    uint8_t req[_MIN_REQ_LENGTH];
+    int req_length;
+    /* Storage of the values read, may be NULL */
+    void *dest;
+    /* Sent by modbus_send_raw_transaction(), the confirmation is relayed */
+    int raw;
+    /* Time the request was sent, see _modbus_micros() */
+    unsigned long send_time;
+} modbus_transaction_t;
+
 /* This structure reduces the number of params in functions and so
  * optimizes the speed of execution (~ 37%). */
 typedef struct _sft {
@@ -88,10 +130,19 @@ typedef struct _modbus_backend {
                                 int nb, uint8_t *req);
     int (*build_response_basis) (sft_t *sft, uint8_t *rsp);
     int (*prepare_response_tid) (const uint8_t *req, int *req_length);
-    int (*send_msg_pre) (uint8_t *req, int req_length);
+    /* crc is the CRC register after the req_length bytes, when the backend
+       has a checksum */
+    int (*send_msg_pre) (uint8_t *req, int req_length, uint16_t crc);
     ssize_t (*send) (modbus_t *ctx, const uint8_t *req, int req_length);
     int (*receive) (modbus_t *ctx, uint8_t *req);
+    /* Same as receive without waiting, see _modbus_receive_msg_poll() */
+    int (*receive_poll) (modbus_t *ctx, uint8_t *req);
     ssize_t (*recv) (modbus_t *ctx, uint8_t *rsp, int rsp_length);
+    /* Optional, returns the length of the whole ADU from its header */
+    int (*adu_length) (const uint8_t *msg);
+    /* Optional, returns the silence ending a frame in microseconds, to
+       receive the frames of unknown length */
+    unsigned long (*frame_delay) (modbus_t *ctx);
     int (*check_integrity) (modbus_t *ctx, uint8_t *msg,
                             const int msg_length);
     int (*pre_check_confirmation) (modbus_t *ctx, const uint8_t *req,
@@ -99,6 +150,9 @@ typedef struct _modbus_backend {
     int (*connect) (modbus_t *ctx);
     void (*close) (modbus_t *ctx);
     int (*flush) (modbus_t *ctx);
+    /* Drops the rest of the frame msg of which msg_length bytes have been
+       received */
+    int (*discard) (modbus_t *ctx, const uint8_t *msg, int msg_length);
     int (*select) (modbus_t *ctx, fd_set *rset, struct timeval *tv, int msg_length);
     void (*free) (modbus_t *ctx);
 } modbus_backend_t;
@@ -112,17 +166,41 @@ struct _modbus {
     int s;
     int debug;
     int error_recovery;
+    int receive_mode;
+    int exception_recovery;
+    /* Copy of the function codes table when modified, NULL otherwise */
+    modbus_function_t *functions;
+    int nb_functions;
     struct timeval response_timeout;
     struct timeval byte_timeout;
     const modbus_backend_t *backend;
     void *backend_data;
     callback_mapping_t callbacks;
+    modbus_idle_cb_t idle_cb;
     modbus_print_cb print;
+    /* Message partially received by modbus_receive_poll() */
+    modbus_parser_t parser;
+    /* Requests in flight, max_transactions slots of which nb_transactions
+       are used. The table is transaction unless modbus_set_max_transactions()
+       allocated a larger one. */
+    modbus_transaction_t *transactions;
+    int max_transactions;
+    int nb_transactions;
+    modbus_transaction_t transaction;
 };
 
 void _modbus_init_common(modbus_t *ctx);
 void _error_print(modbus_t *ctx, const char *context);
 int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type);
+int _modbus_receive_msg_poll(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type);
+unsigned long _modbus_micros(void);
+void _modbus_idle(modbus_t *ctx, unsigned long remaining_us);
+unsigned long _modbus_timeval_to_us(const struct timeval *tv);
+/* CRC-16 of RTU frames, the byte to send first is the high byte */
+uint16_t _modbus_crc16(const uint8_t *buffer, uint16_t buffer_length);
+/* Feeds buffer to the CRC-16 register crc (0xFFFF for a new frame) */
+uint16_t _modbus_crc16_update(uint16_t crc, const uint8_t *buffer,
+                              uint16_t buffer_length);
 
 #ifndef HAVE_STRLCPY
 size_t strlcpy(char *dest, const char *src, size_t dest_size);
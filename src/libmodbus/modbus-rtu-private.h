@@ -83,6 +83,15 @@ typedef struct _modbus_rtu {
 #endif
     /* To handle many slaves on the same link */
     int confirmation_to_ignore;
+    /* CRC register updated by _modbus_rtu_recv() as the frame starting at
+       crc_msg arrives, crc_length bytes have been accumulated */
+    const uint8_t *crc_msg;
+    int crc_length;
+    uint16_t crc;
+    /* Silent intervals in microseconds: the characters of a frame are
+       separated by at most t1.5 and the frames by at least t3.5 */
+    unsigned long t15;
+    unsigned long t35;
 } modbus_rtu_t;
 
 #endif /* MODBUS_RTU_PRIVATE_H */
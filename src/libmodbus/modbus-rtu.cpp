@@ -38,8 +38,6 @@
 #endif
 
 #if defined(ARDUINO) && defined(__AVR__)
-#include <avr/pgmspace.h>
-
 #undef EIO
 #define EIO 5
 
@@ -59,75 +57,6 @@
 #define ENOTSUP 134
 #endif
 
-/* Table of CRC values for high-order byte */
-#if defined(ARDUINO) && defined(__AVR__)
-static PROGMEM const uint8_t table_crc_hi[] = {
-#else
-static const uint8_t table_crc_hi[] = {
-#endif
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-    0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-    0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-    0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
-    0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-    0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
-    0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-    0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
-    0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-    0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40
-};
-
-/* Table of CRC values for low-order byte */
-#if defined(ARDUINO) && defined(__AVR__)
-#include <avr/pgmspace.h>
-static PROGMEM const uint8_t table_crc_lo[] = {
-#else
-static const uint8_t table_crc_lo[] = {
-#endif
-    0x00, 0xC0, 0xC1, 0x01, 0xC3, 0x03, 0x02, 0xC2, 0xC6, 0x06,
-    0x07, 0xC7, 0x05, 0xC5, 0xC4, 0x04, 0xCC, 0x0C, 0x0D, 0xCD,
-    0x0F, 0xCF, 0xCE, 0x0E, 0x0A, 0xCA, 0xCB, 0x0B, 0xC9, 0x09,
-    0x08, 0xC8, 0xD8, 0x18, 0x19, 0xD9, 0x1B, 0xDB, 0xDA, 0x1A,
-    0x1E, 0xDE, 0xDF, 0x1F, 0xDD, 0x1D, 0x1C, 0xDC, 0x14, 0xD4,
-    0xD5, 0x15, 0xD7, 0x17, 0x16, 0xD6, 0xD2, 0x12, 0x13, 0xD3,
-    0x11, 0xD1, 0xD0, 0x10, 0xF0, 0x30, 0x31, 0xF1, 0x33, 0xF3,
-    0xF2, 0x32, 0x36, 0xF6, 0xF7, 0x37, 0xF5, 0x35, 0x34, 0xF4,
-    0x3C, 0xFC, 0xFD, 0x3D, 0xFF, 0x3F, 0x3E, 0xFE, 0xFA, 0x3A,
-    0x3B, 0xFB, 0x39, 0xF9, 0xF8, 0x38, 0x28, 0xE8, 0xE9, 0x29,
-    0xEB, 0x2B, 0x2A, 0xEA, 0xEE, 0x2E, 0x2F, 0xEF, 0x2D, 0xED,
-    0xEC, 0x2C, 0xE4, 0x24, 0x25, 0xE5, 0x27, 0xE7, 0xE6, 0x26,
-    0x22, 0xE2, 0xE3, 0x23, 0xE1, 0x21, 0x20, 0xE0, 0xA0, 0x60,
-    0x61, 0xA1, 0x63, 0xA3, 0xA2, 0x62, 0x66, 0xA6, 0xA7, 0x67,
-    0xA5, 0x65, 0x64, 0xA4, 0x6C, 0xAC, 0xAD, 0x6D, 0xAF, 0x6F,
-    0x6E, 0xAE, 0xAA, 0x6A, 0x6B, 0xAB, 0x69, 0xA9, 0xA8, 0x68,
-    0x78, 0xB8, 0xB9, 0x79, 0xBB, 0x7B, 0x7A, 0xBA, 0xBE, 0x7E,
-    0x7F, 0xBF, 0x7D, 0xBD, 0xBC, 0x7C, 0xB4, 0x74, 0x75, 0xB5,
-    0x77, 0xB7, 0xB6, 0x76, 0x72, 0xB2, 0xB3, 0x73, 0xB1, 0x71,
-    0x70, 0xB0, 0x50, 0x90, 0x91, 0x51, 0x93, 0x53, 0x52, 0x92,
-    0x96, 0x56, 0x57, 0x97, 0x55, 0x95, 0x94, 0x54, 0x9C, 0x5C,
-    0x5D, 0x9D, 0x5F, 0x9F, 0x9E, 0x5E, 0x5A, 0x9A, 0x9B, 0x5B,
-    0x99, 0x59, 0x58, 0x98, 0x88, 0x48, 0x49, 0x89, 0x4B, 0x8B,
-    0x8A, 0x4A, 0x4E, 0x8E, 0x8F, 0x4F, 0x8D, 0x4D, 0x4C, 0x8C,
-    0x44, 0x84, 0x85, 0x45, 0x87, 0x47, 0x46, 0x86, 0x82, 0x42,
-    0x43, 0x83, 0x41, 0x81, 0x80, 0x40
-};
-
 /* Define the slave ID of the remote device to talk in master mode or set the
  * internal slave ID in slave mode */
 static int _modbus_set_slave(modbus_t *ctx, int slave)
@@ -172,27 +101,6 @@ static int _modbus_rtu_build_response_basis(sft_t *sft, uint8_t *rsp)
     return _MODBUS_RTU_PRESET_RSP_LENGTH;
 }
 
-static uint16_t crc16(uint8_t *buffer, uint16_t buffer_length)
-{
-    uint8_t crc_hi = 0xFF; /* high CRC byte initialized */
-    uint8_t crc_lo = 0xFF; /* low CRC byte initialized */
-    unsigned int i; /* will index into CRC lookup */
-
-    /* pass through message buffer */
-    while (buffer_length--) {
-        i = crc_hi ^ *buffer++; /* calculate the CRC  */
-#if defined(ARDUINO) && defined(__AVR__)
-        crc_hi = crc_lo ^ pgm_read_byte_near(table_crc_hi + i);
-        crc_lo = pgm_read_byte_near(table_crc_lo + i);
-#else
-        crc_hi = crc_lo ^ table_crc_hi[i];
-        crc_lo = table_crc_lo[i];
-#endif
-    }
-
-    return (crc_hi << 8 | crc_lo);
-}
-
 static int _modbus_rtu_prepare_response_tid(const uint8_t *req, int *req_length)
 {
 #ifdef ARDUINO
@@ -203,15 +111,30 @@ static int _modbus_rtu_prepare_response_tid(const uint8_t *req, int *req_length)
     return 0;
 }
 
-static int _modbus_rtu_send_msg_pre(uint8_t *req, int req_length)
+static int _modbus_rtu_send_msg_pre(uint8_t *req, int req_length, uint16_t crc)
 {
-    uint16_t crc = crc16(req, req_length);
-    req[req_length++] = crc >> 8;
     req[req_length++] = crc & 0x00FF;
+    req[req_length++] = crc >> 8;
 
     return req_length;
 }
 
+/* Feeds the bytes just received to the running CRC. A chunk which doesn't
+   follow the previous one starts a new frame. */
+static void _modbus_rtu_update_crc(modbus_rtu_t *ctx_rtu, const uint8_t *rsp,
+                                   int rsp_length)
+{
+    if (ctx_rtu->crc_msg == NULL ||
+        rsp != ctx_rtu->crc_msg + ctx_rtu->crc_length) {
+        ctx_rtu->crc_msg = rsp;
+        ctx_rtu->crc_length = 0;
+        ctx_rtu->crc = 0xFFFF;
+    }
+
+    ctx_rtu->crc = _modbus_crc16_update(ctx_rtu->crc, rsp, rsp_length);
+    ctx_rtu->crc_length += rsp_length;
+}
+
 #if defined(_WIN32)
 
 /* This simple implementation is sort of a substitute of the select() call,
@@ -318,6 +241,67 @@ static void _modbus_rtu_ioctl_rts(modbus_t *ctx, int on)
 }
 #endif
 
+/* Number of bits of a character on the line: start bit, data bits, parity
+   bit and stop bits */
+static unsigned long _modbus_rtu_char_bits(const modbus_rtu_t *ctx_rtu)
+{
+#if defined(ARDUINO)
+    switch (ctx_rtu->config) {
+    case SERIAL_5N1:
+        return 7;
+    case SERIAL_5N2:
+    case SERIAL_5E1:
+    case SERIAL_5O1:
+    case SERIAL_6N1:
+        return 8;
+    case SERIAL_5E2:
+    case SERIAL_5O2:
+    case SERIAL_6N2:
+    case SERIAL_6E1:
+    case SERIAL_6O1:
+    case SERIAL_7N1:
+        return 9;
+    case SERIAL_6E2:
+    case SERIAL_6O2:
+    case SERIAL_7N2:
+    case SERIAL_7E1:
+    case SERIAL_7O1:
+    case SERIAL_8N1:
+        return 10;
+    case SERIAL_7E2:
+    case SERIAL_7O2:
+    case SERIAL_8N2:
+    case SERIAL_8E1:
+    case SERIAL_8O1:
+    default:
+        /* 11 bits as required by the Modbus over serial line specification */
+        return 11;
+    case SERIAL_8E2:
+    case SERIAL_8O2:
+        return 12;
+    }
+#else
+    return 1 + ctx_rtu->data_bit + (ctx_rtu->parity == 'N' ? 0 : 1) +
+        ctx_rtu->stop_bit;
+#endif
+}
+
+/* Sets t1.5 and t3.5 from the baud rate and the character format */
+static void _modbus_rtu_init_timing(modbus_rtu_t *ctx_rtu)
+{
+    unsigned long baud = ctx_rtu->baud;
+    unsigned long bits = _modbus_rtu_char_bits(ctx_rtu);
+
+    if (baud == 0 || baud > 19200) {
+        /* Fixed values recommended above 19200 bauds */
+        ctx_rtu->t15 = 750;
+        ctx_rtu->t35 = 1750;
+    } else {
+        ctx_rtu->t15 = (bits * 1500000UL + baud - 1) / baud;
+        ctx_rtu->t35 = (bits * 3500000UL + baud - 1) / baud;
+    }
+}
+
 static ssize_t _modbus_rtu_send(modbus_t *ctx, const uint8_t *req, int req_length)
 {
 #if defined(_WIN32)
@@ -328,6 +312,12 @@ static ssize_t _modbus_rtu_send(modbus_t *ctx, const uint8_t *req, int req_lengt
     modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
 
     ssize_t size;
+    unsigned long elapsed;
+
+    /* Keep the line silent for t3.5 after the last frame received */
+    while ((elapsed = micros() - ctx_rtu->last_char_recv_time) < ctx_rtu->t35) {
+        _modbus_idle(ctx, ctx_rtu->t35 - elapsed);
+    }
 
     ctx_rtu->rs485->noReceive();
     ctx_rtu->rs485->beginTransmission();
@@ -391,61 +381,80 @@ static int _modbus_rtu_receive(modbus_t *ctx, uint8_t *req)
     return rc;
 }
 
+static int _modbus_rtu_receive_poll(modbus_t *ctx, uint8_t *req)
+{
+    int rc;
+    modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
 
+    if (ctx_rtu->confirmation_to_ignore) {
+        rc = _modbus_receive_msg_poll(ctx, req, MSG_CONFIRMATION);
+        if (rc == -1 && errno == EAGAIN) {
+            return -1;
+        }
+        /* Ignore errors and reset the flag */
+        ctx_rtu->confirmation_to_ignore = FALSE;
+        rc = 0;
+        if (ctx->debug) {
+            printf("Confirmation to ignore\n");
+        }
+    } else {
+        rc = _modbus_receive_msg_poll(ctx, req, MSG_INDICATION);
+        if (rc == 0) {
+            /* The next expected message is a confirmation to ignore */
+            ctx_rtu->confirmation_to_ignore = TRUE;
+        }
+    }
+    return rc;
+}
 
-static ssize_t _modbus_rtu_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length)
+static ssize_t _modbus_rtu_read(modbus_t *ctx, uint8_t *rsp, int rsp_length)
 {
 #if defined(_WIN32)
     return win32_ser_read(&((modbus_rtu_t *)ctx->backend_data)->w_ser, rsp, rsp_length);
 #elif defined(ARDUINO)
     modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
+    int avail = ctx_rtu->rs485->available();
+    int i;
+
+    /* Only drain the characters received, readBytes() would wait for the
+       missing ones until the stream timeout */
+    if (avail > rsp_length) {
+        avail = rsp_length;
+    }
+    for (i = 0; i < avail; i++) {
+        rsp[i] = ctx_rtu->rs485->read();
+    }
+
+    if (avail > 0) {
+        ctx_rtu->last_char_recv_time = micros();
+    }
+    ctx_rtu->num_in_recv_buffer = ctx_rtu->rs485->available();
 
-    int avail =  ctx_rtu->rs485->available();
-    if (ctx_rtu->num_in_recv_buffer < avail) {
-        ctx_rtu->num_in_recv_buffer = avail;
-        ctx_rtu->last_char_recv_time = millis();
-    }
-//
-//    if (avail < rsp_length) {
-//        if (avail > 0 && ctx_rtu->last_char_recv_time != 0 && millis() - ctx_rtu->last_char_recv_time > 500) {
-//            for (int i = 0; i < avail; i++) {
-//                ctx_rtu->rs485->read();
-//            }
-//            Serial.println("WARNING: Clearing incoming modbus data");
-//
-//            return 0;
-//        }
-//        Serial.print("a");
-//        Serial.print(avail);
-//        Serial.print("b");
-//        Serial.println(rsp_length);
-//        return 0; // TODO should we read what we can?
-//    } else {
-//        Serial.print("c");
-//        Serial.println(rsp_length);
-//        }
-
-    ctx_rtu->last_char_recv_time = millis();
-
-//    if (avail > rsp_length) {
-//        // replace readBytes
-//    } else {
-//        return 0;
-//    }
-
-//    int bytes_read = 0;
-//    while (bytes_read <= rsp_length && ctx_rtu->rs485->available()) {
-//        rsp[bytes_read++] = ctx_rtu->rs485->read();
-//    }
-//    return bytes_read;
-    return ctx_rtu->rs485->readBytes(rsp, rsp_length); // TODO don't use readbytes?!?!?!?!
+    return avail;
 #else
     return read(ctx->s, rsp, rsp_length);
 #endif
 }
 
+static ssize_t _modbus_rtu_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length)
+{
+    ssize_t rc = _modbus_rtu_read(ctx, rsp, rsp_length);
+
+    if (rc > 0) {
+        _modbus_rtu_update_crc((modbus_rtu_t *)ctx->backend_data, rsp, rc);
+    }
+
+    return rc;
+}
+
 static int _modbus_rtu_flush(modbus_t *);
 
+/* The frames end with a silence of t3.5 */
+static unsigned long _modbus_rtu_frame_delay(modbus_t *ctx)
+{
+    return ((modbus_rtu_t *)ctx->backend_data)->t35;
+}
+
 static int _modbus_rtu_pre_check_confirmation(modbus_t *ctx, const uint8_t *req,
                                               const uint8_t *rsp, int rsp_length)
 {
@@ -469,14 +478,23 @@ static int _modbus_rtu_pre_check_confirmation(modbus_t *ctx, const uint8_t *req,
 
 /* The check_crc16 function shall return 0 is the message is ignored and the
    message length if the CRC is valid. Otherwise it shall return -1 and set
-   errno to EMBADCRC. */
+   errno to EMBADCRC.
+
+   The CRC has been accumulated by _modbus_rtu_recv() while the frame was
+   received, it's only computed here when the frame has been received in
+   another way. */
 static int _modbus_rtu_check_integrity(modbus_t *ctx, uint8_t *msg,
                                        const int msg_length)
 {
-    uint16_t crc_calculated;
-    uint16_t crc_received;
+    modbus_rtu_t *ctx_rtu = (modbus_rtu_t *)ctx->backend_data;
+    int accumulated = (msg == ctx_rtu->crc_msg &&
+                       msg_length == ctx_rtu->crc_length);
+    uint16_t crc;
     int slave = msg[0];
 
+    /* The next frame starts from scratch */
+    ctx_rtu->crc_msg = NULL;
+
     /* Filter on the Modbus unit identifier (slave) in RTU mode to avoid useless
      * CRC computing. */
     if (slave != ctx->slave && slave != MODBUS_BROADCAST_ADDRESS) {
@@ -487,16 +505,20 @@ static int _modbus_rtu_check_integrity(modbus_t *ctx, uint8_t *msg,
         return 0;
     }
 
-    crc_calculated = crc16(msg, msg_length - 2);
-    crc_received = (msg[msg_length - 2] << 8) | msg[msg_length - 1];
+    if (accumulated) {
+        crc = ctx_rtu->crc;
+    } else {
+        crc = _modbus_crc16_update(0xFFFF, msg, msg_length);
+    }
 
-    /* Check CRC of msg */
-    if (crc_calculated == crc_received) {
+    /* Check CRC of msg: the register of a frame followed by its CRC is 0 */
+    if (crc == 0) {
         return msg_length;
     } else {
         if (ctx->debug) {
             fprintf(stderr, "ERROR CRC received 0x%0X != CRC calculated 0x%0X\n",
-                    crc_received, crc_calculated);
+                    (msg[msg_length - 2] << 8) | msg[msg_length - 1],
+                    _modbus_crc16(msg, msg_length - 2));
         }
 
         if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_PROTOCOL) {
@@ -1229,6 +1251,77 @@ int modbus_rtu_set_rts_delay(modbus_t *ctx, int us)
 }
 #endif
 
+/* Sets the inter-character timeout (t1.5) in microseconds, 0 restores the
+   value derived from the baud rate. The byte timeout is set to it. */
+int modbus_rtu_set_char_timeout(modbus_t *ctx, int us)
+{
+    modbus_rtu_t *ctx_rtu;
+
+    if (ctx == NULL || us < 0 ||
+        ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx_rtu = (modbus_rtu_t *)ctx->backend_data;
+    if (us == 0) {
+        unsigned long t35 = ctx_rtu->t35;
+
+        _modbus_rtu_init_timing(ctx_rtu);
+        ctx_rtu->t35 = t35;
+    } else {
+        ctx_rtu->t15 = us;
+    }
+
+    ctx->byte_timeout.tv_sec = ctx_rtu->t15 / 1000000;
+    ctx->byte_timeout.tv_usec = ctx_rtu->t15 % 1000000;
+    return 0;
+}
+
+int modbus_rtu_get_char_timeout(modbus_t *ctx)
+{
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ((modbus_rtu_t *)ctx->backend_data)->t15;
+}
+
+/* Sets the inter-frame delay (t3.5) in microseconds, 0 restores the value
+   derived from the baud rate */
+int modbus_rtu_set_frame_delay(modbus_t *ctx, int us)
+{
+    modbus_rtu_t *ctx_rtu;
+
+    if (ctx == NULL || us < 0 ||
+        ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx_rtu = (modbus_rtu_t *)ctx->backend_data;
+    if (us == 0) {
+        unsigned long t15 = ctx_rtu->t15;
+
+        _modbus_rtu_init_timing(ctx_rtu);
+        ctx_rtu->t15 = t15;
+    } else {
+        ctx_rtu->t35 = us;
+    }
+    return 0;
+}
+
+int modbus_rtu_get_frame_delay(modbus_t *ctx)
+{
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ((modbus_rtu_t *)ctx->backend_data)->t35;
+}
+
 static void _modbus_rtu_close(modbus_t *ctx)
 {
     /* Restore line settings and close file descriptor in RTU mode */
@@ -1275,6 +1368,7 @@ static int _modbus_rtu_flush(modbus_t *ctx)
     while (ctx_rtu->rs485->available()) {
         ctx_rtu->rs485->read();
     }
+    ctx_rtu->num_in_recv_buffer = 0;
 
     return 0;
 #else
@@ -1282,6 +1376,67 @@ static int _modbus_rtu_flush(modbus_t *ctx)
 #endif
 }
 
+static int _modbus_rtu_select(modbus_t *ctx, fd_set *rset,
+                              struct timeval *tv, int length_to_read);
+
+/* Drops the rest of a bad frame. RTU frames carry no length so everything
+   received until the inter-frame silence belongs to it, up to the size of
+   the largest frame: on a bus which never goes silent the next bytes are
+   left to the next receive. */
+static int _modbus_rtu_discard(modbus_t *ctx, const uint8_t *msg, int msg_length)
+{
+    modbus_rtu_t *ctx_rtu = (modbus_rtu_t *)ctx->backend_data;
+    unsigned long t35 = ctx_rtu->t35;
+    int rc_sum = 0;
+#if defined(ARDUINO)
+    unsigned long last = micros();
+    unsigned long elapsed;
+#else
+    uint8_t devnull[MODBUS_RTU_MAX_ADU_LENGTH];
+    fd_set rset;
+    struct timeval tv;
+    ssize_t rc;
+#endif
+
+    (void)msg;
+    (void)msg_length;
+
+#if defined(ARDUINO)
+    while ((elapsed = micros() - last) < t35 &&
+           rc_sum < MODBUS_RTU_MAX_ADU_LENGTH) {
+        if (ctx_rtu->rs485->available()) {
+            ctx_rtu->rs485->read();
+            rc_sum++;
+            last = micros();
+        } else {
+            _modbus_idle(ctx, t35 - elapsed);
+        }
+    }
+    ctx_rtu->num_in_recv_buffer = 0;
+#else
+    while (rc_sum < MODBUS_RTU_MAX_ADU_LENGTH) {
+        FD_ZERO(&rset);
+        FD_SET(ctx->s, &rset);
+        tv.tv_sec = 0;
+        tv.tv_usec = t35;
+        if (_modbus_rtu_select(ctx, &rset, &tv, 1) == -1) {
+            /* Silence, the frame is over */
+            break;
+        }
+
+        /* Not accounted in the running CRC */
+        rc = _modbus_rtu_read(ctx, devnull,
+                              MODBUS_RTU_MAX_ADU_LENGTH - rc_sum);
+        if (rc <= 0) {
+            break;
+        }
+        rc_sum += rc;
+    }
+#endif
+
+    return rc_sum;
+}
+
 static int _modbus_rtu_select(modbus_t *ctx, fd_set *rset,
                               struct timeval *tv, int length_to_read)
 {
@@ -1301,27 +1456,36 @@ static int _modbus_rtu_select(modbus_t *ctx, fd_set *rset,
     modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
     (void)rset;
 
-    unsigned long wait_time_millis = (tv == NULL) ? 0 : (tv->tv_sec * 1000) + (tv->tv_usec / 1000);
-    unsigned long start = millis();
-//
-//    Serial.print("w");
-//    Serial.print(wait_time_millis);
+    unsigned long wait_time = (tv == NULL) ? 0 : _modbus_timeval_to_us(tv);
+    unsigned long byte_timeout = _modbus_timeval_to_us(&ctx->byte_timeout);
+    unsigned long last = micros();
+    unsigned long elapsed;
 
-    do {
+    for (;;) {
         s_rc = ctx_rtu->rs485->available();
 
         if (s_rc >= length_to_read) {
             break;
-        } else if (s_rc >= 1) {
-//            Serial.print("w");
-//            Serial.print(length_to_read);
-//            Serial.print("z");
-//            Serial.print(s_rc);
-//            Serial.print("y");
-//            Serial.print(ctx_rtu->rs485->peek());
         }
 
-    } while ((millis() - start) < wait_time_millis);
+        if (s_rc > ctx_rtu->num_in_recv_buffer) {
+            /* Once characters are received, the timeout is the allowed
+               silence after the last one, the byte timeout (t1.5 by
+               default) at most */
+            ctx_rtu->num_in_recv_buffer = s_rc;
+            ctx_rtu->last_char_recv_time = micros();
+            last = ctx_rtu->last_char_recv_time;
+            if (byte_timeout != 0 && byte_timeout < wait_time) {
+                wait_time = byte_timeout;
+            }
+        }
+
+        elapsed = micros() - last;
+        if (elapsed >= wait_time) {
+            break;
+        }
+        _modbus_idle(ctx, wait_time - elapsed);
+    }
 
     if (s_rc == 0) {
         /* Timeout */
@@ -1374,12 +1538,16 @@ const modbus_backend_t _modbus_rtu_backend = {
     _modbus_rtu_send_msg_pre,
     _modbus_rtu_send,
     _modbus_rtu_receive,
+    _modbus_rtu_receive_poll,
     _modbus_rtu_recv,
+    NULL,
+    _modbus_rtu_frame_delay,
     _modbus_rtu_check_integrity,
     _modbus_rtu_pre_check_confirmation,
     _modbus_rtu_connect,
     _modbus_rtu_close,
     _modbus_rtu_flush,
+    _modbus_rtu_discard,
     _modbus_rtu_select,
     _modbus_rtu_free
 };
@@ -1433,6 +1601,8 @@ modbus_t* modbus_new_rtu(const char *device,
     ctx_rtu->rs485 = rs485;
     ctx_rtu->baud = baud;
     ctx_rtu->config = config;
+    ctx_rtu->last_char_recv_time = 0;
+    ctx_rtu->num_in_recv_buffer = 0;
 #else
     ctx_rtu->device = NULL;
 
@@ -1474,6 +1644,17 @@ modbus_t* modbus_new_rtu(const char *device,
 #endif
 
     ctx_rtu->confirmation_to_ignore = FALSE;
+    ctx_rtu->crc_msg = NULL;
+    ctx_rtu->crc_length = 0;
+
+    _modbus_rtu_init_timing(ctx_rtu);
+#ifdef ARDUINO
+    /* The stream is fed as the characters arrive so a frame is known to be
+       incomplete after a silence of t1.5. The serial drivers of the hosts
+       deliver the characters by blocks, the byte timeout is kept there. */
+    ctx->byte_timeout.tv_sec = 0;
+    ctx->byte_timeout.tv_usec = ctx_rtu->t15;
+#endif
 
     return ctx;
 }
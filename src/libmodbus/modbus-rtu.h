@@ -43,6 +43,11 @@ MODBUS_API int modbus_rtu_set_rts_delay(modbus_t *ctx, int us);
 MODBUS_API int modbus_rtu_get_rts_delay(modbus_t *ctx);
 #endif
 
+MODBUS_API int modbus_rtu_set_char_timeout(modbus_t *ctx, int us);
+MODBUS_API int modbus_rtu_get_char_timeout(modbus_t *ctx);
+MODBUS_API int modbus_rtu_set_frame_delay(modbus_t *ctx, int us);
+MODBUS_API int modbus_rtu_get_frame_delay(modbus_t *ctx);
+
 MODBUS_END_DECLS
 
 #endif /* MODBUS_RTU_H */
@@ -0,0 +1,1458 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+/* Modbus TCP server engine for the Linux host build.
+
+   The connections are multiplexed with edge-triggered epoll, so their number
+   isn't bound by FD_SETSIZE and a call only visits the connections with
+   events. Each connection keeps the bytes of its requests partially
+   received, the requests are delimited by the length field of their MBAP
+   header (like MODBUS_RECEIVE_ADU) so a read can receive several of them.
+   They are replied in order through modbus_reply_build() on the context of
+   the server, with the mapping shared by all the connections, and their
+   responses are sent at once.
+
+   The workers (modbus_tcp_workers_new()) run a server per thread, each on its
+   own listening socket bound to the same port with SO_REUSEPORT so the
+   kernel spreads the connections over them. They share the mapping, which
+   modbus_reply() reads and updates under the sequence lock of each table
+   (see modbus_mapping_write_begin()).
+
+   When config.h defines HAVE_LINUX_IO_URING_H (the <linux/io_uring.h> of
+   Linux 6.0 or later, probed by extras/test/configure.sh for the host
+   tests), modbus_tcp_server_new_uring() drives the same server from an
+   io_uring instead of epoll: the listening socket is served by a multishot
+   accept and each connection by a multishot receive into a ring of buffers
+   registered with the kernel, so a call needs no syscall per socket. The
+   responses are queued as send operations, all of them submitted by a single
+   io_uring_enter() at the end of the call. Only the server uses io_uring:
+   the contexts (TCP clients, RTU) keep their blocking backends, which have a
+   single descriptor to wait for. */
+
+#if !defined(ARDUINO) && defined(__linux__)
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <config.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "modbus-tcp.h"
+
+/* Max number of events handled by an epoll_wait() call */
+#define _SERVER_MAX_EVENTS 256
+
+/* Max number of requests replied on a connection per call, the connection
+   is served again by the next call so the others aren't starved */
+#define _SERVER_MAX_REQUESTS 64
+
+/* Size of the receive buffer of a connection, holding several pipelined
+   requests */
+#define _SERVER_REQ_LENGTH (4 * MODBUS_TCP_MAX_ADU_LENGTH)
+
+/* Size of the buffer of the responses sent at once */
+#define _SERVER_RSP_LENGTH (16 * MODBUS_TCP_MAX_ADU_LENGTH)
+
+/* MBAP header: transaction id (2), protocol id (2), length (2), unit id (1) */
+#define _MBAP_LENGTH 7
+
+/* Time the workers wait for events before checking they must stop, in
+   milliseconds */
+#define _WORKER_POLL_TIMEOUT 100
+
+/* Backlog of the listening sockets of the workers */
+#define _WORKER_BACKLOG 1024
+
+#ifdef HAVE_LINUX_IO_URING_H
+/* Number of entries of the submission queue, the completion queue has 4
+   times more */
+#define _URING_ENTRIES 256
+
+/* Receive buffers provided to the kernel: number (power of 2), size and
+   group */
+#define _URING_BUFS 256
+#define _URING_BUF_SIZE 2048
+#define _URING_BGID 0
+
+/* Max size of the responses queued on a connection whose client doesn't
+   read them */
+#define _URING_OUT_MAX (256 * MODBUS_TCP_MAX_ADU_LENGTH)
+
+/* Operation of a completion, in the low bits of its user_data (the
+   connection) */
+#define _URING_RECV 0
+#define _URING_ACCEPT 1
+#define _URING_SEND 2
+#define _URING_OP_MASK 3
+
+typedef struct _modbus_uring {
+    int fd;
+    /* Submission queue, sqe_tail counts the entries filled so far */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    /* Completion queue */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    /* Mapping of both queues (IORING_FEAT_SINGLE_MMAP) */
+    void *rings;
+    size_t rings_size;
+    /* Ring of the receive buffers, br_tail is published once the
+       completions are handled */
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    uint16_t br_tail;
+    uint8_t *bufs;
+    /* The multishot accept is armed */
+    int accepting;
+} modbus_uring_t;
+#endif
+
+typedef struct _modbus_tcp_connection {
+    int s;
+    /* Number of bytes of req received */
+    int length;
+    /* The socket wasn't drained by the last call */
+    int ready;
+    struct _modbus_tcp_connection *prev;
+    struct _modbus_tcp_connection *next;
+    /* Responses not sent yet: the tail left by a short send (epoll) or the
+       responses being sent (io_uring) */
+    uint8_t *out;
+    int out_size;
+    int out_length;
+    int out_sent;
+#ifdef HAVE_LINUX_IO_URING_H
+    /* io_uring: responses built while out is being sent */
+    uint8_t *pending;
+    int pending_size;
+    int pending_length;
+    /* Operations in flight, the connection is freed once closing and
+       both are over */
+    int receiving;
+    int sending;
+    int closing;
+#endif
+    uint8_t req[_SERVER_REQ_LENGTH];
+} modbus_tcp_connection_t;
+
+struct _modbus_tcp_server {
+    modbus_t *ctx;
+    /* Listening socket */
+    int s;
+    int epfd;
+    int max_connections;
+    int nb_connections;
+    int nb_ready;
+    /* List of the connections */
+    modbus_tcp_connection_t *connections;
+#ifdef HAVE_LINUX_IO_URING_H
+    /* NULL for the epoll engine */
+    modbus_uring_t *ring;
+#endif
+    /* Responses not sent yet */
+    int rsp_length;
+    uint8_t rsp[_SERVER_RSP_LENGTH];
+};
+
+typedef struct _modbus_tcp_worker {
+    modbus_t *ctx;
+    /* Listening socket */
+    int s;
+    modbus_tcp_server_t *server;
+    modbus_mapping_t *mb_mapping;
+    int *stop;
+    pthread_t thread;
+    int started;
+} modbus_tcp_worker_t;
+
+struct _modbus_tcp_workers {
+    int nb_workers;
+    int stop;
+    modbus_tcp_worker_t *workers;
+};
+
+static void connection_close(modbus_tcp_server_t *server,
+                             modbus_tcp_connection_t *connection)
+{
+    if (connection->prev != NULL) {
+        connection->prev->next = connection->next;
+    } else {
+        server->connections = connection->next;
+    }
+    if (connection->next != NULL) {
+        connection->next->prev = connection->prev;
+    }
+    if (connection->ready) {
+        server->nb_ready--;
+    }
+
+    /* Closing the socket removes it from the epoll set */
+    close(connection->s);
+    free(connection->out);
+    free(connection);
+    server->nb_connections--;
+}
+
+/* Accepts all the pending connections, the ones beyond max_connections are
+   closed right away */
+static void accept_connections(modbus_tcp_server_t *server)
+{
+    for (;;) {
+        modbus_tcp_connection_t *connection;
+        struct epoll_event event;
+        int option = 1;
+        int s;
+
+        s = accept4(server->s, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (s == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            /* EAGAIN once the backlog is empty */
+            return;
+        }
+
+        if (server->nb_connections >= server->max_connections) {
+            close(s);
+            continue;
+        }
+
+        connection = (modbus_tcp_connection_t *)malloc(
+            sizeof(modbus_tcp_connection_t));
+        if (connection == NULL) {
+            close(s);
+            continue;
+        }
+        connection->s = s;
+        connection->length = 0;
+        connection->ready = FALSE;
+        connection->out = NULL;
+        connection->out_size = 0;
+        connection->out_length = 0;
+        connection->out_sent = 0;
+
+        /* The responses are sent at once */
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = connection;
+        if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, s, &event) == -1) {
+            close(s);
+            free(connection);
+            continue;
+        }
+        connection->prev = NULL;
+        connection->next = server->connections;
+        if (server->connections != NULL) {
+            server->connections->prev = connection;
+        }
+        server->connections = connection;
+        server->nb_connections++;
+    }
+}
+
+/* Sets the events of the connection, EPOLLOUT is only watched while a tail
+   of responses is waiting for room in the socket */
+static int watch_connection(modbus_tcp_server_t *server,
+                            modbus_tcp_connection_t *connection, int events)
+{
+    struct epoll_event event;
+
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET | events;
+    event.data.ptr = connection;
+
+    return epoll_ctl(server->epfd, EPOLL_CTL_MOD, connection->s, &event);
+}
+
+/* Sends the responses built for the connection. When the socket doesn't
+   take them all (the client reads slower than it sends), the tail is kept
+   in the out buffer of the connection and sent by flush_responses() once
+   the socket is writable. The requests of the connection aren't replied
+   meanwhile.
+
+   The function shall return 0 if successful, or -1 when the connection must
+   be closed. */
+static int send_responses(modbus_tcp_server_t *server,
+                          modbus_tcp_connection_t *connection)
+{
+    ssize_t rc;
+
+    if (server->rsp_length == 0)
+        return 0;
+
+    do {
+        rc = send(connection->s, server->rsp, server->rsp_length, MSG_NOSIGNAL);
+    } while (rc == -1 && errno == EINTR);
+
+    if (rc == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        rc = 0;
+    }
+
+    if (rc < server->rsp_length) {
+        if (connection->out == NULL) {
+            connection->out = (uint8_t *)malloc(_SERVER_RSP_LENGTH);
+            if (connection->out == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            connection->out_size = _SERVER_RSP_LENGTH;
+        }
+        connection->out_length = server->rsp_length - rc;
+        connection->out_sent = 0;
+        memcpy(connection->out, server->rsp + rc, connection->out_length);
+
+        if (watch_connection(server, connection, EPOLLOUT) == -1)
+            return -1;
+    }
+    server->rsp_length = 0;
+
+    return 0;
+}
+
+/* Sends the tail of responses left by send_responses(), the connection stops
+   watching EPOLLOUT once it's sent.
+
+   The function shall return 0 if successful (the tail may not be sent
+   entirely yet), or -1 when the connection must be closed. */
+static int flush_responses(modbus_tcp_server_t *server,
+                           modbus_tcp_connection_t *connection)
+{
+    while (connection->out_sent < connection->out_length) {
+        ssize_t rc = send(connection->s, connection->out + connection->out_sent,
+                          connection->out_length - connection->out_sent,
+                          MSG_NOSIGNAL);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        connection->out_sent += rc;
+    }
+
+    connection->out_length = 0;
+    connection->out_sent = 0;
+
+    return watch_connection(server, connection, 0);
+}
+
+/* Returns the length of the request starting at req, from its MBAP header,
+   or 0 when the header isn't fully received (length bytes). Returns -1 and
+   sets errno when the header is invalid, the frames can't be delimited
+   anymore. */
+static int frame_length(const uint8_t *req, int length)
+{
+    int req_length;
+
+    if (length < _MBAP_LENGTH)
+        return 0;
+
+    req_length = 6 + ((req[4] << 8) | req[5]);
+    if (req[2] != 0 || req[3] != 0 || req_length < _MBAP_LENGTH + 1 ||
+        req_length > MODBUS_TCP_MAX_ADU_LENGTH) {
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    return req_length;
+}
+
+/* Replies the complete requests of the connection in order, their responses
+   are sent together. The replies stop while a tail of responses is waiting
+   to be sent, the remaining requests are kept.
+
+   The function shall return the number of requests replied, or -1 when the
+   connection must be closed (invalid MBAP header or send error). */
+static int reply_requests(modbus_tcp_server_t *server,
+                          modbus_tcp_connection_t *connection,
+                          modbus_mapping_t *mb_mapping)
+{
+    int offset = 0;
+    int nb = 0;
+    int rc;
+
+    server->rsp_length = 0;
+
+    while (connection->out_length == 0) {
+        uint8_t *req = connection->req + offset;
+        int req_length = frame_length(req, connection->length - offset);
+
+        if (req_length == -1)
+            return -1;
+        if (req_length == 0 || connection->length - offset < req_length)
+            break;
+
+        if (server->rsp_length + MODBUS_TCP_MAX_ADU_LENGTH > _SERVER_RSP_LENGTH) {
+            if (send_responses(server, connection) == -1)
+                return -1;
+            if (connection->out_length > 0)
+                break;
+        }
+
+        rc = modbus_reply_build(server->ctx, req, req_length, mb_mapping,
+                                server->rsp + server->rsp_length);
+        if (rc == -1)
+            return -1;
+        server->rsp_length += rc;
+
+        offset += req_length;
+        nb++;
+    }
+
+    if (send_responses(server, connection) == -1)
+        return -1;
+
+    /* Keeps the beginning of the next request */
+    if (offset > 0) {
+        connection->length -= offset;
+        memmove(connection->req, connection->req + offset, connection->length);
+    }
+
+    return nb;
+}
+
+/* Receives the bytes available on the connection and replies the requests.
+   The socket is drained (edge-triggered) unless _SERVER_MAX_REQUESTS requests
+   have been replied, the connection is then marked ready to be served again.
+   While a tail of responses is waiting for room in the socket, the socket
+   isn't read: the connection is served again by the EPOLLOUT event, starting
+   with the requests kept. The connection is closed on errors and hang up.
+
+   The function shall return the number of requests replied. */
+static int serve_connection(modbus_tcp_server_t *server,
+                            modbus_tcp_connection_t *connection,
+                            modbus_mapping_t *mb_mapping)
+{
+    int nb = 0;
+
+    modbus_set_socket(server->ctx, connection->s);
+
+    if (connection->ready) {
+        connection->ready = FALSE;
+        server->nb_ready--;
+    }
+
+    if (connection->out_length > 0) {
+        if (flush_responses(server, connection) == -1)
+            goto close;
+        if (connection->out_length > 0)
+            return 0;
+        nb = reply_requests(server, connection, mb_mapping);
+        if (nb == -1)
+            goto close;
+    }
+
+    for (;;) {
+        ssize_t rc;
+
+        if (connection->out_length > 0)
+            return nb;
+
+        if (nb >= _SERVER_MAX_REQUESTS) {
+            connection->ready = TRUE;
+            server->nb_ready++;
+            return nb;
+        }
+
+        rc = recv(connection->s, connection->req + connection->length,
+                  sizeof(connection->req) - connection->length, 0);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return nb;
+            break;
+        }
+
+        if (rc == 0) {
+            /* Closed by the client */
+            break;
+        }
+
+        connection->length += rc;
+        rc = reply_requests(server, connection, mb_mapping);
+        if (rc == -1)
+            break;
+        nb += rc;
+    }
+
+close:
+    connection_close(server, connection);
+
+    return nb;
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+static void uring_free(modbus_uring_t *ring)
+{
+    /* Closing the ring cancels its operations */
+    if (ring->fd != -1)
+        close(ring->fd);
+    if (ring->rings != NULL)
+        munmap(ring->rings, ring->rings_size);
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->br != NULL)
+        munmap(ring->br, ring->br_size);
+    free(ring->bufs);
+    free(ring);
+}
+
+/* Gives the buffer bid back to the kernel, once br_tail is published */
+static void uring_recycle(modbus_uring_t *ring, int bid)
+{
+    struct io_uring_buf *buf = &ring->br->bufs[ring->br_tail & (_URING_BUFS - 1)];
+
+    buf->addr = (uintptr_t)(ring->bufs + bid * _URING_BUF_SIZE);
+    buf->len = _URING_BUF_SIZE;
+    buf->bid = bid;
+    ring->br_tail++;
+}
+
+static modbus_uring_t *uring_new(void)
+{
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    modbus_uring_t *ring;
+    uint8_t *rings;
+    void *p;
+    int saved_errno;
+    unsigned i;
+
+    ring = (modbus_uring_t *)calloc(1, sizeof(modbus_uring_t));
+    if (ring == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = 4 * _URING_ENTRIES;
+    ring->fd = syscall(__NR_io_uring_setup, _URING_ENTRIES, &params);
+    if (ring->fd == -1) {
+        free(ring);
+        return NULL;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_EXT_ARG)) {
+        errno = ENOSYS;
+        goto error;
+    }
+
+    ring->rings_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    if (params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe) >
+        ring->rings_size) {
+        ring->rings_size = params.cq_off.cqes +
+            params.cq_entries * sizeof(struct io_uring_cqe);
+    }
+    p = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (p == MAP_FAILED)
+        goto error;
+    ring->rings = p;
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    p = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (p == MAP_FAILED)
+        goto error;
+    ring->sqes = (struct io_uring_sqe *)p;
+
+    rings = (uint8_t *)ring->rings;
+    ring->sq_head = (unsigned *)(rings + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(rings + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(rings + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(rings + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(rings + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(rings + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+    /* The entries are always filled in the order of the queue */
+    for (i = 0; i < params.sq_entries; i++) {
+        ((unsigned *)(rings + params.sq_off.array))[i] = i;
+    }
+
+    /* Receive buffers, registered as a ring the kernel picks them from */
+    ring->br_size = _URING_BUFS * sizeof(struct io_uring_buf);
+    p = mmap(NULL, ring->br_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        goto error;
+    ring->br = (struct io_uring_buf_ring *)p;
+
+    ring->bufs = (uint8_t *)malloc(_URING_BUFS * _URING_BUF_SIZE);
+    if (ring->bufs == NULL) {
+        errno = ENOMEM;
+        goto error;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->br;
+    reg.ring_entries = _URING_BUFS;
+    reg.bgid = _URING_BGID;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) == -1) {
+        goto error;
+    }
+
+    for (i = 0; i < _URING_BUFS; i++) {
+        uring_recycle(ring, i);
+    }
+    __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+
+    return ring;
+
+error:
+    saved_errno = errno;
+    uring_free(ring);
+    errno = saved_errno;
+    return NULL;
+}
+
+/* Submits the entries filled, then waits up to timeout milliseconds (-1 for
+   ever) for a completion when wait is set.
+
+   The function shall return 0, or -1 and set errno when io_uring_enter()
+   fails. */
+static int uring_enter(modbus_uring_t *ring, int wait, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned to_submit;
+    unsigned flags = 0;
+    int rc;
+
+    /* The entries not consumed by a failed call are submitted again */
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit == 0 && !wait)
+        return 0;
+
+    memset(&arg, 0, sizeof(arg));
+    if (wait) {
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (timeout >= 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000;
+            arg.ts = (uintptr_t)&ts;
+        }
+    }
+
+    rc = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait ? 1 : 0, flags,
+                 wait ? &arg : NULL, sizeof(arg));
+    if (rc == -1) {
+        /* Timeout, signal, or completions to reap before submitting more */
+        if (errno == ETIME || errno == EINTR || errno == EBUSY ||
+            errno == EAGAIN) {
+            return 0;
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Returns a cleared entry of the submission queue, the queue is submitted
+   when it's full */
+static struct io_uring_sqe *uring_get_sqe(modbus_uring_t *ring)
+{
+    struct io_uring_sqe *sqe;
+
+    if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+        ring->sq_entries) {
+        if (uring_enter(ring, FALSE, 0) == -1)
+            return NULL;
+        if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+            ring->sq_entries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sqe_tail++;
+
+    return sqe;
+}
+
+static int uring_arm_accept(modbus_tcp_server_t *server)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(server->ring);
+
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server->s;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = _URING_ACCEPT;
+    server->ring->accepting = TRUE;
+
+    return 0;
+}
+
+static int uring_arm_recv(modbus_tcp_server_t *server,
+                          modbus_tcp_connection_t *connection)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(server->ring);
+
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = connection->s;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = _URING_BGID;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = (uintptr_t)connection | _URING_RECV;
+    connection->receiving = TRUE;
+
+    return 0;
+}
+
+/* Sends the rest of the responses in flight, or else the pending ones. Only
+   one send is in flight per connection so the responses keep their order. */
+static int uring_send(modbus_tcp_server_t *server,
+                      modbus_tcp_connection_t *connection)
+{
+    struct io_uring_sqe *sqe;
+
+    if (connection->out_sent == connection->out_length) {
+        uint8_t *buffer = connection->out;
+        int size = connection->out_size;
+
+        if (connection->pending_length == 0)
+            return 0;
+
+        connection->out = connection->pending;
+        connection->out_size = connection->pending_size;
+        connection->out_length = connection->pending_length;
+        connection->out_sent = 0;
+        connection->pending = buffer;
+        connection->pending_size = size;
+        connection->pending_length = 0;
+    }
+
+    sqe = uring_get_sqe(server->ring);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = connection->s;
+    sqe->addr = (uintptr_t)(connection->out + connection->out_sent);
+    sqe->len = connection->out_length - connection->out_sent;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)connection | _URING_SEND;
+    connection->sending = TRUE;
+
+    return 0;
+}
+
+/* Closes the connection. Its memory is released once the kernel is done
+   with it: the shutdown ends the receive and send in flight. */
+static void uring_connection_close(modbus_tcp_server_t *server,
+                                   modbus_tcp_connection_t *connection)
+{
+    if (!connection->closing) {
+        connection->closing = TRUE;
+        server->nb_connections--;
+        shutdown(connection->s, SHUT_RDWR);
+    }
+
+    if (connection->receiving || connection->sending)
+        return;
+
+    if (connection->prev != NULL) {
+        connection->prev->next = connection->next;
+    } else {
+        server->connections = connection->next;
+    }
+    if (connection->next != NULL) {
+        connection->next->prev = connection->prev;
+    }
+
+    close(connection->s);
+    free(connection->out);
+    free(connection->pending);
+    free(connection);
+}
+
+static void uring_accepted(modbus_tcp_server_t *server, int s)
+{
+    modbus_tcp_connection_t *connection;
+    int option = 1;
+
+    if (server->nb_connections >= server->max_connections) {
+        close(s);
+        return;
+    }
+
+    connection = (modbus_tcp_connection_t *)calloc(
+        1, sizeof(modbus_tcp_connection_t));
+    if (connection == NULL) {
+        close(s);
+        return;
+    }
+    connection->s = s;
+
+    /* The responses are sent at once */
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+
+    connection->next = server->connections;
+    if (server->connections != NULL) {
+        server->connections->prev = connection;
+    }
+    server->connections = connection;
+    server->nb_connections++;
+
+    if (uring_arm_recv(server, connection) == -1) {
+        uring_connection_close(server, connection);
+    }
+}
+
+/* Replies the complete requests received on the connection, their responses
+   are appended to the pending ones.
+
+   The function shall return the number of requests replied, or -1 when the
+   connection must be closed (invalid MBAP header or too many responses not
+   read by the client). */
+static int uring_reply_requests(modbus_tcp_server_t *server,
+                                modbus_tcp_connection_t *connection,
+                                modbus_mapping_t *mb_mapping)
+{
+    int offset = 0;
+    int nb = 0;
+    int rc;
+
+    for (;;) {
+        uint8_t *req = connection->req + offset;
+        int req_length = frame_length(req, connection->length - offset);
+
+        if (req_length == -1)
+            return -1;
+        if (req_length == 0 || connection->length - offset < req_length)
+            break;
+
+        if (connection->pending_size - connection->pending_length <
+            MODBUS_TCP_MAX_ADU_LENGTH) {
+            int size = (connection->pending_size == 0) ?
+                _SERVER_RSP_LENGTH : 2 * connection->pending_size;
+            uint8_t *pending;
+
+            if (size > _URING_OUT_MAX) {
+                errno = ENOBUFS;
+                return -1;
+            }
+            pending = (uint8_t *)realloc(connection->pending, size);
+            if (pending == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            connection->pending = pending;
+            connection->pending_size = size;
+        }
+
+        rc = modbus_reply_build(server->ctx, req, req_length, mb_mapping,
+                                connection->pending + connection->pending_length);
+        if (rc == -1)
+            return -1;
+        connection->pending_length += rc;
+
+        offset += req_length;
+        nb++;
+    }
+
+    /* Keeps the beginning of the next request */
+    if (offset > 0) {
+        connection->length -= offset;
+        memmove(connection->req, connection->req + offset, connection->length);
+    }
+
+    return nb;
+}
+
+/* Handles a completion of the multishot receive of the connection: the
+   bytes are copied out of the provided buffer, which is given back right
+   away, and the requests are replied.
+
+   The function shall return the number of requests replied. */
+static int uring_received(modbus_tcp_server_t *server,
+                          modbus_tcp_connection_t *connection, int res,
+                          unsigned flags, modbus_mapping_t *mb_mapping)
+{
+    modbus_uring_t *ring = server->ring;
+    int failed = (res == 0 || (res < 0 && res != -ENOBUFS && res != -EAGAIN));
+    int nb = 0;
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        const uint8_t *data = ring->bufs + bid * _URING_BUF_SIZE;
+
+        modbus_set_socket(server->ctx, connection->s);
+
+        /* A request is at most MODBUS_TCP_MAX_ADU_LENGTH long, the buffer of
+           the connection always has room once the requests are replied */
+        while (res > 0 && !connection->closing && !failed) {
+            int length = sizeof(connection->req) - connection->length;
+            int rc;
+
+            if (length > res)
+                length = res;
+            memcpy(connection->req + connection->length, data, length);
+            connection->length += length;
+            data += length;
+            res -= length;
+
+            rc = uring_reply_requests(server, connection, mb_mapping);
+            if (rc == -1) {
+                failed = TRUE;
+            } else {
+                nb += rc;
+            }
+        }
+        uring_recycle(ring, bid);
+    }
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+        /* The multishot receive is over, it's armed again unless the
+           connection is lost (out of buffers, the kernel stopped it) */
+        connection->receiving = FALSE;
+        if (!failed && !connection->closing &&
+            uring_arm_recv(server, connection) == -1) {
+            failed = TRUE;
+        }
+    }
+
+    if (!failed && !connection->closing && !connection->sending &&
+        uring_send(server, connection) == -1) {
+        failed = TRUE;
+    }
+
+    if (failed || connection->closing) {
+        uring_connection_close(server, connection);
+    }
+
+    return nb;
+}
+
+static void uring_sent(modbus_tcp_server_t *server,
+                       modbus_tcp_connection_t *connection, int res)
+{
+    int failed = FALSE;
+
+    connection->sending = FALSE;
+
+    if (res < 0 && res != -EAGAIN && res != -EINTR) {
+        failed = TRUE;
+    } else {
+        if (res > 0)
+            connection->out_sent += res;
+        if (!connection->closing && uring_send(server, connection) == -1)
+            failed = TRUE;
+    }
+
+    if (failed || connection->closing) {
+        uring_connection_close(server, connection);
+    }
+}
+
+static int uring_poll(modbus_tcp_server_t *server,
+                      modbus_mapping_t *mb_mapping, int timeout)
+{
+    modbus_uring_t *ring = server->ring;
+    unsigned head;
+    unsigned tail;
+    int nb = 0;
+    int s;
+
+    /* Errors are retried by the next call */
+    if (!ring->accepting) {
+        uring_arm_accept(server);
+    }
+
+    /* The completions of the last submissions may be there already */
+    head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) &&
+        uring_enter(ring, TRUE, timeout) == -1) {
+        return -1;
+    }
+
+    s = modbus_get_socket(server->ctx);
+
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        modbus_tcp_connection_t *connection =
+            (modbus_tcp_connection_t *)(uintptr_t)(user_data & ~(uint64_t)_URING_OP_MASK);
+
+        /* The entry is released before handling it, the handlers may
+           submit */
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        switch (user_data & _URING_OP_MASK) {
+        case _URING_ACCEPT:
+            if (res >= 0) {
+                uring_accepted(server, res);
+            }
+            if (!(flags & IORING_CQE_F_MORE)) {
+                ring->accepting = FALSE;
+            }
+            break;
+        case _URING_RECV:
+            nb += uring_received(server, connection, res, flags, mb_mapping);
+            break;
+        case _URING_SEND:
+            uring_sent(server, connection, res);
+            break;
+        }
+    }
+
+    /* The buffers consumed are given back and the responses sent */
+    __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+    modbus_set_socket(server->ctx, s);
+
+    if (uring_enter(ring, FALSE, 0) == -1)
+        return -1;
+
+    return nb;
+}
+#endif
+
+/* Allocates a server of the connections accepted on the listening socket s
+   (see modbus_tcp_listen()). The requests are replied with ctx, which must
+   not be used meanwhile. Up to max_connections clients are served at once,
+   the others are disconnected. */
+modbus_tcp_server_t* modbus_tcp_server_new(modbus_t *ctx, int s,
+                                           int max_connections)
+{
+    modbus_tcp_server_t *server;
+    struct epoll_event event;
+    int flags;
+
+    if (ctx == NULL || s < 0 || max_connections < 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    server = (modbus_tcp_server_t *)malloc(sizeof(modbus_tcp_server_t));
+    if (server == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    server->ctx = ctx;
+    server->s = s;
+    server->max_connections = max_connections;
+    server->nb_connections = 0;
+    server->nb_ready = 0;
+    server->connections = NULL;
+    server->rsp_length = 0;
+#ifdef HAVE_LINUX_IO_URING_H
+    server->ring = NULL;
+#endif
+
+    server->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (server->epfd == -1) {
+        free(server);
+        return NULL;
+    }
+
+    /* The backlog is emptied at each event */
+    flags = fcntl(s, F_GETFL, 0);
+    if (flags == -1 || fcntl(s, F_SETFL, flags | O_NONBLOCK) == -1) {
+        close(server->epfd);
+        free(server);
+        return NULL;
+    }
+
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL;
+    if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, s, &event) == -1) {
+        close(server->epfd);
+        free(server);
+        return NULL;
+    }
+
+    return server;
+}
+
+/* Same as modbus_tcp_server_new() with an io_uring instead of epoll. It
+   requires Linux 6.0 (multishot receive), errno is set to ENOSYS when the
+   library is built without io_uring support or EINVAL/ENOSYS by older
+   kernels. */
+modbus_tcp_server_t* modbus_tcp_server_new_uring(modbus_t *ctx, int s,
+                                                 int max_connections)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+    modbus_tcp_server_t *server;
+
+    if (ctx == NULL || s < 0 || max_connections < 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    server = (modbus_tcp_server_t *)malloc(sizeof(modbus_tcp_server_t));
+    if (server == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    server->ctx = ctx;
+    server->s = s;
+    server->epfd = -1;
+    server->max_connections = max_connections;
+    server->nb_connections = 0;
+    server->nb_ready = 0;
+    server->connections = NULL;
+    server->rsp_length = 0;
+
+    server->ring = uring_new();
+    if (server->ring == NULL) {
+        free(server);
+        return NULL;
+    }
+
+    return server;
+#else
+    (void)ctx;
+    (void)s;
+    (void)max_connections;
+    errno = ENOSYS;
+    return NULL;
+#endif
+}
+
+/* Waits up to timeout milliseconds (-1 for ever) for events, then accepts the
+   new connections and replies the requests received with mb_mapping.
+
+   The function shall return the number of requests replied, or -1 and set
+   errno when epoll_wait() fails. */
+int modbus_tcp_server_poll(modbus_tcp_server_t *server,
+                           modbus_mapping_t *mb_mapping, int timeout)
+{
+    struct epoll_event events[_SERVER_MAX_EVENTS];
+    modbus_tcp_connection_t *connection;
+    modbus_tcp_connection_t *next;
+    int nb = 0;
+    int s;
+    int n;
+    int i;
+
+    if (server == NULL || mb_mapping == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#ifdef HAVE_LINUX_IO_URING_H
+    if (server->ring != NULL)
+        return uring_poll(server, mb_mapping, timeout);
+#endif
+
+    /* The connections not drained have bytes waiting */
+    n = epoll_wait(server->epfd, events, _SERVER_MAX_EVENTS,
+                   server->nb_ready > 0 ? 0 : timeout);
+    if (n == -1) {
+        return (errno == EINTR) ? 0 : -1;
+    }
+
+    s = modbus_get_socket(server->ctx);
+
+    for (i = 0; i < n; i++) {
+        connection = (modbus_tcp_connection_t *)events[i].data.ptr;
+
+        if (connection == NULL) {
+            accept_connections(server);
+        } else {
+            /* The bytes received before the hang up are replied */
+            nb += serve_connection(server, connection, mb_mapping);
+        }
+    }
+
+    /* Once the events are handled, none of them refers to a connection
+       closed here */
+    if (server->nb_ready > 0) {
+        for (connection = server->connections; connection != NULL;
+             connection = next) {
+            next = connection->next;
+            if (connection->ready) {
+                nb += serve_connection(server, connection, mb_mapping);
+            }
+        }
+    }
+
+    modbus_set_socket(server->ctx, s);
+
+    return nb;
+}
+
+/* Returns the number of clients connected */
+int modbus_tcp_server_get_connections(modbus_tcp_server_t *server)
+{
+    if (server == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return server->nb_connections;
+}
+
+/* Closes the connections and frees the server. The listening socket is left
+   open. */
+void modbus_tcp_server_free(modbus_tcp_server_t *server)
+{
+    if (server == NULL)
+        return;
+
+#ifdef HAVE_LINUX_IO_URING_H
+    if (server->ring != NULL) {
+        /* Nothing is in flight once the ring is closed */
+        uring_free(server->ring);
+        while (server->connections != NULL) {
+            modbus_tcp_connection_t *connection = server->connections;
+
+            server->connections = connection->next;
+            close(connection->s);
+            free(connection->out);
+            free(connection->pending);
+            free(connection);
+        }
+        free(server);
+        return;
+    }
+#endif
+
+    while (server->connections != NULL) {
+        connection_close(server, server->connections);
+    }
+    close(server->epfd);
+    free(server);
+}
+
+/* Opens a listening socket on ip_address:port which other sockets can bind
+   too (SO_REUSEPORT) */
+static int listen_shared(const char *ip_address, int port)
+{
+    struct sockaddr_in addr;
+    int enable = 1;
+    int s;
+
+    s = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (s == -1) {
+        return -1;
+    }
+
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) == -1 ||
+        setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1) {
+        close(s);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (ip_address == NULL || ip_address[0] == '0') {
+        /* Listen any addresses */
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    } else if (inet_pton(AF_INET, ip_address, &addr.sin_addr) != 1) {
+        close(s);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(s, _WORKER_BACKLOG) == -1) {
+        close(s);
+        return -1;
+    }
+
+    return s;
+}
+
+static void *worker_run(void *arg)
+{
+    modbus_tcp_worker_t *worker = (modbus_tcp_worker_t *)arg;
+
+    while (!__atomic_load_n(worker->stop, __ATOMIC_ACQUIRE)) {
+        if (modbus_tcp_server_poll(worker->server, worker->mb_mapping,
+                                   _WORKER_POLL_TIMEOUT) == -1) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* Allocates nb_workers servers of ip_address:port (any address when NULL),
+   each with its own context, listening socket and epoll set. Each of them
+   serves up to max_connections clients. The contexts can be configured (slave,
+   debug...) before modbus_tcp_workers_start(). */
+modbus_tcp_workers_t* modbus_tcp_workers_new(const char *ip_address, int port,
+                                             int nb_workers,
+                                             int max_connections)
+{
+    modbus_tcp_workers_t *workers;
+    int i;
+
+    if (nb_workers < 1 || max_connections < 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    workers = (modbus_tcp_workers_t *)malloc(sizeof(modbus_tcp_workers_t));
+    if (workers == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    workers->workers = (modbus_tcp_worker_t *)calloc(
+        nb_workers, sizeof(modbus_tcp_worker_t));
+    if (workers->workers == NULL) {
+        free(workers);
+        errno = ENOMEM;
+        return NULL;
+    }
+    workers->nb_workers = nb_workers;
+    workers->stop = FALSE;
+
+    for (i = 0; i < nb_workers; i++) {
+        modbus_tcp_worker_t *worker = &workers->workers[i];
+
+        worker->s = -1;
+        worker->stop = &workers->stop;
+        worker->ctx = modbus_new_tcp(ip_address != NULL ? ip_address : "0.0.0.0",
+                                     port);
+        if (worker->ctx == NULL)
+            break;
+        worker->s = listen_shared(ip_address, port);
+        if (worker->s == -1)
+            break;
+        worker->server = modbus_tcp_server_new(worker->ctx, worker->s,
+                                               max_connections);
+        if (worker->server == NULL)
+            break;
+    }
+
+    if (i < nb_workers) {
+        int saved_errno = errno;
+
+        /* The workers set up are released */
+        workers->nb_workers = i + 1;
+        modbus_tcp_workers_free(workers);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    return workers;
+}
+
+/* Returns the context of the worker, to configure it */
+modbus_t* modbus_tcp_workers_get_context(modbus_tcp_workers_t *workers,
+                                         int worker)
+{
+    if (workers == NULL || worker < 0 || worker >= workers->nb_workers) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return workers->workers[worker].ctx;
+}
+
+/* Starts a thread per worker, serving the requests with mb_mapping until
+   modbus_tcp_workers_free(). The mapping must not be reallocated meanwhile,
+   its values are updated between modbus_mapping_write_begin() and
+   modbus_mapping_write_end(). */
+int modbus_tcp_workers_start(modbus_tcp_workers_t *workers,
+                             modbus_mapping_t *mb_mapping)
+{
+    int i;
+
+    if (workers == NULL || mb_mapping == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (i = 0; i < workers->nb_workers; i++) {
+        modbus_tcp_worker_t *worker = &workers->workers[i];
+        int rc;
+
+        if (worker->started) {
+            errno = EBUSY;
+            return -1;
+        }
+
+        worker->mb_mapping = mb_mapping;
+        rc = pthread_create(&worker->thread, NULL, worker_run, worker);
+        if (rc != 0) {
+            errno = rc;
+            return -1;
+        }
+        worker->started = TRUE;
+    }
+
+    return 0;
+}
+
+/* Stops the threads of the workers, closes their connections and frees
+   them */
+void modbus_tcp_workers_free(modbus_tcp_workers_t *workers)
+{
+    int i;
+
+    if (workers == NULL)
+        return;
+
+    __atomic_store_n(&workers->stop, TRUE, __ATOMIC_RELEASE);
+
+    for (i = 0; i < workers->nb_workers; i++) {
+        modbus_tcp_worker_t *worker = &workers->workers[i];
+
+        if (worker->started) {
+            pthread_join(worker->thread, NULL);
+        }
+        modbus_tcp_server_free(worker->server);
+        if (worker->s != -1) {
+            close(worker->s);
+        }
+        modbus_free(worker->ctx);
+    }
+
+    free(workers->workers);
+    free(workers);
+}
+
+#endif
@@ -123,7 +123,7 @@ static int _modbus_tcp_build_request_basis(modbus_t *ctx, int function,
 #ifdef ARDUINO
     modbus_tcp_t *ctx_tcp = (modbus_tcp_t*)ctx->backend_data;
 #else
-    modbus_tcp_t *ctx_tcp = ctx->backend_data;
+    modbus_tcp_t *ctx_tcp = (modbus_tcp_t *)ctx->backend_data;
 #endif
 
     /* Increase transaction ID */
@@ -183,11 +183,12 @@ static int _modbus_tcp_prepare_response_tid(const uint8_t *req, int *req_length)
     return (req[0] << 8) + req[1];
 }
 
-static int _modbus_tcp_send_msg_pre(uint8_t *req, int req_length)
+static int _modbus_tcp_send_msg_pre(uint8_t *req, int req_length, uint16_t crc)
 {
     /* Substract the header length to the message length */
     int mbap_length = req_length - 6;
 
+    (void)crc;
     req[4] = mbap_length >> 8;
     req[5] = mbap_length & 0x00FF;
 
@@ -213,6 +214,10 @@ static int _modbus_tcp_receive(modbus_t *ctx, uint8_t *req) {
     return _modbus_receive_msg(ctx, req, MSG_INDICATION);
 }
 
+static int _modbus_tcp_receive_poll(modbus_t *ctx, uint8_t *req) {
+    return _modbus_receive_msg_poll(ctx, req, MSG_INDICATION);
+}
+
 static ssize_t _modbus_tcp_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length) {
 #ifdef ARDUINO
     modbus_tcp_t *ctx_tcp = (modbus_tcp_t*)ctx->backend_data;
@@ -223,6 +228,13 @@ static ssize_t _modbus_tcp_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length) {
 #endif
 }
 
+/* The MBAP length field counts the unit identifier and the PDU so the whole
+   ADU is known as soon as the header has been received */
+static int _modbus_tcp_adu_length(const uint8_t *msg)
+{
+    return _MODBUS_TCP_HEADER_LENGTH - 1 + ((msg[4] << 8) | msg[5]);
+}
+
 static int _modbus_tcp_check_integrity(modbus_t *ctx, uint8_t *msg, const int msg_length)
 {
 #ifdef ARDUINO
@@ -360,7 +372,7 @@ static int _modbus_tcp_connect(modbus_t *ctx)
     int rc;
     /* Specialized version of sockaddr for Internet socket address (same size) */
     struct sockaddr_in addr;
-    modbus_tcp_t *ctx_tcp = ctx->backend_data;
+    modbus_tcp_t *ctx_tcp = (modbus_tcp_t *)ctx->backend_data;
     int flags = SOCK_STREAM;
 #endif
 
@@ -421,7 +433,7 @@ static int _modbus_tcp_pi_connect(modbus_t *ctx)
     struct addrinfo *ai_list;
     struct addrinfo *ai_ptr;
     struct addrinfo ai_hints;
-    modbus_tcp_pi_t *ctx_tcp_pi = ctx->backend_data;
+    modbus_tcp_pi_t *ctx_tcp_pi = (modbus_tcp_pi_t *)ctx->backend_data;
 
 #ifdef OS_WIN32
     if (_modbus_tcp_init_win32() == -1) {
@@ -559,6 +571,44 @@ static int _modbus_tcp_flush(modbus_t *ctx)
 #endif
 }
 
+static int _modbus_tcp_select(modbus_t *ctx, fd_set *rset, struct timeval *tv,
+                              int length_to_read);
+
+/* Drops the rest of a bad frame, its length is given by the MBAP header so
+   the next frame is left untouched */
+static int _modbus_tcp_discard(modbus_t *ctx, const uint8_t *msg, int msg_length)
+{
+    uint8_t devnull[MODBUS_TCP_MAX_ADU_LENGTH];
+    int remaining = _modbus_tcp_adu_length(msg) - msg_length;
+    int rc_sum = 0;
+
+    while (remaining > 0) {
+        fd_set rset;
+        struct timeval tv;
+        int rc;
+
+#ifndef ARDUINO
+        FD_ZERO(&rset);
+        FD_SET(ctx->s, &rset);
+#endif
+        tv.tv_sec = ctx->byte_timeout.tv_sec;
+        tv.tv_usec = ctx->byte_timeout.tv_usec;
+        if (_modbus_tcp_select(ctx, &rset, &tv, 1) == -1) {
+            return -1;
+        }
+
+        rc = _modbus_tcp_recv(ctx, devnull, remaining < (int)sizeof(devnull) ?
+                              remaining : (int)sizeof(devnull));
+        if (rc <= 0) {
+            return -1;
+        }
+        remaining -= rc;
+        rc_sum += rc;
+    }
+
+    return rc_sum;
+}
+
 /* Listens for any request from one or many modbus masters in TCP */
 #ifdef ARDUINO
 int modbus_tcp_listen(modbus_t *ctx)
@@ -581,7 +631,7 @@ int modbus_tcp_listen(modbus_t *ctx, int nb_connection)
 #ifdef ARDUINO
     return 0;
 #else
-    ctx_tcp = ctx->backend_data;
+    ctx_tcp = (modbus_tcp_t *)ctx->backend_data;
 
 #ifdef OS_WIN32
     if (_modbus_tcp_init_win32() == -1) {
@@ -643,7 +693,7 @@ int modbus_tcp_pi_listen(modbus_t *ctx, int nb_connection)
         return -1;
     }
 
-    ctx_tcp_pi = ctx->backend_data;
+    ctx_tcp_pi = (modbus_tcp_pi_t *)ctx->backend_data;
 
 #ifdef OS_WIN32
     if (_modbus_tcp_init_win32() == -1) {
@@ -761,12 +811,11 @@ int modbus_tcp_accept(modbus_t *ctx, int *s)
         return -1;
     }
 
-#ifdef ARDUINO
-    if (client == NULL) {
-        errno = EINVAL;
-        return -1;
-    }
+    /* The new connection starts with a new message */
+    ctx->parser.length_to_read = 0;
 
+#ifdef ARDUINO
+    /* NULL detaches the context from the client it was given */
     modbus_tcp_t *ctx_tcp = (modbus_tcp_t*)ctx->backend_data;
 
     ctx_tcp->client = client;
@@ -807,6 +856,9 @@ int modbus_tcp_pi_accept(modbus_t *ctx, int *s)
         return -1;
     }
 
+    /* The new connection starts with a new message */
+    ctx->parser.length_to_read = 0;
+
     addrlen = sizeof(addr);
 #ifdef HAVE_ACCEPT4
     /* Inherit socket flags and use accept4 call */
@@ -835,16 +887,23 @@ static int _modbus_tcp_select(modbus_t *ctx, fd_set *rset, struct timeval *tv, i
 
     modbus_tcp_t *ctx_tcp = (modbus_tcp_t*)ctx->backend_data;
 
-    unsigned long wait_time_millis = (tv == NULL) ? 0 : (tv->tv_sec * 1000) + (tv->tv_usec / 1000);
-    unsigned long start = millis();
+    unsigned long wait_time = (tv == NULL) ? 0 : _modbus_timeval_to_us(tv);
+    unsigned long start = micros();
+    unsigned long elapsed;
 
-    do {
+    for (;;) {
         s_rc = ctx_tcp->client->available();
 
-        if (s_rc >= length_to_read) {
+        if (s_rc >= length_to_read || !ctx_tcp->client->connected()) {
             break;
         }
-    } while ((millis() - start) < wait_time_millis && ctx_tcp->client->connected());
+
+        elapsed = micros() - start;
+        if (elapsed >= wait_time) {
+            break;
+        }
+        _modbus_idle(ctx, wait_time - elapsed);
+    }
 #else
     while ((s_rc = select(ctx->s+1, rset, NULL, NULL, tv)) == -1) {
         if (errno == EINTR) {
@@ -885,12 +944,16 @@ const modbus_backend_t _modbus_tcp_backend = {
     _modbus_tcp_send_msg_pre,
     _modbus_tcp_send,
     _modbus_tcp_receive,
+    _modbus_tcp_receive_poll,
     _modbus_tcp_recv,
+    _modbus_tcp_adu_length,
+    NULL,
     _modbus_tcp_check_integrity,
     _modbus_tcp_pre_check_confirmation,
     _modbus_tcp_connect,
     _modbus_tcp_close,
     _modbus_tcp_flush,
+    _modbus_tcp_discard,
     _modbus_tcp_select,
     _modbus_tcp_free
 };
@@ -909,12 +972,16 @@ const modbus_backend_t _modbus_tcp_pi_backend = {
     _modbus_tcp_send_msg_pre,
     _modbus_tcp_send,
     _modbus_tcp_receive,
+    _modbus_tcp_receive_poll,
     _modbus_tcp_recv,
+    _modbus_tcp_adu_length,
+    NULL,
     _modbus_tcp_check_integrity,
     _modbus_tcp_pre_check_confirmation,
     _modbus_tcp_pi_connect,
     _modbus_tcp_close,
     _modbus_tcp_flush,
+    _modbus_tcp_discard,
     _modbus_tcp_select,
     _modbus_tcp_free
 };
@@ -72,6 +72,30 @@ MODBUS_API int modbus_tcp_accept(modbus_t *ctx, int *s);
 MODBUS_API modbus_t* modbus_new_tcp_pi(const char *node, const char *service);
 MODBUS_API int modbus_tcp_pi_listen(modbus_t *ctx, int nb_connection);
 MODBUS_API int modbus_tcp_pi_accept(modbus_t *ctx, int *s);
+
+#ifdef __linux__
+typedef struct _modbus_tcp_server modbus_tcp_server_t;
+
+MODBUS_API modbus_tcp_server_t* modbus_tcp_server_new(modbus_t *ctx, int s,
+                                                      int max_connections);
+MODBUS_API modbus_tcp_server_t* modbus_tcp_server_new_uring(modbus_t *ctx, int s,
+                                                            int max_connections);
+MODBUS_API int modbus_tcp_server_poll(modbus_tcp_server_t *server,
+                                      modbus_mapping_t *mb_mapping, int timeout);
+MODBUS_API int modbus_tcp_server_get_connections(modbus_tcp_server_t *server);
+MODBUS_API void modbus_tcp_server_free(modbus_tcp_server_t *server);
+
+typedef struct _modbus_tcp_workers modbus_tcp_workers_t;
+
+MODBUS_API modbus_tcp_workers_t* modbus_tcp_workers_new(const char *ip_address,
+                                                        int port, int nb_workers,
+                                                        int max_connections);
+MODBUS_API modbus_t* modbus_tcp_workers_get_context(modbus_tcp_workers_t *workers,
+                                                    int worker);
+MODBUS_API int modbus_tcp_workers_start(modbus_tcp_workers_t *workers,
+                                        modbus_mapping_t *mb_mapping);
+MODBUS_API void modbus_tcp_workers_free(modbus_tcp_workers_t *workers);
+#endif
 #endif
 
 MODBUS_END_DECLS
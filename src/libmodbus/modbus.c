@@ -31,6 +31,9 @@
 #ifndef ARDUINO
 #include <config.h>
 #endif
+#if defined(ARDUINO_ARCH_MBED)
+#include <cmsis_os2.h>
+#endif
 
 #if defined(ARDUINO) && defined(__AVR__)
 #undef EIO
@@ -50,6 +53,12 @@
 
 #undef ENOTSUP
 #define ENOTSUP 134
+
+#undef EAGAIN
+#define EAGAIN 11
+
+#undef EBUSY
+#define EBUSY 16
 #endif
 
 #include "modbus.h"
@@ -66,13 +75,6 @@ const unsigned int libmodbus_version_micro = LIBMODBUS_VERSION_MICRO;
 /* Max between RTU and TCP max adu length (so TCP) */
 #define MAX_MESSAGE_LENGTH 260
 
-/* 3 steps are used to parse the query */
-typedef enum {
-    _STEP_FUNCTION,
-    _STEP_META,
-    _STEP_DATA
-} _step_t;
-
 #if defined(ARDUINO) && defined(__AVR__)
 
 char *strerror(int errnum)
@@ -92,6 +94,8 @@ char *strerror(int errnum)
             return "Connection timed out";
         case ENOTSUP:
             return "Not supported";
+        case EBUSY:
+            return "Device or resource busy";
         default:
             return "Unknown";
     }
@@ -147,6 +151,35 @@ void _error_print(modbus_t *ctx, const char *context)
     }
 }
 
+/* Microseconds elapsed from an arbitrary origin. The counter wraps around,
+   only the differences between two values are meaningful. */
+unsigned long _modbus_micros(void)
+{
+#if defined(_WIN32)
+    return GetTickCount() * 1000UL;
+#elif defined(ARDUINO)
+    return micros();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+#endif
+}
+
+/* Converts tv to microseconds. Durations are compared to differences of
+   _modbus_micros() so they're bounded to half of its range. */
+unsigned long _modbus_timeval_to_us(const struct timeval *tv)
+{
+    const unsigned long max_sec = (ULONG_MAX / 2) / 1000000UL - 1;
+
+    if ((unsigned long)tv->tv_sec > max_sec) {
+        return max_sec * 1000000UL;
+    }
+
+    return (unsigned long)tv->tv_sec * 1000000UL + tv->tv_usec;
+}
+
 static void _sleep_response_timeout(modbus_t *ctx)
 {
     /* Response timeout is always positive */
@@ -155,10 +188,11 @@ static void _sleep_response_timeout(modbus_t *ctx)
     Sleep((ctx->response_timeout.tv_sec * 1000) +
           (ctx->response_timeout.tv_usec / 1000));
 #elif defined(ARDUINO)
-    ctx->print('x');
-    ctx->print(ctx->response_timeout.tv_sec * 1000);
-    delay(ctx->response_timeout.tv_sec * 1000);
-    delayMicroseconds(ctx->response_timeout.tv_usec);
+    unsigned long us = _modbus_timeval_to_us(&ctx->response_timeout);
+
+    /* delayMicroseconds() is only accurate for short delays */
+    delay(us / 1000);
+    delayMicroseconds(us % 1000);
 #else
     /* usleep source code */
     struct timespec request, remaining;
@@ -170,6 +204,17 @@ static void _sleep_response_timeout(modbus_t *ctx)
 #endif
 }
 
+/* Releases all the transactions in flight */
+static void transactions_clear(modbus_t *ctx)
+{
+    int i;
+
+    for (i = 0; i < ctx->max_transactions; i++) {
+        ctx->transactions[i].req_length = 0;
+    }
+    ctx->nb_transactions = 0;
+}
+
 int modbus_flush(modbus_t *ctx)
 {
     int rc;
@@ -179,6 +224,8 @@ int modbus_flush(modbus_t *ctx)
         return -1;
     }
 
+    ctx->parser.length_to_read = 0;
+    transactions_clear(ctx);
     rc = ctx->backend->flush(ctx);
     if (rc != -1 && ctx->debug) {
         /* Not all backends are able to return the number of bytes flushed */
@@ -224,13 +271,24 @@ static unsigned int compute_response_length_from_request(modbus_t *ctx, uint8_t
     return offset + length + ctx->backend->checksum_length;
 }
 
-/* Sends a request/response */
-static int send_msg(modbus_t *ctx, uint8_t *msg, int msg_length)
+/* CRC register after the message on the backends with a checksum, 0 on the
+   others */
+static uint16_t msg_crc(modbus_t *ctx, const uint8_t *msg, int msg_length)
+{
+    if (ctx->backend->checksum_length == 0)
+        return 0;
+
+    return _modbus_crc16_update(0xFFFF, msg, msg_length);
+}
+
+/* Sends a request/response, crc is given by msg_crc() or computed while the
+   message was built */
+static int _send_msg(modbus_t *ctx, uint8_t *msg, int msg_length, uint16_t crc)
 {
     int rc;
     int i;
 
-    msg_length = ctx->backend->send_msg_pre(msg, msg_length);
+    msg_length = ctx->backend->send_msg_pre(msg, msg_length, crc);
 
     if (ctx->debug) {
         for (i = 0; i < msg_length; i++)
@@ -269,17 +327,31 @@ static int send_msg(modbus_t *ctx, uint8_t *msg, int msg_length)
     return rc;
 }
 
-int modbus_send_raw_request(modbus_t *ctx, uint8_t *raw_req, int raw_req_length)
+static int send_msg_crc(modbus_t *ctx, uint8_t *msg, int msg_length,
+                        uint16_t crc)
 {
-    sft_t sft;
-    uint8_t req[MAX_MESSAGE_LENGTH];
-    int req_length;
-
-    if (ctx == NULL) {
-        errno = EINVAL;
+    /* The confirmation of a request in flight would be taken for the one of
+       this message */
+    if (ctx->nb_transactions != 0) {
+        errno = EBUSY;
         return -1;
     }
 
+    return _send_msg(ctx, msg, msg_length, crc);
+}
+
+static int send_msg(modbus_t *ctx, uint8_t *msg, int msg_length)
+{
+    return send_msg_crc(ctx, msg, msg_length, msg_crc(ctx, msg, msg_length));
+}
+
+/* Builds in req the ADU of the raw request (slave followed by the PDU) */
+static int build_raw_request(modbus_t *ctx, const uint8_t *raw_req,
+                             int raw_req_length, uint8_t *req)
+{
+    sft_t sft;
+    int req_length;
+
     if (raw_req_length < 2 || raw_req_length > (MODBUS_MAX_PDU_LENGTH + 1)) {
         /* The raw request must contain function and slave at least and
            must not be longer than the maximum pdu length plus the slave
@@ -301,6 +373,23 @@ int modbus_send_raw_request(modbus_t *ctx, uint8_t *raw_req, int raw_req_length)
         req_length += raw_req_length - 2;
     }
 
+    return req_length;
+}
+
+int modbus_send_raw_request(modbus_t *ctx, uint8_t *raw_req, int raw_req_length)
+{
+    uint8_t req[MAX_MESSAGE_LENGTH];
+    int req_length;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    req_length = build_raw_request(ctx, raw_req, raw_req_length, req);
+    if (req_length == -1)
+        return -1;
+
     return send_msg(ctx, req, req_length);
 }
 
@@ -310,74 +399,40 @@ int modbus_send_raw_request(modbus_t *ctx, uint8_t *raw_req, int raw_req_length)
  *  ---------- Confirmation  Response ----------
  */
 
+static const modbus_function_t *get_function(modbus_t *ctx, int function);
+
 /* Computes the length to read after the function received */
-static uint8_t compute_meta_length_after_function(int function,
+static uint8_t compute_meta_length_after_function(modbus_t *ctx, int function,
                                                   msg_type_t msg_type)
 {
-    int length;
+    const modbus_function_t *def = get_function(ctx, function);
 
     if (msg_type == MSG_INDICATION) {
-        if (function <= MODBUS_FC_WRITE_SINGLE_REGISTER) {
-            length = 4;
-        } else if (function == MODBUS_FC_WRITE_MULTIPLE_COILS ||
-                   function == MODBUS_FC_WRITE_MULTIPLE_REGISTERS) {
-            length = 5;
-        } else if (function == MODBUS_FC_MASK_WRITE_REGISTER) {
-            length = 6;
-        } else if (function == MODBUS_FC_WRITE_AND_READ_REGISTERS) {
-            length = 9;
-        } else {
-            /* MODBUS_FC_READ_EXCEPTION_STATUS, MODBUS_FC_REPORT_SLAVE_ID */
-            length = 0;
-        }
+        return def->indication_meta_length;
     } else {
         /* MSG_CONFIRMATION */
-        switch (function) {
-        case MODBUS_FC_WRITE_SINGLE_COIL:
-        case MODBUS_FC_WRITE_SINGLE_REGISTER:
-        case MODBUS_FC_WRITE_MULTIPLE_COILS:
-        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
-            length = 4;
-            break;
-        case MODBUS_FC_MASK_WRITE_REGISTER:
-            length = 6;
-            break;
-        default:
-            length = 1;
-        }
+        return def->confirmation_meta_length;
     }
-
-    return length;
 }
 
 /* Computes the length to read after the meta information (address, count, etc) */
 static int compute_data_length_after_meta(modbus_t *ctx, uint8_t *msg,
                                           msg_type_t msg_type)
 {
-    int function = msg[ctx->backend->header_length];
-    int length;
+    const int offset = ctx->backend->header_length;
+    const modbus_function_t *def = get_function(ctx, msg[offset]);
+    int count_offset;
+    int length = 0;
 
     if (msg_type == MSG_INDICATION) {
-        switch (function) {
-        case MODBUS_FC_WRITE_MULTIPLE_COILS:
-        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
-            length = msg[ctx->backend->header_length + 5];
-            break;
-        case MODBUS_FC_WRITE_AND_READ_REGISTERS:
-            length = msg[ctx->backend->header_length + 9];
-            break;
-        default:
-            length = 0;
-        }
+        count_offset = def->indication_count_offset;
     } else {
         /* MSG_CONFIRMATION */
-        if (function <= MODBUS_FC_READ_INPUT_REGISTERS ||
-            function == MODBUS_FC_REPORT_SLAVE_ID ||
-            function == MODBUS_FC_WRITE_AND_READ_REGISTERS) {
-            length = msg[ctx->backend->header_length + 1];
-        } else {
-            length = 0;
-        }
+        count_offset = def->confirmation_count_offset;
+    }
+
+    if (count_offset != 0) {
+        length = msg[offset + count_offset];
     }
 
     length += ctx->backend->checksum_length;
@@ -385,9 +440,148 @@ static int compute_data_length_after_meta(modbus_t *ctx, uint8_t *msg,
     return length;
 }
 
+/* Checks whether the length of the confirmations of the function is unknown,
+   the function code isn't supported (its exception responses are) */
+static int is_unframed_confirmation(modbus_t *ctx, int function)
+{
+    const modbus_function_t *def = get_function(ctx, function);
+
+    return !(function & 0x80) && def->reply == NULL &&
+        def->confirmation_meta_length == 1 &&
+        def->confirmation_count_offset == 0;
+}
+
+/* Computes the length of the whole ADU from the bytes received so far. When
+   the meta information isn't complete yet, only a lower bound is returned (the
+   meta information and the checksum are still to come) and step is left to
+   _STEP_META. */
+static int compute_adu_length(modbus_t *ctx, uint8_t *msg, int msg_length,
+                              msg_type_t msg_type, _step_t *step)
+{
+    const int offset = ctx->backend->header_length;
+    int length;
+
+    if (ctx->backend->adu_length != NULL) {
+        /* The transport header provides the length */
+        *step = _STEP_DATA;
+        return ctx->backend->adu_length(msg);
+    }
+
+    length = offset + 1 + compute_meta_length_after_function(ctx, msg[offset],
+                                                             msg_type);
+    if (msg_length < length) {
+        *step = _STEP_META;
+        return length + ctx->backend->checksum_length;
+    }
+
+    *step = _STEP_DATA;
+    return length + compute_data_length_after_meta(ctx, msg, msg_type);
+}
+
+/* Starts the parsing of a new message */
+static void parser_init(modbus_t *ctx, modbus_parser_t *parser,
+                        msg_type_t msg_type)
+{
+    parser->msg_type = msg_type;
+    parser->msg_length = 0;
+    parser->resume_offset = 0;
+
+    /* We need to analyse the message step by step.  At the first step, we want
+     * to reach the function code because all packets contain this
+     * information. */
+    parser->step = _STEP_FUNCTION;
+    parser->length_to_read = ctx->backend->header_length + 1;
+
+    if (ctx->receive_mode == MODBUS_RECEIVE_ADU) {
+        /* Any ADU ends with its checksum, a confirmation also contains at
+           least an exception code or a byte count */
+        parser->length_to_read += ctx->backend->checksum_length;
+        if (msg_type == MSG_CONFIRMATION) {
+            parser->length_to_read++;
+        }
+    }
+}
+
+/* Results of parser_feed() */
+#define _PARSER_NEED_MORE 0
+#define _PARSER_READY     1
+
+/* Accounts the length bytes received at the end of msg.
+
+   The function shall return _PARSER_NEED_MORE while parser->length_to_read
+   bytes are still expected and _PARSER_READY once the message is complete.
+   Otherwise it shall return -1 and set errno to EMBBADDATA when the message
+   announces an invalid length. */
+static int parser_feed(modbus_t *ctx, modbus_parser_t *parser, uint8_t *msg,
+                       int length)
+{
+    /* Sums bytes received */
+    parser->msg_length += length;
+    /* Computes remaining bytes */
+    parser->length_to_read -= length;
+
+    if (parser->length_to_read != 0 || parser->step == _STEP_DATA ||
+        parser->step == _STEP_SILENCE) {
+        return parser->length_to_read == 0 ? _PARSER_READY : _PARSER_NEED_MORE;
+    }
+
+    if (parser->step == _STEP_FUNCTION && parser->msg_type == MSG_CONFIRMATION &&
+        ctx->backend->frame_delay != NULL &&
+        is_unframed_confirmation(ctx, msg[ctx->backend->header_length])) {
+        /* Relayed confirmation of an unknown function, the bytes are read up
+           to the silence which ends the frame */
+        parser->step = _STEP_SILENCE;
+        parser->length_to_read = ctx->backend->max_adu_length -
+            parser->msg_length;
+        return parser->length_to_read == 0 ? _PARSER_READY : _PARSER_NEED_MORE;
+    }
+
+    if (ctx->receive_mode == MODBUS_RECEIVE_ADU) {
+        parser->length_to_read = compute_adu_length(
+            ctx, msg, parser->msg_length, parser->msg_type,
+            &parser->step) - parser->msg_length;
+        if (parser->length_to_read < 0) {
+            errno = EMBBADDATA;
+            _error_print(ctx, "invalid length");
+            return -1;
+        }
+    } else {
+        switch (parser->step) {
+        case _STEP_FUNCTION:
+            /* Function code position */
+            parser->length_to_read = compute_meta_length_after_function(
+                ctx, msg[ctx->backend->header_length], parser->msg_type);
+            if (parser->length_to_read != 0) {
+                parser->step = _STEP_META;
+                break;
+            } /*FALLTHROUGH */ /* else switches straight to the next step */
+        case _STEP_META:
+            parser->length_to_read = compute_data_length_after_meta(
+                ctx, msg, parser->msg_type);
+            parser->step = _STEP_DATA;
+            break;
+        default:
+            break;
+        }
+    }
+
+    if ((parser->msg_length + parser->length_to_read) >
+        (int)ctx->backend->max_adu_length) {
+        errno = EMBBADDATA;
+        _error_print(ctx, "too many data");
+        return -1;
+    }
+
+    return parser->length_to_read == 0 ? _PARSER_READY : _PARSER_NEED_MORE;
+}
+
 /* Waits a response from a modbus server or a request from a modbus client.
    This function blocks if there is no replies (3 timeouts).
 
+   In MODBUS_RECEIVE_ADU mode, each read asks for every byte known to belong
+   to the frame (the whole ADU on TCP, up to the checksum on RTU) so the
+   message is usually received in one or two reads instead of three.
+
    The function shall return the number of received characters and the received
    message in an array of uint8_t if successful. Otherwise it shall return -1
    and errno is set to one of the values defined below:
@@ -404,9 +598,7 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
     fd_set rset;
     struct timeval tv;
     struct timeval *p_tv;
-    int length_to_read;
-    int msg_length = 0;
-    _step_t step;
+    modbus_parser_t parser;
 
     if (ctx->debug) {
         if (msg_type == MSG_INDICATION) {
@@ -422,11 +614,10 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
     FD_SET(ctx->s, &rset);
 #endif
 
-    /* We need to analyse the message step by step.  At the first step, we want
-     * to reach the function code because all packets contain this
-     * information. */
-    step = _STEP_FUNCTION;
-    length_to_read = ctx->backend->header_length + 1;
+    /* A message partially received by _modbus_receive_msg_poll() can't be
+       completed anymore */
+    ctx->parser.length_to_read = 0;
+    parser_init(ctx, &parser, msg_type);
 
     if (msg_type == MSG_INDICATION) {
         /* Wait for a message, we don't know when the message will be
@@ -438,8 +629,12 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
         p_tv = &tv;
     }
 
-    while (length_to_read != 0) {
-        rc = ctx->backend->select(ctx, &rset, p_tv, length_to_read);
+    do {
+        rc = ctx->backend->select(ctx, &rset, p_tv, parser.length_to_read);
+        if (rc == -1 && errno == ETIMEDOUT && parser.step == _STEP_SILENCE) {
+            /* The silence ends the frame */
+            break;
+        }
         if (rc == -1) {
             _error_print(ctx, "select");
             if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_LINK) {
@@ -458,7 +653,8 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
         }
 
         // TODO is this where the 500, 1500 ms delay is coming from?
-        rc = ctx->backend->recv(ctx, msg + msg_length, length_to_read);
+        rc = ctx->backend->recv(ctx, msg + parser.msg_length,
+                                parser.length_to_read);
 
         if (rc == 0) {
             errno = ECONNRESET;
@@ -483,41 +679,21 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
         if (ctx->debug) {
             int i;
             for (i=0; i < rc; i++)
-                printf("<%.2X>", msg[msg_length + i]);
-        }
-
-        /* Sums bytes received */
-        msg_length += rc;
-        /* Computes remaining bytes */
-        length_to_read -= rc;
-
-        if (length_to_read == 0) {
-            switch (step) {
-            case _STEP_FUNCTION:
-                /* Function code position */
-                length_to_read = compute_meta_length_after_function(
-                    msg[ctx->backend->header_length],
-                    msg_type);
-                if (length_to_read != 0) {
-                    step = _STEP_META;
-                    break;
-                } /*FALLTHROUGH */ /* else switches straight to the next step */
-            case _STEP_META:
-                length_to_read = compute_data_length_after_meta(
-                    ctx, msg, msg_type);
-                if ((msg_length + length_to_read) > (int)ctx->backend->max_adu_length) {
-                    errno = EMBBADDATA;
-                    _error_print(ctx, "too many data");
-                    return -1;
-                }
-                step = _STEP_DATA;
-                break;
-            default:
-                break;
-            }
+                printf("<%.2X>", msg[parser.msg_length + i]);
+        }
+
+        rc = parser_feed(ctx, &parser, msg, rc);
+        if (rc == -1) {
+            return -1;
         }
 
-        if (length_to_read > 0 &&
+        if (rc == _PARSER_NEED_MORE && parser.step == _STEP_SILENCE) {
+            unsigned long frame_delay = ctx->backend->frame_delay(ctx);
+
+            tv.tv_sec = frame_delay / 1000000;
+            tv.tv_usec = frame_delay % 1000000;
+            p_tv = &tv;
+        } else if (rc == _PARSER_NEED_MORE &&
             (ctx->byte_timeout.tv_sec > 0 || ctx->byte_timeout.tv_usec > 0)) {
             /* If there is no character in the buffer, the allowed timeout
                interval between two consecutive bytes is defined by
@@ -528,104 +704,362 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
         }
         /* else timeout isn't set again, the full response must be read before
            expiration of response timeout (for CONFIRMATION only) */
-    }
+    } while (rc == _PARSER_NEED_MORE);
 
     if (ctx->debug)
         printf("\n");
 
-    return ctx->backend->check_integrity(ctx, msg, msg_length);
+    return ctx->backend->check_integrity(ctx, msg, parser.msg_length);
 }
 
-/* Receive the request from a modbus master */
-int modbus_receive(modbus_t *ctx, uint8_t *req)
+/* Checks whether the byte timeout has elapsed since the last bytes of a
+   message partially received */
+static int parser_expired(modbus_t *ctx, const modbus_parser_t *parser)
 {
-    if (ctx == NULL) {
-        errno = EINVAL;
-        return -1;
+    if (parser->msg_length == 0 ||
+        (ctx->byte_timeout.tv_sec == 0 && ctx->byte_timeout.tv_usec == 0)) {
+        return FALSE;
     }
 
-    return ctx->backend->receive(ctx, req);
+    return _modbus_micros() - parser->last_recv_time >
+        _modbus_timeval_to_us(&ctx->byte_timeout);
 }
 
-/* Receives the confirmation.
-
-   The function shall store the read response in rsp and return the number of
-   values (bits or words). Otherwise, its shall return -1 and errno is set.
+/* Checks whether the frame of unknown length partially received is over: the
+   line was silent for the frame delay since its last bytes */
+static int parser_silent(modbus_t *ctx, const modbus_parser_t *parser)
+{
+    return _modbus_micros() - parser->last_recv_time >=
+        ctx->backend->frame_delay(ctx);
+}
 
-   The function doesn't check the confirmation is the expected response to the
-   initial request.
-*/
-int modbus_receive_confirmation(modbus_t *ctx, uint8_t *rsp)
+/* Restarts the parsing from the bytes received after a silence, when the
+   message they were taken to continue is invalid. The bytes which don't belong
+   to the new message are dropped. */
+static int parser_resume(modbus_t *ctx, modbus_parser_t *parser, uint8_t *msg)
 {
-    if (ctx == NULL) {
-        errno = EINVAL;
-        return -1;
+    int length = parser->msg_length - parser->resume_offset;
+    int rc = _PARSER_NEED_MORE;
+
+    if (ctx->debug) {
+        printf("Parsing resumed after a silence\n");
     }
 
-    return _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
+    memmove(msg, msg + parser->resume_offset, length);
+    parser_init(ctx, parser, parser->msg_type);
+
+    while (length > 0 && rc == _PARSER_NEED_MORE) {
+        int chunk = length < parser->length_to_read ?
+            length : parser->length_to_read;
+
+        rc = parser_feed(ctx, parser, msg, chunk);
+        length -= chunk;
+    }
+
+    return rc;
 }
 
-static int check_confirmation(modbus_t *ctx, uint8_t *req,
-                              uint8_t *rsp, int rsp_length)
+/* Receives the bytes of a message already available without waiting. The
+   parsing state is kept in ctx so the message is completed by the following
+   calls, msg must be the same buffer for all of them.
+
+   The function shall return the same values as _modbus_receive_msg() once the
+   message is complete. While it's incomplete, it shall return -1 and set errno
+   to EAGAIN. A message of which no byte has been received for byte_timeout
+   is dropped with ETIMEDOUT, or replaced by the message of the bytes received
+   after this silence.
+
+   The silence can only be measured when the previous call was made less than
+   byte_timeout ago. Otherwise the bytes available may have been received just
+   after the others: they are taken as the continuation of the message, and as
+   the beginning of a new one if this message turns out invalid.
+
+   A confirmation of unknown length (_STEP_SILENCE) is complete once no byte
+   has been received for the frame delay of the backend.
+*/
+int _modbus_receive_msg_poll(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
 {
+    modbus_parser_t *parser = &ctx->parser;
     int rc;
-    int rsp_length_computed;
-    const int offset = ctx->backend->header_length;
-    const int function = rsp[offset];
+    int length;
+    int observed;
+    unsigned long now;
+    fd_set rset;
+    struct timeval tv;
 
-    if (ctx->backend->pre_check_confirmation) {
-        rc = ctx->backend->pre_check_confirmation(ctx, req, rsp, rsp_length);
+    if (parser->length_to_read == 0) {
+        parser_init(ctx, parser, msg_type);
+    }
+
+    now = _modbus_micros();
+    observed = now - parser->last_poll_time <=
+        _modbus_timeval_to_us(&ctx->byte_timeout);
+    parser->last_poll_time = now;
+
+    for (;;) {
+#ifndef ARDUINO
+        FD_ZERO(&rset);
+        FD_SET(ctx->s, &rset);
+#endif
+        tv.tv_sec = 0;
+        tv.tv_usec = 0;
+        rc = ctx->backend->select(ctx, &rset, &tv, parser->length_to_read);
+        if (parser->step == _STEP_SILENCE &&
+            ((rc == -1 && errno == ETIMEDOUT) || observed) &&
+            parser_silent(ctx, parser)) {
+            /* The frame is over, the bytes available belong to the next
+               one */
+            if (ctx->debug)
+                printf("\n");
+            parser->length_to_read = 0;
+            return ctx->backend->check_integrity(ctx, msg, parser->msg_length);
+        }
         if (rc == -1) {
-            if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_PROTOCOL) {
-                _sleep_response_timeout(ctx);
-                modbus_flush(ctx);
+            if (errno == ETIMEDOUT && parser->step == _STEP_SILENCE) {
+                errno = EAGAIN;
+                return -1;
+            }
+            if (errno == ETIMEDOUT && !parser_expired(ctx, parser)) {
+                errno = EAGAIN;
+                return -1;
             }
+            if (errno == ETIMEDOUT && parser->resume_offset > 0 &&
+                parser_resume(ctx, parser, msg) == _PARSER_READY) {
+                return ctx->backend->check_integrity(ctx, msg,
+                                                     parser->msg_length);
+            }
+            parser->length_to_read = 0;
+            _error_print(ctx, "select");
             return -1;
         }
-    }
-
-    rsp_length_computed = compute_response_length_from_request(ctx, req);
-
-    /* Exception code */
-    if (function >= 0x80) {
-        if (rsp_length == (offset + 2 + (int)ctx->backend->checksum_length) &&
-            req[offset] == (rsp[offset] - 0x80)) {
-            /* Valid exception code received */
 
-            int exception_code = rsp[offset + 1];
-            if (exception_code < MODBUS_EXCEPTION_MAX) {
-                errno = MODBUS_ENOBASE + exception_code;
-            } else {
-                errno = EMBBADEXC;
+        if (parser->step != _STEP_SILENCE && parser_expired(ctx, parser)) {
+            if (observed) {
+                /* The line was silent since the last bytes, they were the
+                   beginning of a message never completed */
+                if (ctx->debug)
+                    printf("\n");
+                parser_init(ctx, parser, msg_type);
+            } else if (parser->resume_offset == 0) {
+                parser->resume_offset = parser->msg_length;
             }
-            _error_print(ctx, NULL);
-            return -1;
-        } else {
-            errno = EMBBADEXC;
-            _error_print(ctx, NULL);
-            return -1;
         }
-    }
 
-    /* Check length */
-    if ((rsp_length == rsp_length_computed ||
-         rsp_length_computed == MSG_LENGTH_UNDEFINED) &&
-        function < 0x80) {
-        int req_nb_value;
-        int rsp_nb_value;
+        length = parser->length_to_read;
+#ifdef ARDUINO
+        /* The backends return the number of bytes available, the streams
+           wait for the others */
+        if (rc < length) {
+            length = rc;
+        }
+#endif
 
-        /* Check function code */
-        if (function != req[offset]) {
-            if (ctx->debug) {
-                fprintf(stderr,
-                        "Received function not corresponding to the request (0x%X != 0x%X)\n",
-                        function, req[offset]);
-            }
-            if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_PROTOCOL) {
-                _sleep_response_timeout(ctx);
-                modbus_flush(ctx);
+        rc = ctx->backend->recv(ctx, msg + parser->msg_length, length);
+
+        if (rc == 0) {
+            errno = ECONNRESET;
+            rc = -1;
+        }
+
+        if (rc == -1) {
+            parser->length_to_read = 0;
+            _error_print(ctx, "read");
+            if ((ctx->error_recovery & MODBUS_ERROR_RECOVERY_LINK) &&
+                (errno == ECONNRESET || errno == ECONNREFUSED ||
+                 errno == EBADF)) {
+                int saved_errno = errno;
+                modbus_close(ctx);
+                modbus_connect(ctx);
+                /* Could be removed by previous calls */
+                errno = saved_errno;
             }
-            errno = EMBBADDATA;
+            return -1;
+        }
+
+        /* Display the hex code of each character received */
+        if (ctx->debug) {
+            int i;
+            for (i=0; i < rc; i++)
+                printf("<%.2X>", msg[parser->msg_length + i]);
+        }
+
+        parser->last_recv_time = _modbus_micros();
+        rc = parser_feed(ctx, parser, msg, rc);
+        while (rc != _PARSER_NEED_MORE) {
+            if (rc == _PARSER_READY) {
+                if (ctx->debug)
+                    printf("\n");
+
+                rc = ctx->backend->check_integrity(ctx, msg,
+                                                   parser->msg_length);
+                if (rc != -1) {
+                    return rc;
+                }
+            }
+
+            if (parser->resume_offset == 0) {
+                parser->length_to_read = 0;
+                return -1;
+            }
+            rc = parser_resume(ctx, parser, msg);
+        }
+    }
+}
+
+/* Receive the request from a modbus master */
+int modbus_receive(modbus_t *ctx, uint8_t *req)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ctx->backend->receive(ctx, req);
+}
+
+/* Receive the bytes of a request already available, without waiting */
+int modbus_receive_poll(modbus_t *ctx, uint8_t *req)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ctx->backend->receive_poll(ctx, req);
+}
+
+/* Allocates an idle parser, to receive the requests of several connections
+   with one context */
+modbus_parser_t* modbus_parser_new(void)
+{
+    modbus_parser_t *parser;
+
+    parser = (modbus_parser_t *)malloc(sizeof(modbus_parser_t));
+    if (parser == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    memset(parser, 0, sizeof(modbus_parser_t));
+
+    return parser;
+}
+
+void modbus_parser_free(modbus_parser_t *parser)
+{
+    free(parser);
+}
+
+/* Exchanges the parsing state of ctx with parser. A server switching between
+   connections swaps in the parser of the connection before
+   modbus_receive_poll() and swaps it out after, each connection then
+   completes its own requests in its own buffer. */
+int modbus_swap_parser(modbus_t *ctx, modbus_parser_t *parser)
+{
+    modbus_parser_t tmp;
+
+    if (ctx == NULL || parser == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    tmp = ctx->parser;
+    ctx->parser = *parser;
+    *parser = tmp;
+
+    return 0;
+}
+
+/* Receives the confirmation.
+
+   The function shall store the read response in rsp and return the number of
+   values (bits or words). Otherwise, its shall return -1 and errno is set.
+
+   The function doesn't check the confirmation is the expected response to the
+   initial request.
+*/
+int modbus_receive_confirmation(modbus_t *ctx, uint8_t *rsp)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
+}
+
+/* Drops the rest of an invalid confirmation in protocol recovery mode. The
+   end of the confirmation is awaited for response_timeout when blocking,
+   otherwise only the bytes already received are flushed (polling). */
+static void recover_confirmation(modbus_t *ctx, int blocking)
+{
+    if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_PROTOCOL) {
+        if (blocking) {
+            _sleep_response_timeout(ctx);
+            modbus_flush(ctx);
+        } else {
+            /* The other transactions in flight are kept */
+            ctx->parser.length_to_read = 0;
+            ctx->backend->flush(ctx);
+        }
+    }
+}
+
+static int check_confirmation(modbus_t *ctx, uint8_t *req,
+                              uint8_t *rsp, int rsp_length, int blocking)
+{
+    int rc;
+    int rsp_length_computed;
+    const int offset = ctx->backend->header_length;
+    const int function = rsp[offset];
+
+    if (ctx->backend->pre_check_confirmation) {
+        rc = ctx->backend->pre_check_confirmation(ctx, req, rsp, rsp_length);
+        if (rc == -1) {
+            recover_confirmation(ctx, blocking);
+            return -1;
+        }
+    }
+
+    rsp_length_computed = compute_response_length_from_request(ctx, req);
+
+    /* Exception code */
+    if (function >= 0x80) {
+        if (rsp_length == (offset + 2 + (int)ctx->backend->checksum_length) &&
+            req[offset] == (rsp[offset] - 0x80)) {
+            /* Valid exception code received */
+
+            int exception_code = rsp[offset + 1];
+            if (exception_code < MODBUS_EXCEPTION_MAX) {
+                errno = MODBUS_ENOBASE + exception_code;
+            } else {
+                errno = EMBBADEXC;
+            }
+            _error_print(ctx, NULL);
+            return -1;
+        } else {
+            errno = EMBBADEXC;
+            _error_print(ctx, NULL);
+            return -1;
+        }
+    }
+
+    /* Check length */
+    if ((rsp_length == rsp_length_computed ||
+         rsp_length_computed == MSG_LENGTH_UNDEFINED) &&
+        function < 0x80) {
+        int req_nb_value;
+        int rsp_nb_value;
+
+        /* Check function code */
+        if (function != req[offset]) {
+            if (ctx->debug) {
+                fprintf(stderr,
+                        "Received function not corresponding to the request (0x%X != 0x%X)\n",
+                        function, req[offset]);
+            }
+            recover_confirmation(ctx, blocking);
+            errno = EMBBADDATA;
             return -1;
         }
 
@@ -671,10 +1105,7 @@ static int check_confirmation(modbus_t *ctx, uint8_t *req,
                         rsp_nb_value, req_nb_value);
             }
 
-            if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_PROTOCOL) {
-                _sleep_response_timeout(ctx);
-                modbus_flush(ctx);
-            }
+            recover_confirmation(ctx, blocking);
 
             errno = EMBBADDATA;
             rc = -1;
@@ -685,10 +1116,7 @@ static int check_confirmation(modbus_t *ctx, uint8_t *req,
                     "Message length not corresponding to the computed length (%d != %d)\n",
                     rsp_length, rsp_length_computed);
         }
-        if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_PROTOCOL) {
-            _sleep_response_timeout(ctx);
-            modbus_flush(ctx);
-        }
+        recover_confirmation(ctx, blocking);
         errno = EMBBADDATA;
         rc = -1;
     }
@@ -696,6 +1124,34 @@ static int check_confirmation(modbus_t *ctx, uint8_t *req,
     return rc;
 }
 
+/* Checks the confirmation of a raw transaction is the one of the slave and
+   function requested, it's relayed as is (exception responses included).
+   Returns the length of the confirmation. */
+static int check_raw_confirmation(modbus_t *ctx, uint8_t *req,
+                                  uint8_t *rsp, int rsp_length, int blocking)
+{
+    const int offset = ctx->backend->header_length;
+
+    if (ctx->backend->pre_check_confirmation &&
+        ctx->backend->pre_check_confirmation(ctx, req, rsp, rsp_length) == -1) {
+        recover_confirmation(ctx, blocking);
+        return -1;
+    }
+
+    if (rsp[offset] != req[offset] && rsp[offset] != (req[offset] | 0x80)) {
+        if (ctx->debug) {
+            fprintf(stderr,
+                    "Received function not corresponding to the request (0x%X != 0x%X)\n",
+                    rsp[offset], req[offset]);
+        }
+        recover_confirmation(ctx, blocking);
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    return rsp_length;
+}
+
 static int response_io_status(uint8_t *tab_io_status,
                               int address, int nb,
                               uint8_t *rsp, int offset)
@@ -724,6 +1180,7 @@ static int response_io_status(uint8_t *tab_io_status,
 
 /* Build the exception response */
 static int response_exception(modbus_t *ctx, sft_t *sft,
+                              const uint8_t *req, int req_length,
                               int exception_code, uint8_t *rsp,
                               unsigned int to_flush,
                               const char* template, ...)
@@ -731,7 +1188,7 @@ static int response_exception(modbus_t *ctx, sft_t *sft,
     int rsp_length;
 
     /* Print debug message */
-    if (ctx->debug) {
+    if (ctx->debug && template != NULL) {
         va_list ap;
 
         va_start(ap, template);
@@ -741,8 +1198,16 @@ static int response_exception(modbus_t *ctx, sft_t *sft,
 
     /* Flush if required */
     if (to_flush) {
-        _sleep_response_timeout(ctx);
-        modbus_flush(ctx);
+        if (ctx->exception_recovery == MODBUS_EXCEPTION_RECOVERY_DISCARD) {
+            int rc = ctx->backend->discard(ctx, req, req_length);
+
+            if (rc > 0 && ctx->debug) {
+                printf("Bytes discarded (%d)\n", rc);
+            }
+        } else {
+            _sleep_response_timeout(ctx);
+            modbus_flush(ctx);
+        }
     }
 
     /* Build exception response */
@@ -777,364 +1242,1061 @@ int modbus_set_callbacks(modbus_t *ctx, callback_mapping_t *callbacks)
     return 0;
 }
 
-
-/* Send a response to the received request.
-   Analyses the request and constructs a response.
-
-   If an error occurs, this function construct the response
-   accordingly.
-*/
-int modbus_reply(modbus_t *ctx, const uint8_t *req,
-                 int req_length, modbus_mapping_t *mb_mapping)
+/* The callback is called between two polls of the line by the backends
+   which have to spin while waiting (Arduino streams), NULL to spin without
+   pause */
+int modbus_set_idle_callback(modbus_t *ctx, modbus_idle_cb_t idle_cb)
 {
-    int offset;
-    int slave;
-    int function;
-    uint16_t address;
-    uint8_t rsp[MAX_MESSAGE_LENGTH];
-    int rsp_length = 0;
-    sft_t sft;
-
     if (ctx == NULL) {
         errno = EINVAL;
         return -1;
     }
 
-    offset = ctx->backend->header_length;
-    slave = req[offset - 1];
-    function = req[offset];
-    address = (req[offset + 1] << 8) + req[offset + 2];
+    ctx->idle_cb = idle_cb;
 
-    sft.slave = slave;
-    sft.function = function;
-    sft.t_id = ctx->backend->prepare_response_tid(req, &req_length);
+    return 0;
+}
 
-    if (ctx->callbacks.event_cb != NULL) {
-        ctx->callbacks.event_cb(slave, function, address);
+/* Lets the rest of the firmware run while waiting. On Mbed OS, the thread
+   sleeps for a tick when the wait is long enough so the threads of lower
+   priority run too, a yield only gives the CPU to the ones of same
+   priority. */
+void modbus_idle_default(modbus_t *ctx, unsigned long remaining_us)
+{
+    (void)ctx;
+#if defined(ARDUINO_ARCH_MBED)
+    if (remaining_us >= 2000) {
+        osDelay(1);
+    } else {
+        osThreadYield();
     }
+#elif defined(ARDUINO)
+    (void)remaining_us;
+    yield();
+#else
+    (void)remaining_us;
+#endif
+}
 
-    if (slave != ctx->slave) {
-        return 0;
+void _modbus_idle(modbus_t *ctx, unsigned long remaining_us)
+{
+    if (ctx->idle_cb != NULL) {
+        ctx->idle_cb(ctx, remaining_us);
     }
+}
 
-    /* Data are flushed on illegal number of values errors. */
-    switch (function) {
-    case MODBUS_FC_READ_COILS:
-    case MODBUS_FC_READ_DISCRETE_INPUTS: {
-        unsigned int is_input = (function == MODBUS_FC_READ_DISCRETE_INPUTS);
-        int start_bits = is_input ? mb_mapping->start_input_bits : mb_mapping->start_bits;
-        int nb_bits = is_input ? mb_mapping->nb_input_bits : mb_mapping->nb_bits;
-        uint8_t *tab_bits = is_input ? mb_mapping->tab_input_bits : mb_mapping->tab_bits;
-        const char * const name = is_input ? "read_input_bits" : "read_bits";
-        int nb = (req[offset + 3] << 8) + req[offset + 4];
-        /* The mapping can be shifted to reduce memory consumption and it
-           doesn't always start at address zero. */
-        int mapping_address = address - start_bits;
-
-        if (nb < 1 || MODBUS_MAX_READ_BITS < nb) {
-            rsp_length = response_exception(
-                ctx, &sft, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp, TRUE,
-                "Illegal nb of values %d in %s (max %d)\n",
-                nb, name, MODBUS_MAX_READ_BITS);
-        } else if (mapping_address < 0 || (mapping_address + nb) > nb_bits) {
-            rsp_length = response_exception(
-                ctx, &sft,
-                MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
-                "Illegal data address 0x%0X in %s\n",
-                mapping_address < 0 ? address : address + nb, name);
-        } else {
-            rsp_length = ctx->backend->build_response_basis(&sft, rsp);
 
-            if (function == MODBUS_FC_READ_COILS && ctx->callbacks.read_coils_cb != NULL) {
-                int rv = ctx->callbacks.read_coils_cb(&rsp, rsp_length, address, nb);
-                rsp_length += rv;
-            } else {
-                rsp[rsp_length++] = (nb / 8) + ((nb % 8) ? 1 : 0);
-                rsp_length = response_io_status(tab_bits, mapping_address, nb,
-                                                rsp, rsp_length);
-            }
+/* Accessors of the mapping tables. An address range can span the main block
+   and several segments, as long as they are contiguous. The untouched pages
+   of a paged table (NULL storage) read as zero. */
 
-            if (ctx->callbacks.happened_cb != NULL) {
-                ctx->callbacks.happened_cb(slave, function, address, nb);
-            }
-        }
-    }
-        break;
-    case MODBUS_FC_READ_HOLDING_REGISTERS:
-    case MODBUS_FC_READ_INPUT_REGISTERS: {
-        unsigned int is_input = (function == MODBUS_FC_READ_INPUT_REGISTERS);
-        int start_registers = is_input ? mb_mapping->start_input_registers : mb_mapping->start_registers;
-        int nb_registers = is_input ? mb_mapping->nb_input_registers : mb_mapping->nb_registers;
-        uint16_t *tab_registers = is_input ? mb_mapping->tab_input_registers : mb_mapping->tab_registers;
-        const char * const name = is_input ? "read_input_registers" : "read_registers";
-        int nb = (req[offset + 3] << 8) + req[offset + 4];
-        /* The mapping can be shifted to reduce memory consumption and it
-           doesn't always start at address zero. */
-        int mapping_address = address - start_registers;
-
-        if (nb < 1 || MODBUS_MAX_READ_REGISTERS < nb) {
-            rsp_length = response_exception(
-                ctx, &sft, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp, TRUE,
-                "Illegal nb of values %d in %s (max %d)\n",
-                nb, name, MODBUS_MAX_READ_REGISTERS);
-        } else if (mapping_address < 0 || (mapping_address + nb) > nb_registers) {
-            rsp_length = response_exception(
-                ctx, &sft, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
-                "Illegal data address 0x%0X in %s\n",
-                mapping_address < 0 ? address : address + nb, name);
-        } else {
-            int i;
+/* Returns TRUE when the nb addresses from address are all mapped. Untouched
+   pages aren't readable with MODBUS_MAPPING_STRICT_PAGES. */
+static int mapping_is_mapped(const modbus_mapping_t *mb_mapping,
+                             modbus_table_t table, int address, int nb,
+                             int reading)
+{
+    void *tab;
+    int index;
 
-            rsp_length = ctx->backend->build_response_basis(&sft, rsp);
-            if (function == MODBUS_FC_READ_HOLDING_REGISTERS && ctx->callbacks.read_holding_registers_cb != NULL) {
-                int rv = ctx->callbacks.read_holding_registers_cb(&rsp, rsp_length, address, nb, tab_registers, mapping_address);
-                rsp_length += rv;
-            } else {
-                rsp[rsp_length++] = nb << 1;
-                for (i = mapping_address; i < mapping_address + nb; i++) {
-                    rsp[rsp_length++] = tab_registers[i] >> 8;
-                    rsp[rsp_length++] = tab_registers[i] & 0xFF;
-                }
-            }
+    while (nb > 0) {
+        int n = modbus_mapping_locate(mb_mapping, table, address, &tab, &index);
 
-            if (ctx->callbacks.happened_cb != NULL) {
-                ctx->callbacks.happened_cb(slave, function, address, nb);
-            }
+        if (n == 0) {
+            return FALSE;
+        }
+        if (tab == NULL && reading &&
+            (mb_mapping->flags & MODBUS_MAPPING_STRICT_PAGES)) {
+            return FALSE;
         }
+        address += n;
+        nb -= n;
     }
-        break;
-    case MODBUS_FC_WRITE_SINGLE_COIL: {
-        int mapping_address = address - mb_mapping->start_bits;
-
-        if (mapping_address < 0 || mapping_address >= mb_mapping->nb_bits) {
-            rsp_length = response_exception(
-                ctx, &sft, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
-                "Illegal data address 0x%0X in write_bit\n",
-                address);
-        } else {
-            int data = (req[offset + 3] << 8) + req[offset + 4];
 
-#if defined(ARDUINO) && defined(__AVR__)
-            if (data == (int)0xFF00 || data == 0x0) {
-#else
-            if (data == 0xFF00 || data == 0x0) {
-#endif
-
-                mb_mapping->tab_bits[mapping_address] = data ? 1 : 0; // TODO do we save this?
+    return TRUE;
+}
 
-                if (ctx->callbacks.write_single_coil_cb != NULL) {
-                    ctx->callbacks.write_single_coil_cb(address, data);
-                }
+static int mapping_is_packed(const modbus_mapping_t *mb_mapping,
+                             modbus_table_t table)
+{
+    return mb_mapping->flags & (table == MODBUS_TABLE_BITS ?
+                                MODBUS_MAPPING_PACKED_BITS :
+                                MODBUS_MAPPING_PACKED_INPUT_BITS);
+}
 
-                memcpy(rsp, req, req_length);
-                rsp_length = req_length;
+static int mapping_is_wire_order(const modbus_mapping_t *mb_mapping,
+                                 modbus_table_t table)
+{
+    return mb_mapping->flags & (table == MODBUS_TABLE_REGISTERS ?
+                                MODBUS_MAPPING_WIRE_ORDER_REGISTERS :
+                                MODBUS_MAPPING_WIRE_ORDER_INPUT_REGISTERS);
+}
 
-                if (ctx->callbacks.happened_cb != NULL) {
-                    ctx->callbacks.happened_cb(slave, function, address, data);
-                }
-            } else {
-                rsp_length = response_exception(
-                    ctx, &sft,
-                    MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp, FALSE,
-                    "Illegal data value 0x%0X in write_bit request at address %0X\n",
-                    data, address);
-            }
-        }
+/* Allocates the pages of nb addresses from address and starts their update
+   (see modbus_mapping_write_begin()). On failure, no update is started and
+   errno is set to EMBXSFAIL. */
+static int mapping_write_begin(modbus_mapping_t *mb_mapping,
+                               modbus_table_t table, int address, int nb)
+{
+    if (modbus_mapping_touch(mb_mapping, table, address, nb) == -1) {
+        errno = EMBXSFAIL;
+        return -1;
     }
-        break;
-    case MODBUS_FC_WRITE_SINGLE_REGISTER: {
-        int mapping_address = address - mb_mapping->start_registers;
+    modbus_mapping_write_begin(mb_mapping, table);
 
-        if (mapping_address < 0 || mapping_address >= mb_mapping->nb_registers) {
-            rsp_length = response_exception(
-                ctx, &sft,
-                MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
-                "Illegal data address 0x%0X in write_register\n",
-                address);
-        } else {
-            int data = (req[offset + 3] << 8) + req[offset + 4];
+    return 0;
+}
 
-            if (ctx->callbacks.write_single_register_cb != NULL) {
-                ctx->callbacks.write_single_register_cb(&rsp, rsp_length, address, data, mb_mapping->tab_registers, mapping_address);
-            } else {
-                mb_mapping->tab_registers[mapping_address] = data;
-                memcpy(rsp, req, req_length);
-            }
+/* Packs nb mapped bits into dest (LSB first) */
+static void mapping_get_bits(const modbus_mapping_t *mb_mapping,
+                             modbus_table_t table, int address, int nb,
+                             uint8_t *dest)
+{
+    int packed = mapping_is_packed(mb_mapping, table);
+    uint8_t *tab;
+    int index;
+    int done;
+    int n;
+    int i;
 
-            rsp_length = req_length;
+    n = modbus_mapping_locate(mb_mapping, table, address, (void **)&tab, &index);
+    if (n >= nb) {
+        if (tab == NULL) {
+            memset(dest, 0, (nb + 7) / 8);
+        } else if (packed) {
+            modbus_get_packed_bits(tab, index, nb, dest);
+        } else {
+            response_io_status(tab, index, nb, dest, 0);
+        }
+        return;
+    }
 
-            if (ctx->callbacks.happened_cb != NULL) {
-                ctx->callbacks.happened_cb(slave, function, address, data);
+    /* Bit by bit across the blocks */
+    memset(dest, 0, (nb + 7) / 8);
+    for (done = 0; done < nb; done += n) {
+        n = modbus_mapping_locate(mb_mapping, table, address + done,
+                                  (void **)&tab, &index);
+        if (n > nb - done) {
+            n = nb - done;
+        }
+        for (i = 0; tab != NULL && i < n; i++) {
+            if (packed ? MODBUS_GET_PACKED_BIT(tab, index + i) : tab[index + i]) {
+                MODBUS_SET_PACKED_BIT(dest, done + i, 1);
             }
         }
     }
-        break;
-    case MODBUS_FC_WRITE_MULTIPLE_COILS: {
-        int nb = (req[offset + 3] << 8) + req[offset + 4];
-        int nb_bits = req[offset + 5];
-        int mapping_address = address - mb_mapping->start_bits;
-
-        if (nb < 1 || MODBUS_MAX_WRITE_BITS < nb || nb_bits * 8 < nb) {
-            /* May be the indication has been truncated on reading because of
-             * invalid address (eg. nb is 0 but the request contains values to
-             * write) so it's necessary to flush. */
-            rsp_length = response_exception(
-                ctx, &sft, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp, TRUE,
-                "Illegal number of values %d in write_bits (max %d)\n",
-                nb, MODBUS_MAX_WRITE_BITS);
-        } else if (mapping_address < 0 ||
-                   (mapping_address + nb) > mb_mapping->nb_bits) {
-            rsp_length = response_exception(
-                ctx, &sft,
-                MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
-                "Illegal data address 0x%0X in write_bits\n",
-                mapping_address < 0 ? address : address + nb);
+}
+
+/* Unpacks nb bits of src (LSB first) to the mapped bits */
+static void mapping_set_bits(modbus_mapping_t *mb_mapping,
+                             modbus_table_t table, int address, int nb,
+                             const uint8_t *src)
+{
+    int packed = mapping_is_packed(mb_mapping, table);
+    uint8_t *tab;
+    int index;
+    int done;
+    int n;
+    int i;
+
+    n = modbus_mapping_locate(mb_mapping, table, address, (void **)&tab, &index);
+    if (n >= nb) {
+        if (packed) {
+            modbus_set_packed_bits(tab, index, nb, src);
         } else {
-            /* 6 = byte count */
-            modbus_set_bits_from_bytes(mb_mapping->tab_bits, mapping_address, nb,
-                                       &req[offset + 6]);
+            modbus_set_bits_from_bytes(tab, index, nb, src);
+        }
+        return;
+    }
+
+    for (done = 0; done < nb; done += n) {
+        n = modbus_mapping_locate(mb_mapping, table, address + done,
+                                  (void **)&tab, &index);
+        if (n > nb - done) {
+            n = nb - done;
+        }
+        for (i = 0; i < n; i++) {
+            int value = MODBUS_GET_PACKED_BIT(src, done + i);
 
-            rsp_length = ctx->backend->build_response_basis(&sft, rsp);
-            /* 4 to copy the bit address (2) and the quantity of bits */
-            memcpy(rsp + rsp_length, req + rsp_length, 4);
-            rsp_length += 4;
+            if (packed) {
+                MODBUS_SET_PACKED_BIT(tab, index + i, value);
+            } else {
+                tab[index + i] = value;
+            }
         }
     }
-        break;
-    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS: {
-        int nb = (req[offset + 3] << 8) + req[offset + 4];
-        int nb_bytes = req[offset + 5];
-        int mapping_address = address - mb_mapping->start_registers;
+}
 
-        if (nb < 1 || MODBUS_MAX_WRITE_REGISTERS < nb || nb_bytes * 8 < nb) {
-            rsp_length = response_exception(
-                ctx, &sft, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp, TRUE,
-                "Illegal number of values %d in write_registers (max %d)\n",
-                nb, MODBUS_MAX_WRITE_REGISTERS);
-        } else if (mapping_address < 0 ||
-                   (mapping_address + nb) > mb_mapping->nb_registers) {
-            rsp_length = response_exception(
-                ctx, &sft, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
-                "Illegal data address 0x%0X in write_registers\n",
-                mapping_address < 0 ? address : address + nb);
+/* Copies nb mapped registers to dest in network byte order */
+static void mapping_get_registers(const modbus_mapping_t *mb_mapping,
+                                  modbus_table_t table, int address, int nb,
+                                  uint8_t *dest)
+{
+    int wire_order = mapping_is_wire_order(mb_mapping, table);
+    uint16_t *tab;
+    int index;
+    int done;
+    int n;
+    int i;
+
+    for (done = 0; done < nb; done += n) {
+        n = modbus_mapping_locate(mb_mapping, table, address + done,
+                                  (void **)&tab, &index);
+        if (n > nb - done) {
+            n = nb - done;
+        }
+        if (tab == NULL) {
+            memset(dest, 0, n * 2);
+            dest += n * 2;
+            continue;
+        }
+        if (wire_order) {
+            memcpy(dest, &tab[index], n * 2);
+            dest += n * 2;
+            continue;
+        }
+        for (i = index; i < index + n; i++) {
+            *dest++ = tab[i] >> 8;
+            *dest++ = tab[i] & 0xFF;
+        }
+    }
+}
+
+/* Copies nb mapped registers to dest as they are stored, without allocating
+   the untouched pages (they read as zero) */
+static void mapping_copy_registers(const modbus_mapping_t *mb_mapping,
+                                   modbus_table_t table, int address, int nb,
+                                   uint16_t *dest)
+{
+    uint16_t *tab;
+    int index;
+    int done;
+    int n;
+
+    for (done = 0; done < nb; done += n) {
+        n = modbus_mapping_locate(mb_mapping, table, address + done,
+                                  (void **)&tab, &index);
+        if (n > nb - done) {
+            n = nb - done;
+        }
+        if (tab == NULL) {
+            memset(dest + done, 0, n * sizeof(uint16_t));
         } else {
-            int i, j;
-            for (i = mapping_address, j = 6; i < mapping_address + nb; i++, j += 2) {
-                /* 6 and 7 = first value */
-                mb_mapping->tab_registers[i] =
-                    (req[offset + j] << 8) + req[offset + j + 1];
+            memcpy(dest + done, &tab[index], n * sizeof(uint16_t));
+        }
+    }
+}
+
+/* Copies nb registers from src in network byte order to the mapping */
+static void mapping_set_registers(modbus_mapping_t *mb_mapping,
+                                  modbus_table_t table, int address, int nb,
+                                  const uint8_t *src)
+{
+    int wire_order = mapping_is_wire_order(mb_mapping, table);
+    uint16_t *tab;
+    int index;
+    int done;
+    int n;
+    int i;
+
+    for (done = 0; done < nb; done += n) {
+        n = modbus_mapping_locate(mb_mapping, table, address + done,
+                                  (void **)&tab, &index);
+        if (n > nb - done) {
+            n = nb - done;
+        }
+        if (wire_order) {
+            memcpy(&tab[index], src, n * 2);
+            src += n * 2;
+            continue;
+        }
+        for (i = index; i < index + n; i++, src += 2) {
+            tab[i] = (src[0] << 8) + src[1];
+        }
+    }
+}
+
+/* Writes a holding register in its own update. On failure, errno is set to
+   EMBXSFAIL. */
+static int mapping_set_register(modbus_mapping_t *mb_mapping, int address,
+                                uint16_t value)
+{
+    uint16_t *tab;
+    int index;
+
+    if (mapping_write_begin(mb_mapping, MODBUS_TABLE_REGISTERS, address, 1) == -1) {
+        return -1;
+    }
+    modbus_mapping_locate(mb_mapping, MODBUS_TABLE_REGISTERS, address,
+                          (void **)&tab, &index);
+    if (mapping_is_wire_order(mb_mapping, MODBUS_TABLE_REGISTERS)) {
+        MODBUS_SET_WIRE_REGISTER(tab, index, value);
+    } else {
+        tab[index] = value;
+    }
+    modbus_mapping_write_end(mb_mapping, MODBUS_TABLE_REGISTERS);
+
+    return 0;
+}
+
+/* Reply handlers of the built-in function codes (see modbus_reply_cb_t).
+   The data are flushed on illegal number of values errors only, the other
+   indications have been received whole */
+
+static int reply_read_bits(modbus_t *ctx, const uint8_t *req, int req_length,
+                           modbus_mapping_t *mb_mapping,
+                           uint8_t *rsp, int rsp_length)
+{
+    const int offset = ctx->backend->header_length;
+    int function = req[offset];
+    uint16_t address = (req[offset + 1] << 8) + req[offset + 2];
+    unsigned int is_input = (function == MODBUS_FC_READ_DISCRETE_INPUTS);
+    modbus_table_t table = is_input ? MODBUS_TABLE_INPUT_BITS : MODBUS_TABLE_BITS;
+    const char * const name = is_input ? "read_input_bits" : "read_bits";
+    int nb = (req[offset + 3] << 8) + req[offset + 4];
+    unsigned int sequence;
+
+    (void)req_length;
+    (void)name;
+
+    if (nb < 1 || MODBUS_MAX_READ_BITS < nb) {
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal nb of values %d in %s (max %d)\n",
+                    nb, name, MODBUS_MAX_READ_BITS);
+        }
+        errno = EMBXILVAL;
+        return MODBUS_REPLY_TRUNCATED;
+    }
+
+    /* The mapping can be shifted to reduce memory consumption and it
+       doesn't always start at address zero. */
+    if (!mapping_is_mapped(mb_mapping, table, address, nb, TRUE)) {
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal data address 0x%0X in %s\n",
+                    address, name);
+        }
+        errno = EMBXILADD;
+        return -1;
+    }
+
+    if (function == MODBUS_FC_READ_COILS && ctx->callbacks.read_coils_cb != NULL) {
+        int rv = ctx->callbacks.read_coils_cb(rsp, rsp_length, address, nb);
+        rsp_length += rv;
+    } else {
+        int nb_bytes = (nb / 8) + ((nb % 8) ? 1 : 0);
+
+        rsp[rsp_length++] = nb_bytes;
+        do {
+            sequence = modbus_mapping_read_begin(mb_mapping, table);
+            mapping_get_bits(mb_mapping, table, address, nb, rsp + rsp_length);
+        } while (modbus_mapping_read_retry(mb_mapping, table, sequence));
+        rsp_length += nb_bytes;
+    }
+
+    if (ctx->callbacks.happened_cb != NULL) {
+        ctx->callbacks.happened_cb(ctx->slave, function, address, nb);
+    }
+
+    return rsp_length;
+}
+
+static int reply_read_registers(modbus_t *ctx, const uint8_t *req, int req_length,
+                                modbus_mapping_t *mb_mapping,
+                                uint8_t *rsp, int rsp_length)
+{
+    const int offset = ctx->backend->header_length;
+    int function = req[offset];
+    uint16_t address = (req[offset + 1] << 8) + req[offset + 2];
+    unsigned int is_input = (function == MODBUS_FC_READ_INPUT_REGISTERS);
+    modbus_table_t table = is_input ? MODBUS_TABLE_INPUT_REGISTERS : MODBUS_TABLE_REGISTERS;
+    const char * const name = is_input ? "read_input_registers" : "read_registers";
+    int nb = (req[offset + 3] << 8) + req[offset + 4];
+    unsigned int sequence;
+
+    (void)req_length;
+    (void)name;
+
+    if (nb < 1 || MODBUS_MAX_READ_REGISTERS < nb) {
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal nb of values %d in %s (max %d)\n",
+                    nb, name, MODBUS_MAX_READ_REGISTERS);
+        }
+        errno = EMBXILVAL;
+        return MODBUS_REPLY_TRUNCATED;
+    }
+
+    if (!mapping_is_mapped(mb_mapping, table, address, nb, TRUE)) {
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal data address 0x%0X in %s\n",
+                    address, name);
+        }
+        errno = EMBXILADD;
+        return -1;
+    }
+
+    if (function == MODBUS_FC_READ_HOLDING_REGISTERS && ctx->callbacks.read_holding_registers_cb != NULL) {
+        uint16_t tab_registers[MODBUS_MAX_READ_REGISTERS];
+        int rv;
+        int i;
+
+        /* The callback is given a copy of the registers in host byte order:
+           the range can span several blocks and reading doesn't allocate the
+           untouched pages */
+        do {
+            sequence = modbus_mapping_read_begin(mb_mapping, table);
+            mapping_copy_registers(mb_mapping, table, address, nb, tab_registers);
+        } while (modbus_mapping_read_retry(mb_mapping, table, sequence));
+        if (mapping_is_wire_order(mb_mapping, table)) {
+            for (i = 0; i < nb; i++) {
+                tab_registers[i] = MODBUS_GET_WIRE_REGISTER(tab_registers, i);
             }
+        }
+        rv = ctx->callbacks.read_holding_registers_cb(rsp, rsp_length, address, nb, tab_registers, 0);
+        rsp_length += rv;
+    } else {
+        rsp[rsp_length++] = nb << 1;
+        do {
+            sequence = modbus_mapping_read_begin(mb_mapping, table);
+            mapping_get_registers(mb_mapping, table, address, nb, rsp + rsp_length);
+        } while (modbus_mapping_read_retry(mb_mapping, table, sequence));
+        rsp_length += nb << 1;
+    }
+
+    if (ctx->callbacks.happened_cb != NULL) {
+        ctx->callbacks.happened_cb(ctx->slave, function, address, nb);
+    }
+
+    return rsp_length;
+}
+
+static int reply_write_bit(modbus_t *ctx, const uint8_t *req, int req_length,
+                           modbus_mapping_t *mb_mapping,
+                           uint8_t *rsp, int rsp_length)
+{
+    const int offset = ctx->backend->header_length;
+    int function = req[offset];
+    uint16_t address = (req[offset + 1] << 8) + req[offset + 2];
+    int data = (req[offset + 3] << 8) + req[offset + 4];
+    uint8_t *tab_bits;
+    int mapping_address;
+
+    (void)rsp_length;
 
-            rsp_length = ctx->backend->build_response_basis(&sft, rsp);
-            /* 4 to copy the address (2) and the no. of registers */
-            memcpy(rsp + rsp_length, req + rsp_length, 4);
-            rsp_length += 4;
+    if (!mapping_is_mapped(mb_mapping, MODBUS_TABLE_BITS, address, 1, FALSE)) {
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal data address 0x%0X in write_bit\n",
+                    address);
         }
+        errno = EMBXILADD;
+        return -1;
     }
-        break;
-    case MODBUS_FC_REPORT_SLAVE_ID: {
-        int str_len;
-        int byte_count_pos;
 
-        rsp_length = ctx->backend->build_response_basis(&sft, rsp);
-        /* Skip byte count for now */
-        byte_count_pos = rsp_length++;
-        rsp[rsp_length++] = _REPORT_SLAVE_ID;
-        /* Run indicator status to ON */
-        rsp[rsp_length++] = 0xFF;
-        /* LMB + length of LIBMODBUS_VERSION_STRING */
-        str_len = 3 + strlen(LIBMODBUS_VERSION_STRING);
-        memcpy(rsp + rsp_length, "LMB" LIBMODBUS_VERSION_STRING, str_len);
-        rsp_length += str_len;
-        rsp[byte_count_pos] = rsp_length - byte_count_pos - 1;
+#if defined(ARDUINO) && defined(__AVR__)
+    if (data != (int)0xFF00 && data != 0x0) {
+#else
+    if (data != 0xFF00 && data != 0x0) {
+#endif
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal data value 0x%0X in write_bit request at address %0X\n",
+                    data, address);
+        }
+        errno = EMBXILVAL;
+        return -1;
     }
-        break;
-    case MODBUS_FC_READ_EXCEPTION_STATUS:
+
+    if (mapping_write_begin(mb_mapping, MODBUS_TABLE_BITS, address, 1) == -1) {
+        return -1;
+    }
+    modbus_mapping_locate(mb_mapping, MODBUS_TABLE_BITS, address,
+                          (void **)&tab_bits, &mapping_address);
+
+    if (mb_mapping->flags & MODBUS_MAPPING_PACKED_BITS) {
+        MODBUS_SET_PACKED_BIT(tab_bits, mapping_address, data);
+    } else {
+        tab_bits[mapping_address] = data ? 1 : 0; // TODO do we save this?
+    }
+    modbus_mapping_write_end(mb_mapping, MODBUS_TABLE_BITS);
+
+    if (ctx->callbacks.write_single_coil_cb != NULL) {
+        ctx->callbacks.write_single_coil_cb(address, data);
+    }
+
+    if (rsp != req) {
+        memcpy(rsp, req, req_length);
+    }
+
+    if (ctx->callbacks.happened_cb != NULL) {
+        ctx->callbacks.happened_cb(ctx->slave, function, address, data);
+    }
+
+    return req_length;
+}
+
+static int reply_write_register(modbus_t *ctx, const uint8_t *req, int req_length,
+                                modbus_mapping_t *mb_mapping,
+                                uint8_t *rsp, int rsp_length)
+{
+    const int offset = ctx->backend->header_length;
+    int function = req[offset];
+    uint16_t address = (req[offset + 1] << 8) + req[offset + 2];
+    int data = (req[offset + 3] << 8) + req[offset + 4];
+
+    (void)rsp_length;
+
+    if (!mapping_is_mapped(mb_mapping, MODBUS_TABLE_REGISTERS, address, 1, FALSE)) {
         if (ctx->debug) {
-            fprintf(stderr, "FIXME Not implemented\n");
+            fprintf(stderr, "Illegal data address 0x%0X in write_register\n",
+                    address);
         }
-        errno = ENOPROTOOPT;
+        errno = EMBXILADD;
         return -1;
-        break;
-    case MODBUS_FC_MASK_WRITE_REGISTER: {
-        int mapping_address = address - mb_mapping->start_registers;
+    }
+
+    if (ctx->callbacks.write_single_register_cb != NULL) {
+        uint16_t value;
+        uint16_t stored;
+        unsigned int sequence;
+
+        /* The callback builds the whole response. It runs without the table
+           locked and is given a copy of the register, the value it leaves
+           there is written once it returns. */
+        do {
+            sequence = modbus_mapping_read_begin(mb_mapping, MODBUS_TABLE_REGISTERS);
+            mapping_copy_registers(mb_mapping, MODBUS_TABLE_REGISTERS, address, 1, &stored);
+        } while (modbus_mapping_read_retry(mb_mapping, MODBUS_TABLE_REGISTERS, sequence));
+        if (mapping_is_wire_order(mb_mapping, MODBUS_TABLE_REGISTERS)) {
+            stored = MODBUS_GET_WIRE_REGISTER(&stored, 0);
+        }
+        value = stored;
+
+        ctx->callbacks.write_single_register_cb(rsp, 0, address, data, &value, 0);
+        if (value != stored &&
+            mapping_set_register(mb_mapping, address, value) == -1) {
+            return -1;
+        }
+    } else {
+        if (mapping_set_register(mb_mapping, address, data) == -1) {
+            return -1;
+        }
+        if (rsp != req) {
+            memcpy(rsp, req, req_length);
+        }
+    }
+
+    if (ctx->callbacks.happened_cb != NULL) {
+        ctx->callbacks.happened_cb(ctx->slave, function, address, data);
+    }
+
+    return req_length;
+}
+
+static int reply_write_bits(modbus_t *ctx, const uint8_t *req, int req_length,
+                            modbus_mapping_t *mb_mapping,
+                            uint8_t *rsp, int rsp_length)
+{
+    const int offset = ctx->backend->header_length;
+    uint16_t address = (req[offset + 1] << 8) + req[offset + 2];
+    int nb = (req[offset + 3] << 8) + req[offset + 4];
+    int nb_bits = req[offset + 5];
+
+    (void)req_length;
+
+    if (nb < 1 || MODBUS_MAX_WRITE_BITS < nb || nb_bits * 8 < nb) {
+        /* May be the indication has been truncated on reading because of
+         * invalid address (eg. nb is 0 but the request contains values to
+         * write) so it's necessary to flush. */
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal number of values %d in write_bits (max %d)\n",
+                    nb, MODBUS_MAX_WRITE_BITS);
+        }
+        errno = EMBXILVAL;
+        return MODBUS_REPLY_TRUNCATED;
+    }
+
+    if (!mapping_is_mapped(mb_mapping, MODBUS_TABLE_BITS, address, nb, FALSE)) {
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal data address 0x%0X in write_bits\n",
+                    address);
+        }
+        errno = EMBXILADD;
+        return -1;
+    }
+
+    if (mapping_write_begin(mb_mapping, MODBUS_TABLE_BITS, address, nb) == -1) {
+        return -1;
+    }
+
+    /* 6 = byte count */
+    mapping_set_bits(mb_mapping, MODBUS_TABLE_BITS, address, nb, &req[offset + 6]);
+    modbus_mapping_write_end(mb_mapping, MODBUS_TABLE_BITS);
+
+    /* 4 to copy the bit address (2) and the quantity of bits */
+    if (rsp != req) {
+        memcpy(rsp + rsp_length, req + rsp_length, 4);
+    }
+    rsp_length += 4;
+
+    return rsp_length;
+}
+
+static int reply_write_registers(modbus_t *ctx, const uint8_t *req, int req_length,
+                                 modbus_mapping_t *mb_mapping,
+                                 uint8_t *rsp, int rsp_length)
+{
+    const int offset = ctx->backend->header_length;
+    uint16_t address = (req[offset + 1] << 8) + req[offset + 2];
+    int nb = (req[offset + 3] << 8) + req[offset + 4];
+    int nb_bytes = req[offset + 5];
+
+    (void)req_length;
+
+    if (nb < 1 || MODBUS_MAX_WRITE_REGISTERS < nb || nb_bytes * 8 < nb) {
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal number of values %d in write_registers (max %d)\n",
+                    nb, MODBUS_MAX_WRITE_REGISTERS);
+        }
+        errno = EMBXILVAL;
+        return MODBUS_REPLY_TRUNCATED;
+    }
+
+    if (!mapping_is_mapped(mb_mapping, MODBUS_TABLE_REGISTERS, address, nb, FALSE)) {
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal data address 0x%0X in write_registers\n",
+                    address);
+        }
+        errno = EMBXILADD;
+        return -1;
+    }
+
+    if (mapping_write_begin(mb_mapping, MODBUS_TABLE_REGISTERS, address, nb) == -1) {
+        return -1;
+    }
+
+    /* 6 and 7 = first value */
+    mapping_set_registers(mb_mapping, MODBUS_TABLE_REGISTERS, address, nb,
+                          &req[offset + 6]);
+    modbus_mapping_write_end(mb_mapping, MODBUS_TABLE_REGISTERS);
+
+    /* 4 to copy the address (2) and the no. of registers */
+    if (rsp != req) {
+        memcpy(rsp + rsp_length, req + rsp_length, 4);
+    }
+    rsp_length += 4;
+
+    return rsp_length;
+}
+
+static int reply_report_slave_id(modbus_t *ctx, const uint8_t *req, int req_length,
+                                 modbus_mapping_t *mb_mapping,
+                                 uint8_t *rsp, int rsp_length)
+{
+    int str_len;
+    int byte_count_pos;
+
+    (void)ctx;
+    (void)req;
+    (void)req_length;
+    (void)mb_mapping;
+
+    /* Skip byte count for now */
+    byte_count_pos = rsp_length++;
+    rsp[rsp_length++] = _REPORT_SLAVE_ID;
+    /* Run indicator status to ON */
+    rsp[rsp_length++] = 0xFF;
+    /* LMB + length of LIBMODBUS_VERSION_STRING */
+    str_len = 3 + strlen(LIBMODBUS_VERSION_STRING);
+    memcpy(rsp + rsp_length, "LMB" LIBMODBUS_VERSION_STRING, str_len);
+    rsp_length += str_len;
+    rsp[byte_count_pos] = rsp_length - byte_count_pos - 1;
+
+    return rsp_length;
+}
+
+static int reply_read_exception_status(modbus_t *ctx, const uint8_t *req,
+                                       int req_length,
+                                       modbus_mapping_t *mb_mapping,
+                                       uint8_t *rsp, int rsp_length)
+{
+    (void)req;
+    (void)req_length;
+    (void)mb_mapping;
+    (void)rsp;
+    (void)rsp_length;
+
+    if (ctx->debug) {
+        fprintf(stderr, "FIXME Not implemented\n");
+    }
+    errno = ENOPROTOOPT;
+    return -1;
+}
+
+static int reply_mask_write_register(modbus_t *ctx, const uint8_t *req,
+                                     int req_length,
+                                     modbus_mapping_t *mb_mapping,
+                                     uint8_t *rsp, int rsp_length)
+{
+    const int offset = ctx->backend->header_length;
+    uint16_t address = (req[offset + 1] << 8) + req[offset + 2];
+    uint16_t *tab_registers;
+    int mapping_address;
+    int wire_order;
+    uint16_t data;
+    uint16_t and;
+    uint16_t or;
+
+    (void)rsp_length;
+
+    if (!mapping_is_mapped(mb_mapping, MODBUS_TABLE_REGISTERS, address, 1, FALSE)) {
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal data address 0x%0X in write_register\n",
+                    address);
+        }
+        errno = EMBXILADD;
+        return -1;
+    }
+
+    if (mapping_write_begin(mb_mapping, MODBUS_TABLE_REGISTERS, address, 1) == -1) {
+        return -1;
+    }
+    modbus_mapping_locate(mb_mapping, MODBUS_TABLE_REGISTERS, address,
+                          (void **)&tab_registers, &mapping_address);
+
+    wire_order = mapping_is_wire_order(mb_mapping, MODBUS_TABLE_REGISTERS);
+    if (wire_order) {
+        data = MODBUS_GET_WIRE_REGISTER(tab_registers, mapping_address);
+    } else {
+        data = tab_registers[mapping_address];
+    }
+    and = (req[offset + 3] << 8) + req[offset + 4];
+    or = (req[offset + 5] << 8) + req[offset + 6];
+
+    data = (data & and) | (or & (~and));
+    if (wire_order) {
+        MODBUS_SET_WIRE_REGISTER(tab_registers, mapping_address, data);
+    } else {
+        tab_registers[mapping_address] = data;
+    }
+    modbus_mapping_write_end(mb_mapping, MODBUS_TABLE_REGISTERS);
+    if (rsp != req) {
+        memcpy(rsp, req, req_length);
+    }
+
+    return req_length;
+}
+
+static int reply_write_and_read_registers(modbus_t *ctx, const uint8_t *req,
+                                          int req_length,
+                                          modbus_mapping_t *mb_mapping,
+                                          uint8_t *rsp, int rsp_length)
+{
+    const int offset = ctx->backend->header_length;
+    int function = req[offset];
+    uint16_t address = (req[offset + 1] << 8) + req[offset + 2];
+    int nb = (req[offset + 3] << 8) + req[offset + 4];
+    uint16_t address_write = (req[offset + 5] << 8) + req[offset + 6];
+    int nb_write = (req[offset + 7] << 8) + req[offset + 8];
+    int nb_write_bytes = req[offset + 9];
+
+    (void)req_length;
+
+    if (nb_write < 1 || MODBUS_MAX_WR_WRITE_REGISTERS < nb_write ||
+        nb < 1 || MODBUS_MAX_WR_READ_REGISTERS < nb ||
+        nb_write_bytes != nb_write * 2) {
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal nb of values (W%d, R%d) in write_and_read_registers (max W%d, R%d)\n",
+                    nb_write, nb, MODBUS_MAX_WR_WRITE_REGISTERS, MODBUS_MAX_WR_READ_REGISTERS);
+        }
+        errno = EMBXILVAL;
+        return MODBUS_REPLY_TRUNCATED;
+    }
+
+    if (!mapping_is_mapped(mb_mapping, MODBUS_TABLE_REGISTERS, address, nb, TRUE) ||
+        !mapping_is_mapped(mb_mapping, MODBUS_TABLE_REGISTERS, address_write, nb_write, FALSE)) {
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal data read address 0x%0X or write address 0x%0X write_and_read_registers\n",
+                    address, address_write);
+        }
+        errno = EMBXILADD;
+        return -1;
+    }
+
+    if (mapping_write_begin(mb_mapping, MODBUS_TABLE_REGISTERS,
+                            address_write, nb_write) == -1) {
+        return -1;
+    }
+
+    rsp[rsp_length++] = nb << 1;
+
+    /* Write first.
+       10 and 11 are the offset of the first values to write */
+    mapping_set_registers(mb_mapping, MODBUS_TABLE_REGISTERS, address_write,
+                          nb_write, &req[offset + 10]);
+
+    /* and read the data for the response, in the same update so the
+       response holds the values written */
+    mapping_get_registers(mb_mapping, MODBUS_TABLE_REGISTERS, address, nb,
+                          rsp + rsp_length);
+    modbus_mapping_write_end(mb_mapping, MODBUS_TABLE_REGISTERS);
+    rsp_length += nb << 1;
+
+    if (ctx->callbacks.happened_cb != NULL) {
+        ctx->callbacks.happened_cb(ctx->slave, function, address, nb);
+    }
+
+    return rsp_length;
+}
+
+/* Whether the handler answers with the request itself, left untouched when
+   the response is built in place */
+static int is_echo(modbus_t *ctx, const modbus_function_t *def)
+{
+    return def->reply == reply_write_bit ||
+           def->reply == reply_mask_write_register ||
+           (def->reply == reply_write_register &&
+            ctx->callbacks.write_single_register_cb == NULL);
+}
+
+/* Analyses the request and constructs a response in rsp with the handler
+   registered for its function code. rsp can be the request itself, the
+   handlers read the fields of the request before writing the response.
+
+   If an error occurs, this function construct the response
+   accordingly. It returns the length of the response to send, 0 when none
+   is due, and sets crc to the CRC register after the response (see
+   msg_crc()).
+*/
+static int build_reply(modbus_t *ctx, const uint8_t *req, int req_length,
+                       modbus_mapping_t *mb_mapping, uint8_t *rsp,
+                       uint16_t *crc)
+{
+    int offset;
+    int slave;
+    int function;
+    uint16_t address;
+    int rsp_length = 0;
+    /* Length of the indication as received, req_length doesn't count the
+       checksum once the response TID has been prepared */
+    int msg_length = req_length;
+    const modbus_function_t *def;
+    sft_t sft;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    offset = ctx->backend->header_length;
+    slave = req[offset - 1];
+    function = req[offset];
+    address = (req[offset + 1] << 8) + req[offset + 2];
+
+    sft.slave = slave;
+    sft.function = function;
+    sft.t_id = ctx->backend->prepare_response_tid(req, &req_length);
+
+    if (ctx->callbacks.event_cb != NULL) {
+        ctx->callbacks.event_cb(slave, function, address);
+    }
+
+    if (slave != ctx->slave) {
+        return 0;
+    }
+
+    def = get_function(ctx, function);
+    if (def->reply == NULL) {
+        rsp_length = response_exception(
+            ctx, &sft, req, msg_length,
+            MODBUS_EXCEPTION_ILLEGAL_FUNCTION, rsp, TRUE,
+            "Unknown Modbus function code: 0x%0X\n", function);
+    } else {
+        rsp_length = ctx->backend->build_response_basis(&sft, rsp);
+        rsp_length = def->reply(ctx, req, req_length, mb_mapping,
+                                rsp, rsp_length);
+        if (rsp_length < 0) {
+            int exception_code = errno - MODBUS_ENOBASE;
+
+            if (exception_code < MODBUS_EXCEPTION_ILLEGAL_FUNCTION ||
+                exception_code >= MODBUS_EXCEPTION_MAX) {
+                /* Not a Modbus exception, no response */
+                return -1;
+            }
 
-        if (mapping_address < 0 || mapping_address >= mb_mapping->nb_registers) {
             rsp_length = response_exception(
-                ctx, &sft, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
-                "Illegal data address 0x%0X in write_register\n",
-                address);
-        } else {
-            uint16_t data = mb_mapping->tab_registers[mapping_address];
-            uint16_t and = (req[offset + 3] << 8) + req[offset + 4];
-            uint16_t or = (req[offset + 5] << 8) + req[offset + 6];
+                ctx, &sft, req, msg_length, exception_code, rsp,
+                rsp_length == MODBUS_REPLY_TRUNCATED, NULL);
+        }
+    }
+
+    /* Suppress any responses when the request was a broadcast */
+    if (slave == MODBUS_BROADCAST_ADDRESS)
+        return 0;
+
+    if (ctx->backend->checksum_length != 0 && rsp == req &&
+        rsp_length == req_length && is_echo(ctx, def)) {
+        /* The request left as is in place, followed by its checked CRC */
+        *crc = rsp[rsp_length] | (rsp[rsp_length + 1] << 8);
+    } else {
+        *crc = msg_crc(ctx, rsp, rsp_length);
+    }
+
+    return rsp_length;
+}
+
+/* Send a response to the received request */
+static int reply(modbus_t *ctx, const uint8_t *req, int req_length,
+                 modbus_mapping_t *mb_mapping, uint8_t *rsp)
+{
+    uint16_t crc;
+    int rsp_length = build_reply(ctx, req, req_length, mb_mapping, rsp, &crc);
+
+    if (rsp_length <= 0)
+        return rsp_length;
+
+    return send_msg_crc(ctx, rsp, rsp_length, crc);
+}
+
+int modbus_reply(modbus_t *ctx, const uint8_t *req,
+                 int req_length, modbus_mapping_t *mb_mapping)
+{
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+
+    return reply(ctx, req, req_length, mb_mapping, rsp);
+}
+
+/* Same as modbus_reply() but the response is built in the buffer of the
+   request, which must be large enough for the longest response of the
+   backend (MODBUS_RTU_MAX_ADU_LENGTH or MODBUS_TCP_MAX_ADU_LENGTH). The echo
+   responses are sent without any copy, nor computing their CRC again. */
+int modbus_reply_in_place(modbus_t *ctx, uint8_t *req,
+                          int req_length, modbus_mapping_t *mb_mapping)
+{
+    return reply(ctx, req, req_length, mb_mapping, req);
+}
+
+/* Same as modbus_reply() but the response is stored in rsp, which must be
+   large enough for the longest response of the backend, instead of being
+   sent. The responses of several requests can then be sent at once.
+
+   The function shall return the length of the response (with its checksum
+   on RTU), 0 when no response is due (other slave or broadcast), or -1 and
+   set errno.
+*/
+int modbus_reply_build(modbus_t *ctx, const uint8_t *req, int req_length,
+                       modbus_mapping_t *mb_mapping, uint8_t *rsp)
+{
+    uint16_t crc;
+    int rsp_length = build_reply(ctx, req, req_length, mb_mapping, rsp, &crc);
+
+    if (rsp_length <= 0)
+        return rsp_length;
+
+    return ctx->backend->send_msg_pre(rsp, rsp_length, crc);
+}
+
+/* Built-in function codes, indexed by function code */
+#define _MODBUS_NB_FUNCTIONS (MODBUS_FC_WRITE_AND_READ_REGISTERS + 1)
+
+static const modbus_function_t _modbus_functions[_MODBUS_NB_FUNCTIONS] = {
+    { 0, 0, 1, 0, NULL },
+    /* MODBUS_FC_READ_COILS */
+    { 4, 0, 1, 1, reply_read_bits },
+    /* MODBUS_FC_READ_DISCRETE_INPUTS */
+    { 4, 0, 1, 1, reply_read_bits },
+    /* MODBUS_FC_READ_HOLDING_REGISTERS */
+    { 4, 0, 1, 1, reply_read_registers },
+    /* MODBUS_FC_READ_INPUT_REGISTERS */
+    { 4, 0, 1, 1, reply_read_registers },
+    /* MODBUS_FC_WRITE_SINGLE_COIL */
+    { 4, 0, 4, 0, reply_write_bit },
+    /* MODBUS_FC_WRITE_SINGLE_REGISTER */
+    { 4, 0, 4, 0, reply_write_register },
+    /* MODBUS_FC_READ_EXCEPTION_STATUS */
+    { 0, 0, 1, 0, reply_read_exception_status },
+    { 0, 0, 1, 0, NULL },
+    { 0, 0, 1, 0, NULL },
+    { 0, 0, 1, 0, NULL },
+    { 0, 0, 1, 0, NULL },
+    { 0, 0, 1, 0, NULL },
+    { 0, 0, 1, 0, NULL },
+    { 0, 0, 1, 0, NULL },
+    /* MODBUS_FC_WRITE_MULTIPLE_COILS */
+    { 5, 5, 4, 0, reply_write_bits },
+    /* MODBUS_FC_WRITE_MULTIPLE_REGISTERS */
+    { 5, 5, 4, 0, reply_write_registers },
+    /* MODBUS_FC_REPORT_SLAVE_ID */
+    { 0, 0, 1, 1, reply_report_slave_id },
+    { 0, 0, 1, 0, NULL },
+    { 0, 0, 1, 0, NULL },
+    { 0, 0, 1, 0, NULL },
+    { 0, 0, 1, 0, NULL },
+    /* MODBUS_FC_MASK_WRITE_REGISTER */
+    { 6, 0, 6, 0, reply_mask_write_register },
+    /* MODBUS_FC_WRITE_AND_READ_REGISTERS */
+    { 9, 9, 1, 1, reply_write_and_read_registers }
+};
+
+/* Unknown function codes and exception responses: nothing follows the
+   function code of an indication, the exception code follows the one of a
+   confirmation */
+static const modbus_function_t _modbus_function_unsupported = { 0, 0, 1, 0, NULL };
+
+static const modbus_function_t *get_function(modbus_t *ctx, int function)
+{
+    if (ctx->functions != NULL) {
+        if (function < ctx->nb_functions) {
+            return &ctx->functions[function];
+        }
+    } else if (function < _MODBUS_NB_FUNCTIONS) {
+        return &_modbus_functions[function];
+    }
+
+    return &_modbus_function_unsupported;
+}
+
+/* Installs the framing rules and the reply handler of a function code, the
+   built-in ones can be replaced. Without definition (def is NULL), the
+   function code isn't supported anymore and is replied with an illegal
+   function exception. */
+int modbus_set_function(modbus_t *ctx, int function, const modbus_function_t *def)
+{
+    if (ctx == NULL || function < 1 || function >= 0x80) {
+        errno = EINVAL;
+        return -1;
+    }
 
-            data = (data & and) | (or & (~and));
-            mb_mapping->tab_registers[mapping_address] = data;
-            memcpy(rsp, req, req_length);
-            rsp_length = req_length;
-        }
+    /* The byte count must be part of the meta information */
+    if (def != NULL &&
+        (def->indication_count_offset > def->indication_meta_length ||
+         def->confirmation_count_offset > def->confirmation_meta_length)) {
+        errno = EINVAL;
+        return -1;
     }
-        break;
-    case MODBUS_FC_WRITE_AND_READ_REGISTERS: {
-        int nb = (req[offset + 3] << 8) + req[offset + 4];
-        uint16_t address_write = (req[offset + 5] << 8) + req[offset + 6];
-        int nb_write = (req[offset + 7] << 8) + req[offset + 8];
-        int nb_write_bytes = req[offset + 9];
-        int mapping_address = address - mb_mapping->start_registers;
-        int mapping_address_write = address_write - mb_mapping->start_registers;
-
-        if (nb_write < 1 || MODBUS_MAX_WR_WRITE_REGISTERS < nb_write ||
-            nb < 1 || MODBUS_MAX_WR_READ_REGISTERS < nb ||
-            nb_write_bytes != nb_write * 2) {
-            rsp_length = response_exception(
-                ctx, &sft, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp, TRUE,
-                "Illegal nb of values (W%d, R%d) in write_and_read_registers (max W%d, R%d)\n",
-                nb_write, nb, MODBUS_MAX_WR_WRITE_REGISTERS, MODBUS_MAX_WR_READ_REGISTERS);
-        } else if (mapping_address < 0 ||
-                   (mapping_address + nb) > mb_mapping->nb_registers ||
-                   mapping_address_write < 0 ||
-                   (mapping_address_write + nb_write) > mb_mapping->nb_registers) {
-            rsp_length = response_exception(
-                ctx, &sft, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
-                "Illegal data read address 0x%0X or write address 0x%0X write_and_read_registers\n",
-                mapping_address < 0 ? address : address + nb,
-                mapping_address_write < 0 ? address_write : address_write + nb_write);
-        } else {
-            int i, j;
-            rsp_length = ctx->backend->build_response_basis(&sft, rsp);
-            rsp[rsp_length++] = nb << 1;
-
-            /* Write first.
-               10 and 11 are the offset of the first values to write */
-            for (i = mapping_address_write, j = 10;
-                 i < mapping_address_write + nb_write; i++, j += 2) {
-                mb_mapping->tab_registers[i] =
-                    (req[offset + j] << 8) + req[offset + j + 1];
-            }
 
-            /* and read the data for the response */
-            for (i = mapping_address; i < mapping_address + nb; i++) {
-                rsp[rsp_length++] = mb_mapping->tab_registers[i] >> 8;
-                rsp[rsp_length++] = mb_mapping->tab_registers[i] & 0xFF;
-            }
+    if (function >= ctx->nb_functions) {
+        /* Copy of the built-in table, grown to the highest function code */
+        int nb_functions = function < _MODBUS_NB_FUNCTIONS ?
+            _MODBUS_NB_FUNCTIONS : function + 1;
+        modbus_function_t *functions;
+        int i;
 
-            if (ctx->callbacks.happened_cb != NULL) {
-                ctx->callbacks.happened_cb(slave, function, address, nb);
-            }
+        functions = (modbus_function_t *)realloc(
+            ctx->functions, nb_functions * sizeof(modbus_function_t));
+        if (functions == NULL) {
+            errno = ENOMEM;
+            return -1;
         }
-    }
-        break;
 
-    default:
-        rsp_length = response_exception(
-            ctx, &sft, MODBUS_EXCEPTION_ILLEGAL_FUNCTION, rsp, TRUE,
-            "Unknown Modbus function code: 0x%0X\n", function);
-        break;
+        for (i = ctx->nb_functions; i < nb_functions; i++) {
+            functions[i] = (i < _MODBUS_NB_FUNCTIONS) ?
+                _modbus_functions[i] : _modbus_function_unsupported;
+        }
+        ctx->functions = functions;
+        ctx->nb_functions = nb_functions;
     }
 
-    /* Suppress any responses when the request was a broadcast */
-    return (slave == MODBUS_BROADCAST_ADDRESS) ? 0 : send_msg(ctx, rsp, rsp_length);
+    ctx->functions[function] = (def != NULL) ? *def : _modbus_function_unsupported;
+
+    return 0;
 }
 
 int modbus_reply_exception(modbus_t *ctx, const uint8_t *req,
@@ -1195,7 +2357,7 @@ static int read_io_status(modbus_t *ctx, int function,
         if (rc == -1)
             return -1;
 
-        rc = check_confirmation(ctx, req, rsp, rc);
+        rc = check_confirmation(ctx, req, rsp, rc, TRUE);
         if (rc == -1)
             return -1;
 
@@ -1304,7 +2466,7 @@ static int read_registers(modbus_t *ctx, int function, int addr, int nb,
         if (rc == -1)
             return -1;
 
-        rc = check_confirmation(ctx, req, rsp, rc);
+        rc = check_confirmation(ctx, req, rsp, rc, TRUE);
         if (rc == -1)
             return -1;
 
@@ -1395,7 +2557,7 @@ static int write_single(modbus_t *ctx, int function, int addr, int value)
         if (rc == -1)
             return -1;
 
-        rc = check_confirmation(ctx, req, rsp, rc);
+        rc = check_confirmation(ctx, req, rsp, rc, TRUE);
     }
 
     return rc;
@@ -1480,7 +2642,7 @@ int modbus_write_bits(modbus_t *ctx, int addr, int nb, const uint8_t *src)
         if (rc == -1)
             return -1;
 
-        rc = check_confirmation(ctx, req, rsp, rc);
+        rc = check_confirmation(ctx, req, rsp, rc, TRUE);
     }
 
 
@@ -1530,7 +2692,7 @@ int modbus_write_registers(modbus_t *ctx, int addr, int nb, const uint16_t *src)
         if (rc == -1)
             return -1;
 
-        rc = check_confirmation(ctx, req, rsp, rc);
+        rc = check_confirmation(ctx, req, rsp, rc, TRUE);
     }
 
     return rc;
@@ -1566,7 +2728,7 @@ int modbus_mask_write_register(modbus_t *ctx, int addr, uint16_t and_mask, uint1
         if (rc == -1)
             return -1;
 
-        rc = check_confirmation(ctx, req, rsp, rc);
+        rc = check_confirmation(ctx, req, rsp, rc, TRUE);
     }
 
     return rc;
@@ -1623,77 +2785,561 @@ int modbus_write_and_read_registers(modbus_t *ctx,
     byte_count = write_nb * 2;
     req[req_length++] = byte_count;
 
-    for (i = 0; i < write_nb; i++) {
-        req[req_length++] = src[i] >> 8;
-        req[req_length++] = src[i] & 0x00FF;
+    for (i = 0; i < write_nb; i++) {
+        req[req_length++] = src[i] >> 8;
+        req[req_length++] = src[i] & 0x00FF;
+    }
+
+    rc = send_msg(ctx, req, req_length);
+    if (rc > 0) {
+        int offset;
+
+        rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
+        if (rc == -1)
+            return -1;
+
+        rc = check_confirmation(ctx, req, rsp, rc, TRUE);
+        if (rc == -1)
+            return -1;
+
+        offset = ctx->backend->header_length;
+        for (i = 0; i < rc; i++) {
+            /* shift reg hi_byte to temp OR with lo_byte */
+            dest[i] = (rsp[offset + 2 + (i << 1)] << 8) |
+                rsp[offset + 3 + (i << 1)];
+        }
+    }
+
+    return rc;
+}
+
+/* Send a request to get the slave ID of the device (only available in serial
+   communication). */
+int modbus_report_slave_id(modbus_t *ctx, int max_dest, uint8_t *dest)
+{
+    int rc;
+    int req_length;
+    uint8_t req[_MIN_REQ_LENGTH];
+
+    if (ctx == NULL || max_dest <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    req_length = ctx->backend->build_request_basis(ctx, MODBUS_FC_REPORT_SLAVE_ID,
+                                                   0, 0, req);
+
+    /* HACKISH, addr and count are not used */
+    req_length -= 4;
+
+    rc = send_msg(ctx, req, req_length);
+    if (rc > 0) {
+        int i;
+        int offset;
+        uint8_t rsp[MAX_MESSAGE_LENGTH];
+
+        rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
+        if (rc == -1)
+            return -1;
+
+        rc = check_confirmation(ctx, req, rsp, rc, TRUE);
+        if (rc == -1)
+            return -1;
+
+        offset = ctx->backend->header_length + 2;
+
+        /* Byte count, slave id, run indicator status and
+           additional data. Truncate copy to max_dest. */
+        for (i=0; i < rc && i < max_dest; i++) {
+            dest[i] = rsp[offset + i];
+        }
+    }
+
+    return rc;
+}
+
+/* Returns the identifier of the transaction, the MBAP transaction identifier
+   on TCP and 0 otherwise */
+static int transaction_id(modbus_t *ctx,
+                          const modbus_transaction_t *transaction)
+{
+    if (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_TCP) {
+        return (transaction->req[0] << 8) | transaction->req[1];
+    }
+
+    return 0;
+}
+
+/* Returns the transaction of the confirmation rsp, NULL when the
+   confirmation matches none of the transactions in flight (late confirmation
+   of a transaction timed out) */
+static modbus_transaction_t *transaction_find(modbus_t *ctx,
+                                              const uint8_t *rsp)
+{
+    int i;
+
+    /* A single transaction is checked against any confirmation like the
+       blocking requests */
+    if (ctx->max_transactions == 1) {
+        return ctx->transactions;
+    }
+
+    for (i = 0; i < ctx->max_transactions; i++) {
+        modbus_transaction_t *transaction = &ctx->transactions[i];
+
+        if (transaction->req_length != 0 &&
+            transaction->req[0] == rsp[0] && transaction->req[1] == rsp[1]) {
+            return transaction;
+        }
+    }
+
+    return NULL;
+}
+
+/* Returns the transaction in flight which times out first, and in remaining
+   the microseconds left before it does. Once a confirmation started, the
+   allowed interval between two consecutive bytes is defined by
+   byte_timeout. */
+static modbus_transaction_t *transaction_next_timeout(modbus_t *ctx,
+                                                      unsigned long *remaining)
+{
+    modbus_transaction_t *next = NULL;
+    unsigned long now = _modbus_micros();
+    unsigned long since;
+    unsigned long timeout;
+    int i;
+
+    *remaining = 0;
+
+    if (ctx->parser.length_to_read != 0 && ctx->parser.msg_length > 0 &&
+        (ctx->byte_timeout.tv_sec > 0 || ctx->byte_timeout.tv_usec > 0)) {
+        /* Expired by _modbus_receive_msg_poll() */
+        since = now - ctx->parser.last_recv_time;
+        timeout = _modbus_timeval_to_us(&ctx->byte_timeout);
+        *remaining = since < timeout ? timeout - since : 0;
+        return NULL;
+    }
+
+    timeout = _modbus_timeval_to_us(&ctx->response_timeout);
+    for (i = 0; i < ctx->max_transactions; i++) {
+        modbus_transaction_t *transaction = &ctx->transactions[i];
+        unsigned long left;
+
+        if (transaction->req_length == 0)
+            continue;
+
+        since = now - transaction->send_time;
+        left = since < timeout ? timeout - since : 0;
+        if (next == NULL || left < *remaining) {
+            next = transaction;
+            *remaining = left;
+        }
+    }
+
+    return next;
+}
+
+/* Sets the number of requests which can be in flight at once, sent by
+   modbus_send_transaction(). Only TCP matches the confirmations to their
+   request (pipelining), the other backends are limited to one. */
+int modbus_set_max_transactions(modbus_t *ctx, int nb)
+{
+    modbus_transaction_t *transactions;
+
+    if (ctx == NULL || nb < 1 || nb > UINT16_MAX ||
+        (nb > 1 && ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_TCP)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->nb_transactions != 0) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if (nb == 1) {
+        transactions = &ctx->transaction;
+    } else {
+        transactions = (modbus_transaction_t *)malloc(
+            nb * sizeof(modbus_transaction_t));
+        if (transactions == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    if (ctx->transactions != &ctx->transaction) {
+        free(ctx->transactions);
+    }
+    ctx->transactions = transactions;
+    ctx->max_transactions = nb;
+    transactions_clear(ctx);
+
+    return 0;
+}
+
+/* Sends the request and keeps it in a free slot of the transactions */
+static int transaction_send(modbus_t *ctx, uint8_t *req, int req_length,
+                            void *dest, int raw)
+{
+    modbus_transaction_t *transaction;
+    int rc;
+
+    rc = _send_msg(ctx, req, req_length, msg_crc(ctx, req, req_length));
+    if (rc == -1)
+        return -1;
+
+    if (ctx->nb_transactions == 0) {
+        /* A message partially received can't be a confirmation */
+        ctx->parser.length_to_read = 0;
+    }
+
+    transaction = ctx->transactions;
+    while (transaction->req_length != 0) {
+        transaction++;
+    }
+    memcpy(transaction->req, req,
+           req_length < _MIN_REQ_LENGTH ? req_length : _MIN_REQ_LENGTH);
+    transaction->req_length = req_length;
+    transaction->dest = dest;
+    transaction->raw = raw;
+    transaction->send_time = _modbus_micros();
+    ctx->nb_transactions++;
+
+    return transaction_id(ctx, transaction);
+}
+
+/* Sends a request without waiting for the confirmation, which is then
+   received by modbus_poll_transactions(). Up to max_transactions requests
+   can be in flight, EBUSY is returned otherwise.
+
+   function is one of the read and write functions of the data tables. src
+   holds the nb values to write: uint8_t for the coils, uint16_t for the
+   registers and the AND then OR masks for MODBUS_FC_MASK_WRITE_REGISTER. The
+   single writes take nb 1. The values read are stored in dest.
+
+   The function shall return the identifier of the transaction (the MBAP
+   transaction identifier on TCP, 0 otherwise).
+*/
+int modbus_send_transaction(modbus_t *ctx, int function, int addr, int nb,
+                            const void *src, void *dest)
+{
+    int i;
+    int req_length;
+    int max_nb;
+    uint8_t req[MAX_MESSAGE_LENGTH];
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    switch (function) {
+    case MODBUS_FC_READ_COILS:
+    case MODBUS_FC_READ_DISCRETE_INPUTS:
+        max_nb = MODBUS_MAX_READ_BITS;
+        break;
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+    case MODBUS_FC_READ_INPUT_REGISTERS:
+        max_nb = MODBUS_MAX_READ_REGISTERS;
+        break;
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+        max_nb = MODBUS_MAX_WRITE_BITS;
+        break;
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        max_nb = MODBUS_MAX_WRITE_REGISTERS;
+        break;
+    case MODBUS_FC_WRITE_SINGLE_COIL:
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+    case MODBUS_FC_MASK_WRITE_REGISTER:
+        max_nb = 1;
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (nb < 1 || (src == NULL && function != MODBUS_FC_READ_COILS &&
+                   function != MODBUS_FC_READ_DISCRETE_INPUTS &&
+                   function != MODBUS_FC_READ_HOLDING_REGISTERS &&
+                   function != MODBUS_FC_READ_INPUT_REGISTERS)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (nb > max_nb) {
+        if (ctx->debug) {
+            fprintf(stderr, "ERROR Too many values (%d > %d)\n", nb, max_nb);
+        }
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    if (ctx->nb_transactions == ctx->max_transactions) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    switch (function) {
+    case MODBUS_FC_WRITE_SINGLE_COIL:
+        req_length = ctx->backend->build_request_basis(
+            ctx, function, addr, ((const uint8_t *)src)[0] ? 0xFF00 : 0, req);
+        break;
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        req_length = ctx->backend->build_request_basis(
+            ctx, function, addr, ((const uint16_t *)src)[0], req);
+        break;
+    case MODBUS_FC_MASK_WRITE_REGISTER:
+        /* Same layout as modbus_mask_write_register(), count is not used */
+        req_length = ctx->backend->build_request_basis(ctx, function, addr,
+                                                       0, req) - 2;
+        for (i = 0; i < 2; i++) {
+            req[req_length++] = ((const uint16_t *)src)[i] >> 8;
+            req[req_length++] = ((const uint16_t *)src)[i] & 0x00FF;
+        }
+        break;
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+        req_length = ctx->backend->build_request_basis(ctx, function, addr,
+                                                       nb, req);
+        req[req_length++] = (nb / 8) + ((nb % 8) ? 1 : 0);
+        memset(req + req_length, 0, req[req_length - 1]);
+        for (i = 0; i < nb; i++) {
+            if (((const uint8_t *)src)[i])
+                req[req_length + i / 8] |= 1 << (i % 8);
+        }
+        req_length += req[req_length - 1];
+        break;
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        req_length = ctx->backend->build_request_basis(ctx, function, addr,
+                                                       nb, req);
+        req[req_length++] = nb * 2;
+        for (i = 0; i < nb; i++) {
+            req[req_length++] = ((const uint16_t *)src)[i] >> 8;
+            req[req_length++] = ((const uint16_t *)src)[i] & 0x00FF;
+        }
+        break;
+    default:
+        req_length = ctx->backend->build_request_basis(ctx, function, addr,
+                                                       nb, req);
+    }
+
+    return transaction_send(ctx, req, req_length, dest, FALSE);
+}
+
+/* Sends the raw request (slave followed by the PDU, see
+   modbus_send_raw_request()) without waiting for the confirmation, to relay
+   any function. modbus_poll_transactions() then returns the length of the
+   confirmation, stored as received in rsp (exception responses included),
+   instead of a number of values. Only the slave, the function code and the
+   integrity of the confirmation are checked.
+
+   The function shall return the identifier of the transaction. */
+int modbus_send_raw_transaction(modbus_t *ctx, const uint8_t *raw_req,
+                                int raw_req_length)
+{
+    uint8_t req[MAX_MESSAGE_LENGTH];
+    int req_length;
+
+    if (ctx == NULL || raw_req == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->nb_transactions == ctx->max_transactions) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    req_length = build_raw_request(ctx, raw_req, raw_req_length, req);
+    if (req_length == -1)
+        return -1;
+
+    return transaction_send(ctx, req, req_length, NULL, TRUE);
+}
+
+/* Same as modbus_send_transaction(), the values read are stored by
+   modbus_poll_confirmation() */
+int modbus_send_request(modbus_t *ctx, int function, int addr, int nb,
+                        const void *src)
+{
+    return modbus_send_transaction(ctx, function, addr, nb, src, NULL);
+}
+
+static int poll_transactions(modbus_t *ctx, uint8_t *rsp, void *dest,
+                             int *t_id, int blocking)
+{
+    int rc;
+    int i;
+    int raw;
+    int offset;
+    unsigned long remaining;
+    modbus_transaction_t *transaction;
+    uint8_t req[_MIN_REQ_LENGTH];
+
+    *t_id = -1;
+
+    if (ctx->nb_transactions == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (;;) {
+        rc = _modbus_receive_msg_poll(ctx, rsp, MSG_CONFIRMATION);
+        if (rc == -1 && errno == EAGAIN) {
+            transaction = transaction_next_timeout(ctx, &remaining);
+            if (transaction == NULL || remaining > 0) {
+                return -1;
+            }
+            if (ctx->nb_transactions == 1) {
+                /* Nothing else can be received */
+                ctx->parser.length_to_read = 0;
+            }
+            errno = ETIMEDOUT;
+            _error_print(ctx, "select");
+            break;
+        }
+
+        if (rc == -1) {
+            /* The link failed or the stream is lost, the following
+               confirmations can't be matched anymore */
+            transactions_clear(ctx);
+            return -1;
+        }
+
+        transaction = transaction_find(ctx, rsp);
+        if (transaction != NULL)
+            break;
+
+        if (ctx->debug) {
+            fprintf(stderr, "Confirmation of no transaction in flight ignored\n");
+        }
+    }
+
+    /* The transaction is over, whatever the outcome */
+    *t_id = transaction_id(ctx, transaction);
+    if (dest == NULL) {
+        dest = transaction->dest;
     }
+    memcpy(req, transaction->req, _MIN_REQ_LENGTH);
+    raw = transaction->raw;
+    transaction->req_length = 0;
+    ctx->nb_transactions--;
 
-    rc = send_msg(ctx, req, req_length);
-    if (rc > 0) {
-        int offset;
+    if (rc == -1)
+        return -1;
 
-        rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
-        if (rc == -1)
-            return -1;
+    if (raw)
+        return check_raw_confirmation(ctx, req, rsp, rc, blocking);
 
-        rc = check_confirmation(ctx, req, rsp, rc);
-        if (rc == -1)
-            return -1;
+    rc = check_confirmation(ctx, req, rsp, rc, blocking);
+    if (rc == -1)
+        return -1;
 
-        offset = ctx->backend->header_length;
+    offset = ctx->backend->header_length;
+
+    switch (req[offset]) {
+    case MODBUS_FC_READ_COILS:
+    case MODBUS_FC_READ_DISCRETE_INPUTS:
+        /* rc is the byte count, return the number of bits like
+           modbus_read_bits() */
+        rc = (req[offset + 3] << 8) | req[offset + 4];
+        modbus_set_bits_from_bytes((uint8_t *)dest, 0, rc, rsp + offset + 2);
+        break;
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+    case MODBUS_FC_READ_INPUT_REGISTERS:
         for (i = 0; i < rc; i++) {
-            /* shift reg hi_byte to temp OR with lo_byte */
-            dest[i] = (rsp[offset + 2 + (i << 1)] << 8) |
+            ((uint16_t *)dest)[i] = (rsp[offset + 2 + (i << 1)] << 8) |
                 rsp[offset + 3 + (i << 1)];
         }
+        break;
+    default:
+        break;
     }
 
     return rc;
 }
 
-/* Send a request to get the slave ID of the device (only available in serial
-   communication). */
-int modbus_report_slave_id(modbus_t *ctx, int max_dest, uint8_t *dest)
+/* Receives the bytes of the confirmations already available, without
+   waiting, until a transaction is over. rsp must be the same buffer for all
+   the calls.
+
+   The function shall return the same value as the blocking function of the
+   request (number of values read or written, the length of the confirmation
+   for a raw transaction) once a confirmation is received and checked, and
+   store the identifier of its transaction in t_id. While the
+   confirmations are awaited, it shall return -1 and set errno to EAGAIN.
+   Otherwise it shall return -1 with errno set, and the transaction which
+   failed in t_id (ETIMEDOUT when its response timeout expired, exception
+   codes...). t_id is -1 when the link failed, all the transactions in flight
+   are then dropped.
+*/
+int modbus_poll_transactions(modbus_t *ctx, uint8_t *rsp, int *t_id)
 {
-    int rc;
-    int req_length;
-    uint8_t req[_MIN_REQ_LENGTH];
+    int dummy;
 
-    if (ctx == NULL || max_dest <= 0) {
+    if (ctx == NULL) {
         errno = EINVAL;
         return -1;
     }
 
-    req_length = ctx->backend->build_request_basis(ctx, MODBUS_FC_REPORT_SLAVE_ID,
-                                                   0, 0, req);
+    return poll_transactions(ctx, rsp, NULL, t_id != NULL ? t_id : &dummy,
+                             FALSE);
+}
 
-    /* HACKISH, addr and count are not used */
-    req_length -= 4;
+/* Receives the bytes of the confirmation already available, without waiting,
+   when a single request is in flight.
 
-    rc = send_msg(ctx, req, req_length);
-    if (rc > 0) {
-        int i;
-        int offset;
-        uint8_t rsp[MAX_MESSAGE_LENGTH];
+   The function shall return the same value as the blocking function of the
+   request (number of values read or written) once the confirmation is
+   received and checked, and store the read values in dest. While the
+   confirmation is awaited, it shall return -1 and set errno to EAGAIN. It
+   shall return -1 with ETIMEDOUT when the response timeout expires. rsp must
+   be the same buffer for all the calls of a transaction.
+*/
+int modbus_poll_confirmation(modbus_t *ctx, uint8_t *rsp, void *dest)
+{
+    int t_id;
 
-        rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
-        if (rc == -1)
-            return -1;
+    if (ctx == NULL || ctx->nb_transactions > 1) {
+        errno = EINVAL;
+        return -1;
+    }
 
-        rc = check_confirmation(ctx, req, rsp, rc);
-        if (rc == -1)
-            return -1;
+    return poll_transactions(ctx, rsp, dest, &t_id, FALSE);
+}
 
-        offset = ctx->backend->header_length + 2;
+/* Same as modbus_poll_confirmation() but waits until the transaction is
+   over */
+int modbus_wait_confirmation(modbus_t *ctx, uint8_t *rsp, void *dest)
+{
+    int rc;
+    int t_id;
+    unsigned long remaining;
+    fd_set rset;
+    struct timeval tv;
 
-        /* Byte count, slave id, run indicator status and
-           additional data. Truncate copy to max_dest. */
-        for (i=0; i < rc && i < max_dest; i++) {
-            dest[i] = rsp[offset + i];
-        }
+    if (ctx == NULL || ctx->nb_transactions > 1) {
+        errno = EINVAL;
+        return -1;
     }
 
-    return rc;
+    for (;;) {
+        rc = poll_transactions(ctx, rsp, dest, &t_id, TRUE);
+        if (rc != -1 || errno != EAGAIN) {
+            return rc;
+        }
+
+        /* Wait for the next bytes, the backends report the errors to the
+           following poll */
+#ifndef ARDUINO
+        FD_ZERO(&rset);
+        FD_SET(ctx->s, &rset);
+#endif
+        transaction_next_timeout(ctx, &remaining);
+        tv.tv_sec = remaining / 1000000;
+        tv.tv_usec = remaining % 1000000;
+        ctx->backend->select(ctx, &rset, &tv, ctx->parser.length_to_read);
+    }
 }
 
 void _modbus_init_common(modbus_t *ctx)
@@ -1704,12 +3350,24 @@ void _modbus_init_common(modbus_t *ctx)
 
     ctx->debug = FALSE;
     ctx->error_recovery = MODBUS_ERROR_RECOVERY_NONE;
+    ctx->receive_mode = MODBUS_RECEIVE_ADU;
+    ctx->exception_recovery = MODBUS_EXCEPTION_RECOVERY_DISCARD;
+
+    ctx->functions = NULL;
+    ctx->nb_functions = 0;
+    ctx->idle_cb = modbus_idle_default;
 
     ctx->response_timeout.tv_sec = 0;
     ctx->response_timeout.tv_usec = _RESPONSE_TIMEOUT;
 
     ctx->byte_timeout.tv_sec = 0;
     ctx->byte_timeout.tv_usec = _BYTE_TIMEOUT;
+
+    ctx->parser.length_to_read = 0;
+    ctx->transactions = &ctx->transaction;
+    ctx->max_transactions = 1;
+    ctx->transaction.req_length = 0;
+    ctx->nb_transactions = 0;
 }
 
 /* Define the slave number */
@@ -1720,6 +3378,13 @@ int modbus_set_slave(modbus_t *ctx, int slave)
         return -1;
     }
 
+    /* The RTU confirmations are filtered on the slave */
+    if (ctx->nb_transactions != 0 &&
+        ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_RTU) {
+        errno = EBUSY;
+        return -1;
+    }
+
     return ctx->backend->set_slave(ctx, slave);
 }
 
@@ -1751,6 +3416,34 @@ int modbus_set_error_recovery(modbus_t *ctx,
     return 0;
 }
 
+int modbus_set_receive_mode(modbus_t *ctx, modbus_receive_mode mode)
+{
+    if (ctx == NULL ||
+        (mode != MODBUS_RECEIVE_STEPWISE && mode != MODBUS_RECEIVE_ADU)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->receive_mode = mode;
+    return 0;
+}
+
+/* Selects how the server gets rid of the rest of a request with an illegal
+   function or quantity before replying with an exception. */
+int modbus_set_exception_recovery(modbus_t *ctx,
+                                  modbus_exception_recovery_mode exception_recovery)
+{
+    if (ctx == NULL ||
+        (exception_recovery != MODBUS_EXCEPTION_RECOVERY_FLUSH &&
+         exception_recovery != MODBUS_EXCEPTION_RECOVERY_DISCARD)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->exception_recovery = exception_recovery;
+    return 0;
+}
+
 int modbus_set_socket(modbus_t *ctx, int s)
 {
     if (ctx == NULL) {
@@ -1841,6 +3534,8 @@ int modbus_connect(modbus_t *ctx)
         return -1;
     }
 
+    ctx->parser.length_to_read = 0;
+    transactions_clear(ctx);
     return ctx->backend->connect(ctx);
 }
 
@@ -1857,6 +3552,10 @@ void modbus_free(modbus_t *ctx)
     if (ctx == NULL)
         return;
 
+    free(ctx->functions);
+    if (ctx->transactions != &ctx->transaction) {
+        free(ctx->transactions);
+    }
     ctx->backend->free(ctx);
 }
 
@@ -1891,6 +3590,12 @@ modbus_mapping_t* modbus_mapping_new_start_address(
     }
 
     /* 0X */
+    mb_mapping->flags = 0;
+    memset(mb_mapping->segments, 0, sizeof(mb_mapping->segments));
+    memset(mb_mapping->nb_segments, 0, sizeof(mb_mapping->nb_segments));
+    memset(mb_mapping->pages, 0, sizeof(mb_mapping->pages));
+    memset(mb_mapping->sequences, 0, sizeof(mb_mapping->sequences));
+
     mb_mapping->nb_bits = nb_bits;
     mb_mapping->start_bits = start_bits;
     if (nb_bits == 0) {
@@ -1968,13 +3673,19 @@ modbus_mapping_t* modbus_mapping_new(int nb_bits, int nb_input_bits,
         0, nb_bits, 0, nb_input_bits, 0, nb_registers, 0, nb_input_registers);
 }
 
-/* Frees the 4 arrays */
+/* Frees the 4 arrays, the segments and the pages */
 void modbus_mapping_free(modbus_mapping_t *mb_mapping)
 {
+    int table;
+
     if (mb_mapping == NULL) {
         return;
     }
 
+    for (table = 0; table < MODBUS_TABLE_MAX; table++) {
+        modbus_mapping_remove_segments(mb_mapping, (modbus_table_t)table);
+        modbus_mapping_disable_paging(mb_mapping, (modbus_table_t)table);
+    }
     free(mb_mapping->tab_input_registers);
     free(mb_mapping->tab_registers);
     free(mb_mapping->tab_input_bits);
@@ -1982,6 +3693,417 @@ void modbus_mapping_free(modbus_mapping_t *mb_mapping)
     free(mb_mapping);
 }
 
+/* Main block of a table */
+static void *mapping_block(const modbus_mapping_t *mb_mapping,
+                           modbus_table_t table, int *start, int *nb)
+{
+    switch (table) {
+    case MODBUS_TABLE_BITS:
+        *start = mb_mapping->start_bits;
+        *nb = mb_mapping->nb_bits;
+        return mb_mapping->tab_bits;
+    case MODBUS_TABLE_INPUT_BITS:
+        *start = mb_mapping->start_input_bits;
+        *nb = mb_mapping->nb_input_bits;
+        return mb_mapping->tab_input_bits;
+    case MODBUS_TABLE_INPUT_REGISTERS:
+        *start = mb_mapping->start_input_registers;
+        *nb = mb_mapping->nb_input_registers;
+        return mb_mapping->tab_input_registers;
+    default:
+        *start = mb_mapping->start_registers;
+        *nb = mb_mapping->nb_registers;
+        return mb_mapping->tab_registers;
+    }
+}
+
+/* Adds a block of nb addresses from start to a table, in addition to the
+   main block (start_xxx, nb_xxx and tab_xxx) and the other segments. The
+   storage is allocated and cleared here.
+
+   Returns 0 on success, otherwise -1 with errno set to EINVAL when the block
+   overlaps an existing one or to ENOMEM. */
+int modbus_mapping_add_segment(modbus_mapping_t *mb_mapping,
+                               modbus_table_t table, int start, int nb)
+{
+    modbus_segment_t *segments;
+    int n;
+    int block_start;
+    int block_nb;
+    size_t size;
+    void *tab;
+    int i;
+
+    if (mb_mapping == NULL || table < 0 || table >= MODBUS_TABLE_MAX ||
+        start < 0 || nb < 1 || (long)start + nb > 0x10000L) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mapping_block(mb_mapping, table, &block_start, &block_nb);
+    if (block_nb > 0 && start < block_start + block_nb &&
+        block_start < start + nb) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Sorted insertion */
+    n = mb_mapping->nb_segments[table];
+    segments = mb_mapping->segments[table];
+    for (i = 0; i < n && segments[i].start < start; i++)
+        ;
+    if ((i > 0 && segments[i - 1].start + segments[i - 1].nb > start) ||
+        (i < n && start + nb > segments[i].start)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (table == MODBUS_TABLE_BITS || table == MODBUS_TABLE_INPUT_BITS) {
+        int packed = mb_mapping->flags &
+            (table == MODBUS_TABLE_BITS ? MODBUS_MAPPING_PACKED_BITS :
+                                          MODBUS_MAPPING_PACKED_INPUT_BITS);
+        size = packed ? (nb + 7) / 8 : nb;
+    } else {
+        size = nb * sizeof(uint16_t);
+    }
+
+    tab = malloc(size);
+    if (tab == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(tab, 0, size);
+
+    segments = (modbus_segment_t *)realloc(segments,
+                                           (n + 1) * sizeof(modbus_segment_t));
+    if (segments == NULL) {
+        free(tab);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memmove(&segments[i + 1], &segments[i], (n - i) * sizeof(modbus_segment_t));
+    segments[i].start = start;
+    segments[i].nb = nb;
+    segments[i].tab = tab;
+    mb_mapping->segments[table] = segments;
+    mb_mapping->nb_segments[table] = n + 1;
+
+    return 0;
+}
+
+/* Frees the segments of a table, the main block is kept */
+void modbus_mapping_remove_segments(modbus_mapping_t *mb_mapping,
+                                    modbus_table_t table)
+{
+    int i;
+
+    if (mb_mapping == NULL || table < 0 || table >= MODBUS_TABLE_MAX) {
+        return;
+    }
+
+    for (i = 0; i < mb_mapping->nb_segments[table]; i++) {
+        free(mb_mapping->segments[table][i].tab);
+    }
+    free(mb_mapping->segments[table]);
+    mb_mapping->segments[table] = NULL;
+    mb_mapping->nb_segments[table] = 0;
+}
+
+/* Makes the table span the whole address space. The storage is split in
+   pages of MODBUS_PAGE_SIZE addresses, allocated on the first write (or by
+   modbus_mapping_touch()), the untouched pages read as zero. The main block
+   and the segments of the table aren't used anymore.
+
+   Returns 0 on success, -1 with errno set to ENOMEM otherwise. */
+int modbus_mapping_enable_paging(modbus_mapping_t *mb_mapping,
+                                 modbus_table_t table)
+{
+    size_t size = (0x10000L / MODBUS_PAGE_SIZE) * sizeof(void *);
+
+    if (mb_mapping == NULL || table < 0 || table >= MODBUS_TABLE_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (mb_mapping->pages[table] != NULL) {
+        return 0;
+    }
+
+    mb_mapping->pages[table] = (void **)malloc(size);
+    if (mb_mapping->pages[table] == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(mb_mapping->pages[table], 0, size);
+
+    return 0;
+}
+
+/* Frees the pages of a table */
+void modbus_mapping_disable_paging(modbus_mapping_t *mb_mapping,
+                                   modbus_table_t table)
+{
+    int page;
+
+    if (mb_mapping == NULL || table < 0 || table >= MODBUS_TABLE_MAX ||
+        mb_mapping->pages[table] == NULL) {
+        return;
+    }
+
+    for (page = 0; page < 0x10000L / MODBUS_PAGE_SIZE; page++) {
+        free(mb_mapping->pages[table][page]);
+    }
+    free(mb_mapping->pages[table]);
+    mb_mapping->pages[table] = NULL;
+}
+
+/* Sequence lock of a table: the application threads can update the values
+   while modbus_reply() serves them from another thread. The readers never
+   block the writers and copy the values again when an update happened
+   meanwhile.
+
+   The microcontrollers have a single core: the updates run with the
+   interrupts disabled, so no reader or other writer can preempt them and a
+   reader never finds an update in progress. Elsewhere, the writers are
+   serialized on the sequence counter with atomic operations, when the
+   target provides them lock-free (the others are assumed to have no
+   threads). */
+#if defined(ARDUINO) && (defined(__arm__) || defined(__AVR__))
+#define _MODBUS_SEQ_IRQ
+#if defined(__arm__)
+static inline unsigned int _modbus_irq_save(void)
+{
+    unsigned int primask;
+
+    __asm__ volatile ("mrs %0, primask\n\tcpsid i" : "=r" (primask) : : "memory");
+    return primask;
+}
+
+static inline void _modbus_irq_restore(unsigned int primask)
+{
+    __asm__ volatile ("msr primask, %0" : : "r" (primask) : "memory");
+}
+#else
+static inline unsigned int _modbus_irq_save(void)
+{
+    unsigned int sreg = SREG;
+
+    cli();
+    __asm__ volatile ("" : : : "memory");
+    return sreg;
+}
+
+static inline void _modbus_irq_restore(unsigned int sreg)
+{
+    __asm__ volatile ("" : : : "memory");
+    SREG = sreg;
+}
+#endif
+#define _MODBUS_SEQ_LOAD(p) (*(volatile unsigned int *)(p))
+#define _MODBUS_SEQ_FENCE() __asm__ volatile ("" : : : "memory")
+#elif defined(__GCC_ATOMIC_INT_LOCK_FREE) && __GCC_ATOMIC_INT_LOCK_FREE == 2
+#define _MODBUS_SEQ_ATOMIC
+#define _MODBUS_SEQ_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define _MODBUS_SEQ_FENCE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#else
+#define _MODBUS_SEQ_LOAD(p) (*(volatile unsigned int *)(p))
+#define _MODBUS_SEQ_FENCE()
+#endif
+
+/* Installs a page allocated by modbus_mapping_touch(), returns FALSE when
+   another thread did it first */
+static int mapping_publish_page(void **slot, void *page)
+{
+#if defined(_MODBUS_SEQ_IRQ)
+    unsigned int irq = _modbus_irq_save();
+    int published = (*slot == NULL);
+
+    if (published) {
+        *slot = page;
+    }
+    _modbus_irq_restore(irq);
+
+    return published;
+#elif defined(_MODBUS_SEQ_ATOMIC)
+    void *expected = NULL;
+
+    return __atomic_compare_exchange_n(slot, &expected, page, FALSE,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+#else
+    *slot = page;
+
+    return TRUE;
+#endif
+}
+
+/* Starts an update of a table, the values written up to
+   modbus_mapping_write_end() are seen all together by the readers. The
+   update must be short: it spins while another update is in progress and
+   runs with the interrupts disabled on the microcontrollers. The pages to
+   write must be allocated beforehand (modbus_mapping_touch()). */
+void modbus_mapping_write_begin(modbus_mapping_t *mb_mapping,
+                                modbus_table_t table)
+{
+    unsigned int *p = &mb_mapping->sequences[table];
+#if defined(_MODBUS_SEQ_IRQ)
+    mb_mapping->irq_states[table] = _modbus_irq_save();
+    ++*(volatile unsigned int *)p;
+#elif defined(_MODBUS_SEQ_ATOMIC)
+    unsigned int sequence;
+
+    do {
+        sequence = _MODBUS_SEQ_LOAD(p) & ~1U;
+    } while (!__atomic_compare_exchange_n(p, &sequence, sequence + 1, FALSE,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    /* The counter is odd before any value is written */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+#else
+    ++*(volatile unsigned int *)p;
+#endif
+}
+
+void modbus_mapping_write_end(modbus_mapping_t *mb_mapping,
+                              modbus_table_t table)
+{
+    unsigned int *p = &mb_mapping->sequences[table];
+#if defined(_MODBUS_SEQ_IRQ)
+    ++*(volatile unsigned int *)p;
+    _modbus_irq_restore(mb_mapping->irq_states[table]);
+#elif defined(_MODBUS_SEQ_ATOMIC)
+    __atomic_add_fetch(p, 1, __ATOMIC_RELEASE);
+#else
+    ++*(volatile unsigned int *)p;
+#endif
+}
+
+/* Returns the sequence to give to modbus_mapping_read_retry() once the
+   values are copied, waits for the end of the update in progress (never on
+   the microcontrollers) */
+unsigned int modbus_mapping_read_begin(modbus_mapping_t *mb_mapping,
+                                       modbus_table_t table)
+{
+    unsigned int sequence;
+
+    do {
+        sequence = _MODBUS_SEQ_LOAD(&mb_mapping->sequences[table]);
+    } while (sequence & 1);
+
+    return sequence;
+}
+
+/* Returns TRUE when the table has been updated since
+   modbus_mapping_read_begin(), the values copied must be copied again */
+int modbus_mapping_read_retry(modbus_mapping_t *mb_mapping,
+                              modbus_table_t table, unsigned int sequence)
+{
+    _MODBUS_SEQ_FENCE();
+    return _MODBUS_SEQ_LOAD(&mb_mapping->sequences[table]) != sequence;
+}
+
+/* Allocates the missing pages of the nb addresses from address, nothing to
+   do when the table isn't paged. It's called before the update writing
+   them, several threads can allocate the pages of a table at once.
+
+   Returns 0 on success, -1 with errno set to ENOMEM otherwise. */
+int modbus_mapping_touch(modbus_mapping_t *mb_mapping,
+                         modbus_table_t table, int address, int nb)
+{
+    void **pages;
+    size_t size;
+    unsigned int page;
+    unsigned int last;
+
+    if (mb_mapping == NULL || table < 0 || table >= MODBUS_TABLE_MAX ||
+        nb < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pages = mb_mapping->pages[table];
+    if (pages == NULL) {
+        return 0;
+    }
+
+    if (table == MODBUS_TABLE_BITS || table == MODBUS_TABLE_INPUT_BITS) {
+        int packed = mb_mapping->flags &
+            (table == MODBUS_TABLE_BITS ? MODBUS_MAPPING_PACKED_BITS :
+                                          MODBUS_MAPPING_PACKED_INPUT_BITS);
+        size = packed ? MODBUS_PAGE_SIZE / 8 : MODBUS_PAGE_SIZE;
+    } else {
+        size = MODBUS_PAGE_SIZE * sizeof(uint16_t);
+    }
+
+    last = (uint16_t)(address + nb - 1) / MODBUS_PAGE_SIZE;
+    for (page = (uint16_t)address / MODBUS_PAGE_SIZE; page <= last; page++) {
+        if (pages[page] == NULL) {
+            void *tab = malloc(size);
+
+            if (tab == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            memset(tab, 0, size);
+            if (!mapping_publish_page(&pages[page], tab)) {
+                free(tab);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Finds the storage of an address: in its page for a paged table, otherwise
+   in the main block, then by binary search in the segments of the table.
+
+   Returns the number of contiguous addresses stored from address (tab and
+   index are set to the storage and the index of address in it), 0 when the
+   address isn't mapped. tab is NULL for an untouched page. */
+int modbus_mapping_locate(const modbus_mapping_t *mb_mapping,
+                          modbus_table_t table, int address,
+                          void **tab, int *index)
+{
+    const modbus_segment_t *segments;
+    int start;
+    int nb;
+    int low;
+    int high;
+
+    if (mb_mapping->pages[table] != NULL) {
+        if ((unsigned int)address > 0xFFFF) {
+            return 0;
+        }
+        *tab = mb_mapping->pages[table][(uint16_t)address / MODBUS_PAGE_SIZE];
+        *index = (uint16_t)address % MODBUS_PAGE_SIZE;
+        return MODBUS_PAGE_SIZE - *index;
+    }
+
+    *tab = mapping_block(mb_mapping, table, &start, &nb);
+    if (address >= start && address < start + nb) {
+        *index = address - start;
+        return start + nb - address;
+    }
+
+    segments = mb_mapping->segments[table];
+    low = 0;
+    high = mb_mapping->nb_segments[table];
+    while (low < high) {
+        int middle = (low + high) / 2;
+
+        if (address < segments[middle].start) {
+            high = middle;
+        } else if (address >= segments[middle].start + segments[middle].nb) {
+            low = middle + 1;
+        } else {
+            *tab = segments[middle].tab;
+            *index = address - segments[middle].start;
+            return segments[middle].start + segments[middle].nb - address;
+        }
+    }
+
+    return 0;
+}
+
 #ifndef HAVE_STRLCPY
 /*
  * Function strlcpy was originally developed by
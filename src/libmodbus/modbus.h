@@ -151,14 +151,29 @@ extern const unsigned int libmodbus_version_minor;
 extern const unsigned int libmodbus_version_micro;
 
 typedef struct _modbus modbus_t;
+/* Parsing state of a request partially received, see modbus_swap_parser() */
+typedef struct _modbus_parser modbus_parser_t;
 
 typedef void (*modbus_event_cb_t) (int device_addr, int function, int address);
+/* Called while a backend waits for the line, remaining_us is the time left
+   before the wait times out */
+typedef void (*modbus_idle_cb_t) (modbus_t *ctx, unsigned long remaining_us);
 typedef void (*modbus_write_single_coil_cb_t) (int addr, uint16_t value);
 typedef int (*modbus_read_coils_cb_t) (uint8_t *rsp, int16_t rsp_length, uint16_t addr, uint16_t nb);
 typedef void (*modbus_happened_cb_t) (int device_addr, int function, int address, int value);
+/* Builds the response to a read holding registers request from rsp_length
+   and returns the number of bytes added. tab_registers is a copy of the nb
+   registers from addr in host byte order, whatever the storage of the table
+   (MODBUS_MAPPING_WIRE_ORDER_REGISTERS), tab_register_start_offset is 0. */
 typedef int (*modbus_read_holding_registers_cb_t) (uint8_t *rsp, int16_t rsp_length, uint16_t addr, uint16_t nb, uint16_t *tab_registers, int tab_register_start_offset);
+/* Builds the whole response to a write single register request (from
+   rsp_length 0). tab_registers is a copy of the register at addr in host
+   byte order, as for the read callback, tab_register_start_offset is 0: the
+   value left there is written to the mapping once the callback returns. */
 typedef void (*modbus_write_single_register_cb_t) (uint8_t *rsp, int16_t rsp_length, uint16_t addr, uint16_t value, uint16_t *tab_registers, int tab_register_start_offset);
 
+/* The callbacks are called by modbus_reply() without any table locked, so
+   they can read and update the mapping (see modbus_mapping_write_begin()) */
 typedef struct {
     modbus_event_cb_t event_cb;
     modbus_happened_cb_t happened_cb;
@@ -169,6 +184,24 @@ typedef struct {
 
 } callback_mapping_t;
 
+/* Tables of a modbus_mapping_t */
+typedef enum
+{
+    MODBUS_TABLE_BITS = 0,
+    MODBUS_TABLE_INPUT_BITS,
+    MODBUS_TABLE_INPUT_REGISTERS,
+    MODBUS_TABLE_REGISTERS,
+    MODBUS_TABLE_MAX
+} modbus_table_t;
+
+/* Additional block of addresses of a table, see modbus_mapping_add_segment() */
+typedef struct {
+    int start;
+    int nb;
+    /* uint8_t for bits (packed or not), uint16_t for registers */
+    void *tab;
+} modbus_segment_t;
+
 typedef struct {
     int nb_bits;
     int start_bits;
@@ -182,8 +215,65 @@ typedef struct {
     uint8_t *tab_input_bits;
     uint16_t *tab_input_registers;
     uint16_t *tab_registers;
+    int flags;
+    /* Additional blocks of each table (modbus_table_t), sorted by address */
+    modbus_segment_t *segments[MODBUS_TABLE_MAX];
+    int nb_segments[MODBUS_TABLE_MAX];
+    /* Page directories of the tables spanning the whole address space, see
+       modbus_mapping_enable_paging() */
+    void **pages[MODBUS_TABLE_MAX];
+    /* Sequence counters of the tables, odd while an update is in progress,
+       see modbus_mapping_write_begin() */
+    unsigned int sequences[MODBUS_TABLE_MAX];
+    /* Interrupt states saved by modbus_mapping_write_begin() on the
+       microcontrollers */
+    unsigned int irq_states[MODBUS_TABLE_MAX];
 } modbus_mapping_t;
 
+/* modbus_mapping_t flags: tab_bits/tab_input_bits store one bit per coil or
+   discrete input (LSB first, same layout as on the wire) instead of one byte.
+   The segments of the table use the same layout so the flag can't change
+   once segments are added. */
+#define MODBUS_MAPPING_PACKED_BITS          (1<<0)
+#define MODBUS_MAPPING_PACKED_INPUT_BITS    (1<<1)
+/* Reading an untouched page of a paged table replies an illegal data address
+   exception instead of zeros */
+#define MODBUS_MAPPING_STRICT_PAGES         (1<<2)
+/* tab_registers/tab_input_registers store the registers in network byte
+   order (big-endian, as on the wire) so the requests are served by memcpy.
+   Access them with MODBUS_GET_WIRE_REGISTER/MODBUS_SET_WIRE_REGISTER. As the
+   packed flags, they can't change once segments or pages are allocated. */
+#define MODBUS_MAPPING_WIRE_ORDER_REGISTERS         (1<<3)
+#define MODBUS_MAPPING_WIRE_ORDER_INPUT_REGISTERS   (1<<4)
+
+/* Number of bits or registers of a page of a paged table */
+#define MODBUS_PAGE_SIZE 256
+
+/* Builds the response of a function code after the header and the function
+   code already written in rsp (rsp_length bytes). rsp may be req
+   (modbus_reply_in_place()), so the request must be read before the response
+   is written over it. Returns the length of the response or -1 with errno set
+   to EMBX* to reply with that exception. MODBUS_REPLY_TRUNCATED, with errno
+   set as well, tells the indication may have been received truncated (bad
+   quantity or byte count): the rest of it is flushed before replying. */
+#define MODBUS_REPLY_TRUNCATED (-2)
+
+typedef int (*modbus_reply_cb_t)(modbus_t *ctx, const uint8_t *req,
+                                 int req_length, modbus_mapping_t *mb_mapping,
+                                 uint8_t *rsp, int rsp_length);
+
+/* Framing and handling of a function code. The meta length is the number of
+   bytes following the function code (address, quantity, byte count...); the
+   count offset, when not 0, is the position in that meta information of the
+   byte giving the number of data bytes that follow. */
+typedef struct {
+    uint8_t indication_meta_length;
+    uint8_t indication_count_offset;
+    uint8_t confirmation_meta_length;
+    uint8_t confirmation_count_offset;
+    modbus_reply_cb_t reply;
+} modbus_function_t;
+
 typedef enum
 {
     MODBUS_ERROR_RECOVERY_NONE          = 0,
@@ -191,14 +281,36 @@ typedef enum
     MODBUS_ERROR_RECOVERY_PROTOCOL      = (1<<2)
 } modbus_error_recovery_mode;
 
+typedef enum
+{
+    /* Read the function code, the meta information and the data in three
+       separate steps */
+    MODBUS_RECEIVE_STEPWISE             = 0,
+    /* Read as much of the ADU as is known to belong to the frame at once */
+    MODBUS_RECEIVE_ADU
+} modbus_receive_mode;
+
+typedef enum
+{
+    /* Wait for the response timeout then flush the link before replying to
+       a request with an illegal function or quantity */
+    MODBUS_EXCEPTION_RECOVERY_FLUSH     = 0,
+    /* Only drop the rest of the bad request and reply immediately */
+    MODBUS_EXCEPTION_RECOVERY_DISCARD
+} modbus_exception_recovery_mode;
+
 MODBUS_API int modbus_set_slave(modbus_t* ctx, int slave);
 MODBUS_API int modbus_get_slave(modbus_t* ctx);
 MODBUS_API int modbus_set_error_recovery(modbus_t *ctx, modbus_error_recovery_mode error_recovery);
+MODBUS_API int modbus_set_receive_mode(modbus_t *ctx, modbus_receive_mode mode);
+MODBUS_API int modbus_set_exception_recovery(modbus_t *ctx, modbus_exception_recovery_mode exception_recovery);
 MODBUS_API int modbus_set_socket(modbus_t *ctx, int s);
 MODBUS_API int modbus_get_socket(modbus_t *ctx);
 
 MODBUS_API int modbus_set_event_callback(modbus_t* ctx, modbus_event_cb_t cb);
 MODBUS_API int modbus_set_callbacks(modbus_t* ctx, callback_mapping_t* callbacks);
+MODBUS_API int modbus_set_idle_callback(modbus_t *ctx, modbus_idle_cb_t idle_cb);
+MODBUS_API void modbus_idle_default(modbus_t *ctx, unsigned long remaining_us);
 
 MODBUS_API int modbus_get_response_timeout(modbus_t *ctx, uint32_t *to_sec, uint32_t *to_usec);
 MODBUS_API int modbus_set_response_timeout(modbus_t *ctx, uint32_t to_sec, uint32_t to_usec);
@@ -241,17 +353,62 @@ MODBUS_API modbus_mapping_t* modbus_mapping_new_start_address(
 MODBUS_API modbus_mapping_t* modbus_mapping_new(int nb_bits, int nb_input_bits,
                                                 int nb_registers, int nb_input_registers);
 MODBUS_API void modbus_mapping_free(modbus_mapping_t *mb_mapping);
+MODBUS_API int modbus_mapping_add_segment(modbus_mapping_t *mb_mapping,
+                                          modbus_table_t table,
+                                          int start, int nb);
+MODBUS_API void modbus_mapping_remove_segments(modbus_mapping_t *mb_mapping,
+                                               modbus_table_t table);
+MODBUS_API int modbus_mapping_enable_paging(modbus_mapping_t *mb_mapping,
+                                           modbus_table_t table);
+MODBUS_API void modbus_mapping_disable_paging(modbus_mapping_t *mb_mapping,
+                                              modbus_table_t table);
+MODBUS_API int modbus_mapping_touch(modbus_mapping_t *mb_mapping,
+                                    modbus_table_t table, int address, int nb);
+MODBUS_API void modbus_mapping_write_begin(modbus_mapping_t *mb_mapping,
+                                           modbus_table_t table);
+MODBUS_API void modbus_mapping_write_end(modbus_mapping_t *mb_mapping,
+                                         modbus_table_t table);
+MODBUS_API unsigned int modbus_mapping_read_begin(modbus_mapping_t *mb_mapping,
+                                                  modbus_table_t table);
+MODBUS_API int modbus_mapping_read_retry(modbus_mapping_t *mb_mapping,
+                                         modbus_table_t table,
+                                         unsigned int sequence);
+MODBUS_API int modbus_mapping_locate(const modbus_mapping_t *mb_mapping,
+                                     modbus_table_t table, int address,
+                                     void **tab, int *index);
 
 MODBUS_API int modbus_send_raw_request(modbus_t *ctx, uint8_t *raw_req, int raw_req_length);
 
 MODBUS_API int modbus_receive(modbus_t *ctx, uint8_t *req);
+MODBUS_API int modbus_receive_poll(modbus_t *ctx, uint8_t *req);
+MODBUS_API modbus_parser_t* modbus_parser_new(void);
+MODBUS_API void modbus_parser_free(modbus_parser_t *parser);
+MODBUS_API int modbus_swap_parser(modbus_t *ctx, modbus_parser_t *parser);
 
 MODBUS_API int modbus_receive_confirmation(modbus_t *ctx, uint8_t *rsp);
 
+MODBUS_API int modbus_set_max_transactions(modbus_t *ctx, int nb);
+MODBUS_API int modbus_send_transaction(modbus_t *ctx, int function, int addr,
+                                       int nb, const void *src, void *dest);
+MODBUS_API int modbus_send_raw_transaction(modbus_t *ctx, const uint8_t *raw_req,
+                                           int raw_req_length);
+MODBUS_API int modbus_poll_transactions(modbus_t *ctx, uint8_t *rsp, int *t_id);
+MODBUS_API int modbus_send_request(modbus_t *ctx, int function, int addr,
+                                   int nb, const void *src);
+MODBUS_API int modbus_poll_confirmation(modbus_t *ctx, uint8_t *rsp, void *dest);
+MODBUS_API int modbus_wait_confirmation(modbus_t *ctx, uint8_t *rsp, void *dest);
+
 MODBUS_API int modbus_reply(modbus_t *ctx, const uint8_t *req,
                             int req_length, modbus_mapping_t *mb_mapping);
+MODBUS_API int modbus_reply_in_place(modbus_t *ctx, uint8_t *req,
+                                     int req_length, modbus_mapping_t *mb_mapping);
+MODBUS_API int modbus_reply_build(modbus_t *ctx, const uint8_t *req,
+                                  int req_length, modbus_mapping_t *mb_mapping,
+                                  uint8_t *rsp);
 MODBUS_API int modbus_reply_exception(modbus_t *ctx, const uint8_t *req,
                                       unsigned int exception_code);
+MODBUS_API int modbus_set_function(modbus_t *ctx, int function,
+                                   const modbus_function_t *def);
 
 /**
  * UTILS FUNCTIONS
@@ -266,6 +423,25 @@ MODBUS_API int modbus_reply_exception(modbus_t *ctx, const uint8_t *req,
       (int64_t)tab_int16[(index) + 3])
 #define MODBUS_GET_INT32_FROM_INT16(tab_int16, index) ((tab_int16[(index)] << 16) + tab_int16[(index) + 1])
 #define MODBUS_GET_INT16_FROM_INT8(tab_int8, index) ((tab_int8[(index)] << 8) + tab_int8[(index) + 1])
+#define MODBUS_GET_PACKED_BIT(tab_bits, index) \
+    (((tab_bits)[(index) >> 3] >> ((index) & 7)) & 1)
+#define MODBUS_SET_PACKED_BIT(tab_bits, index, value) \
+    do { \
+        if (value) \
+            (tab_bits)[(index) >> 3] |= (1 << ((index) & 7)); \
+        else \
+            (tab_bits)[(index) >> 3] &= ~(1 << ((index) & 7)); \
+    } while (0)
+
+/* Register index of a table stored in network byte order */
+#define MODBUS_GET_WIRE_REGISTER(tab_registers, index) \
+    ((uint16_t)(((const uint8_t *)(tab_registers))[2 * (index)] << 8 | \
+                ((const uint8_t *)(tab_registers))[2 * (index) + 1]))
+#define MODBUS_SET_WIRE_REGISTER(tab_registers, index, value) \
+    do { \
+        ((uint8_t *)(tab_registers))[2 * (index)] = (uint16_t)(value) >> 8; \
+        ((uint8_t *)(tab_registers))[2 * (index) + 1] = (value) & 0xFF; \
+    } while (0)
 #define MODBUS_SET_INT16_TO_INT8(tab_int8, index, value) \
     do { \
         tab_int8[(index)] = (value) >> 8;  \
@@ -288,6 +464,10 @@ MODBUS_API void modbus_set_bits_from_byte(uint8_t *dest, int idx, const uint8_t
 MODBUS_API void modbus_set_bits_from_bytes(uint8_t *dest, int idx, unsigned int nb_bits,
                                        const uint8_t *tab_byte);
 MODBUS_API uint8_t modbus_get_byte_from_bits(const uint8_t *src, int idx, unsigned int nb_bits);
+MODBUS_API void modbus_get_packed_bits(const uint8_t *src, int idx, unsigned int nb_bits,
+                                       uint8_t *dest);
+MODBUS_API void modbus_set_packed_bits(uint8_t *dest, int idx, unsigned int nb_bits,
+                                       const uint8_t *src);
 MODBUS_API float modbus_get_float(const uint16_t *src);
 MODBUS_API float modbus_get_float_abcd(const uint16_t *src);
 MODBUS_API float modbus_get_float_dcba(const uint16_t *src);